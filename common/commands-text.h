@@ -11,7 +11,10 @@
 #include "commands.h"
 
 //! Returns the name of a PowerUnit given its ID
-inline const char * ConvertPUID(char id)
+/*!
+ *  Unsigned, since PU_ALL is 0xFF
+ */
+inline const char * ConvertPUID(unsigned char id)
 {
     switch (id)
     {
@@ -21,6 +24,8 @@ inline const char * ConvertPUID(char id)
         return "Light 2";
     case PU_RECEPTACLE:
         return "Receptacle";
+    case PU_ALL:
+        return "All units";
     }
 
     return "Unknown";
@@ -43,6 +48,14 @@ inline const char * ConvertMCError(char error)
         return "No dimmer available";
     case RES_NOGENCLOCK:
         return "No general-purpose clock available";
+    case RES_NOSCENE:
+        return "No scene stored in that slot";
+    case RES_TOOLATE:
+        return "Scheduled time has already passed";
+    case RES_QUEUEFULL:
+        return "Too many scheduled commands";
+    case RES_BADCRC:
+        return "Command failed its CRC check";
     case RES_FAILURE:
         return "Other failure";
     }
@@ -64,6 +77,36 @@ inline const char * ConvertCommandID(char cmd)
         return "Change level";
     case COM_INFO:
         return "Get info";
+    case COM_BATCH:
+        return "Change many levels";
+    case COM_INFO_DELTA:
+        return "Get changed info";
+    case COM_SUBSCRIBE:
+        return "Subscribe to status";
+    case COM_FADE:
+        return "Fade to level";
+    case COM_SCENE_STORE:
+        return "Store scene";
+    case COM_SCENE_RECALL:
+        return "Recall scene";
+    case COM_SCENE_BOOT:
+        return "Set boot scene";
+    case COM_SCHEDULE:
+        return "Schedule levels";
+    case COM_CAPS:
+        return "Get capabilities";
+    case COM_BAUD:
+        return "Change baud rate";
+    case COM_CRC:
+        return "Set CRC mode";
+    case COM_STATS:
+        return "Get performance counters";
+    case COM_MAINS:
+        return "Get mains statistics";
+    case COM_ZC_HISTORY:
+        return "Get zero-crossing history";
+    case COM_STATUS:
+        return "Status";
     }
     return "Unknown";
 }
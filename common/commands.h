@@ -10,9 +10,60 @@
 #define COMMANDS_H
 
 /* Number of dimmers and powerunits */
+/* The dimmers are slots in the firing scheduler rather than */
+/* timer channels, so DIMMER_COUNT may be raised as needed */
 #define DIMMER_COUNT 6
 #define PU_COUNT 3
-#define INFO_SIZE (4+4*DIMMER_COUNT+3*PU_COUNT) 
+
+/* Size of the COM_INFO response: the zero-crossing stamps (2 bytes */
+/* each, low first) and the half-cycle count (4 bytes, low first, see */
+/* COM_SCHEDULE), followed by each dimmer and then each powerunit */
+/*  dimmer: powerunit id, level, compare value (2 bytes, low first) */
+/*  powerunit: id, state, level, fade target, half-cycles left */
+/*             in the fade (2 bytes, low first, zero if not fading) */
+#define INFO_ZC_SIZE 8
+#define INFO_DIMMER_SIZE 4
+#define INFO_PU_SIZE 6
+#define INFO_SIZE (INFO_ZC_SIZE+INFO_DIMMER_SIZE*DIMMER_COUNT+INFO_PU_SIZE*PU_COUNT) 
+
+/* COM_INFO_DELTA takes the version (2 bytes, low first) of the last */
+/* info the PC has, or zero for everything. The response is the current */
+/* version (2 bytes), the zero-crossing stamps and count, a bitmap of changed fields */
+/* (dimmers first, then powerunits), then the COM_INFO fields for each */
+/* bit that is set */
+#define INFO_BITMAP_SIZE ((DIMMER_COUNT+PU_COUNT+7)/8)
+#define INFO_DELTA_MAX (2+INFO_BITMAP_SIZE+INFO_SIZE)
+
+/* Size of the microcontroller's command buffer (in bytes) */
+/* The PC must not have more than this many bytes of commands */
+/* waiting for a response. Must be less than or equal to 256 */
+#define CMDBUF_SIZE 64
+
+/* Version of the protocol in this file, returned by COM_CAPS */
+#define PROTOCOL_VERSION 1
+
+/* Feature bits returned by COM_CAPS */
+#define FEAT_SEQ        0x0001  /* FRAME_START_SEQ */
+#define FEAT_BATCH      0x0002  /* COM_BATCH */
+#define FEAT_INFO_DELTA 0x0004  /* COM_INFO_DELTA */
+#define FEAT_SUBSCRIBE  0x0008  /* COM_SUBSCRIBE */
+#define FEAT_FADE       0x0010  /* COM_FADE */
+#define FEAT_SCENES     0x0020  /* COM_SCENE_* */
+#define FEAT_SCHEDULE   0x0040  /* COM_SCHEDULE */
+#define FEAT_BAUD       0x0080  /* COM_BAUD */
+#define FEAT_CRC        0x0100  /* FRAME_START_CRC and COM_CRC */
+#define FEAT_STATS      0x0200  /* COM_STATS */
+#define FEAT_MAINS      0x0400  /* COM_MAINS and COM_ZC_HISTORY */
+
+/* Baud rates for COM_BAUD. BAUD_DEFAULT is the rate the */
+/* microcontroller starts at (38400) */
+#define BAUD_DEFAULT   0
+#define BAUD_57600     1
+#define BAUD_115200    2
+#define BAUD_250000    3
+#define BAUD_500000    4
+#define BAUD_1000000   5
+#define BAUD_COUNT     6
 
 /* IDs for the power units */
 /* These always start at 1 */
@@ -20,17 +71,187 @@
 #define PU_LIGHT2      2
 #define PU_RECEPTACLE  3
 
+/* Refers to all of the power units at once (COM_BATCH only) */
+#define PU_ALL         0xFF
+
 /* States  of the powerunits */
 #define PUSTATE_OFF    1
 #define PUSTATE_ON     2
 #define PUSTATE_DIM    3
 
+/* Start bytes of a command */
+/*  A command is FRAME_START, command, arguments... */
+/*  or FRAME_START_SEQ, sequence, command, arguments... */
+#define FRAME_START      '\\'
+#define FRAME_START_SEQ  '#'
+
+/* Start byte of a CRC-checked command */
+/*  FRAME_START_CRC, length, sequence, command, arguments..., CRC */
+/*  The length counts the sequence byte, the command and the arguments */
+/*  (at most FRAME_LEN_MAX). The CRC is a CRC-8 (polynomial 0x07, */
+/*  starting at zero) of everything from the length byte to the last */
+/*  argument. A command with a bad length or CRC is not run, and the */
+/*  response is RES_BADCRC with whatever sequence and command bytes */
+/*  were received (which may be wrong) */
+#define FRAME_START_CRC  '$'
+#define FRAME_LEN_MAX    (CMDBUF_SIZE-4)
+
+/* Set in the command byte of a response if it is followed */
+/* by the sequence byte of the command (after the unit id) */
+#define RES_SEQ_FLAG     0x80
+
+/* Set in the length byte of a response if it is followed by a CRC */
+/* (as for FRAME_START_CRC, starting with the length byte). Responses */
+/* to FRAME_START_CRC commands, and everything sent in CRC mode, */
+/* have one. Responses must therefore be shorter than 128 bytes */
+#define RES_CRC_FLAG     0x80
+
 /* General commands */
 #define COM_NOTHING  0
 #define COM_INFO     1
 #define COM_ON       2
 #define COM_OFF      3
 #define COM_LEVEL    4
+#define COM_BATCH    5
+#define COM_INFO_DELTA 6
+#define COM_SUBSCRIBE  7
+#define COM_FADE       8
+#define COM_SCENE_STORE  9
+#define COM_SCENE_RECALL 10
+#define COM_SCENE_BOOT   11
+#define COM_SCHEDULE     12
+#define COM_CAPS         13
+#define COM_BAUD         14
+#define COM_CRC          15
+#define COM_STATS        16
+#define COM_MAINS        17
+#define COM_ZC_HISTORY   18
+
+/* COM_SUBSCRIBE takes flags, then the heartbeat period in half-cycles */
+/* (2 bytes, low first, zero for none). With SUB_ONCHANGE, a status */
+/* frame is also sent whenever the state changes (at most every few */
+/* half-cycles while fading). Flags and period of zero unsubscribes */
+#define SUB_ONCHANGE 0x01
+
+/* Command byte of the unsolicited status frames sent while subscribed. */
+/* These never have a sequence byte. The payload is the same as the */
+/* COM_INFO_DELTA response, relative to the previous status frame */
+#define COM_STATUS   0x7F
+
+/* COM_FADE takes the unit id, the target level, and the length of */
+/* the fade in half-cycles (2 bytes, low first). The microcontroller */
+/* steps the level every half-cycle. Any other level change for the */
+/* unit stops the fade */
+
+/* Scenes are stored in the microcontroller's EEPROM. Each one holds */
+/* the level of every powerunit. COM_SCENE_STORE takes the slot. */
+/* COM_SCENE_RECALL takes the slot and the length of a fade to it, in */
+/* half-cycles (2 bytes, low first, zero to change right away). */
+/* COM_SCENE_BOOT takes SCENE_BOOT_OFF (start with everything off) */
+/* or SCENE_BOOT_LAST (recall the last scene stored or recalled when */
+/* powered up). The slot (or boot option) is the id of the response */
+#define SCENE_COUNT      8
+#define SCENE_BOOT_OFF   0
+#define SCENE_BOOT_LAST  1
+
+/* COM_SCHEDULE applies levels on a given half-cycle. It takes the */
+/* half-cycle count to apply them on (4 bytes, low first, see COM_INFO), */
+/* the length of a fade to them in half-cycles (2 bytes, low first, zero */
+/* to change right away), the number of pairs, then that many (id, level) */
+/* pairs as in COM_BATCH. Everything scheduled for the same count */
+/* takes effect on the same half-cycle. The response has the current */
+/* count (4 bytes, low first). If the count has already passed, nothing */
+/* is done and the result is RES_TOOLATE. At most SCHEDULE_QUEUE commands */
+/* can be waiting (RES_QUEUEFULL) */
+#define SCHEDULE_MAX     8
+#define SCHEDULE_QUEUE   4
+
+/* COM_CAPS takes no arguments. The response is PROTOCOL_VERSION, */
+/* the feature bits (2 bytes, low first), a bitmap of the supported */
+/* baud rates (bit BAUD_xxx set if supported), and CMDBUF_SIZE */
+#define CAPS_SIZE 5
+
+/* COM_BAUD takes one of the BAUD_xxx rates. The response is sent at */
+/* the old rate, and then the microcontroller switches. If it doesn't */
+/* receive a COM_NOTHING at the new rate within BAUD_FALLBACK */
+/* half-cycles (or 1/120s periods if there is no mains), it goes */
+/* back to BAUD_DEFAULT */
+#define BAUD_FALLBACK 240
+
+/* COM_CRC takes 1 to turn on CRC mode, or 0 to turn it off. In CRC */
+/* mode, only FRAME_START_CRC commands are accepted (anything else is */
+/* skipped while looking for the next start byte) and status frames */
+/* also have a CRC. The response is sent in the old mode */
+
+/* COM_STATS takes flags. The response has the microcontroller's */
+/* performance counters, in STATS_SIZE bytes (all low byte first): */
+/*  STATS_RXOVERFLOW: bytes dropped because the command buffer was full (2 bytes) */
+/*  STATS_OVERRUN: bytes lost before being read from the USART (DOR0) (2 bytes) */
+/*  STATS_FRAMEERROR: bytes received with a framing error (FE0) (2 bytes) */
+/*  STATS_BUFFHIGH: most bytes ever waiting in the command buffer (1 byte) */
+/*  STATS_MISSEDZC: zero crossings that didn't arrive when expected (2 bytes) */
+/*  STATS_LOOPMAX: longest main loop iteration, in CPU cycles (4 bytes) */
+/*  STATS_ISRMAX: longest run of each interrupt, in CPU cycles (2 bytes */
+/*                each, in the order of the STATS_ISR_xxx numbers) */
+/* Times are measured with an 8-cycle resolution, and counters stop at */
+/* their maximum. With STATS_RESET, everything is cleared after being read */
+#define STATS_RESET        0x01
+#define STATS_RXOVERFLOW   0
+#define STATS_OVERRUN      2
+#define STATS_FRAMEERROR   4
+#define STATS_BUFFHIGH     6
+#define STATS_MISSEDZC     7
+#define STATS_LOOPMAX      9
+#define STATS_ISRMAX       13
+#define STATS_ISR_ZEROCROSS 0  /* TIMER4_CAPT_vect */
+#define STATS_ISR_COMPARE   1  /* TIMER1_COMPA_vect */
+#define STATS_ISR_TOP       2  /* TIMER1_CAPT_vect */
+#define STATS_ISR_RX        3  /* USART0_RX_vect */
+#define STATS_ISR_COUNT     4
+#define STATS_SIZE (STATS_ISRMAX+2*STATS_ISR_COUNT)
+
+/* COM_MAINS takes flags. The response has statistics of the length */
+/* of a full mains cycle (measured on each rising edge, in ticks of */
+/* the zero-crossing timer, F_CPU/8), in MAINS_SIZE bytes (all low */
+/* byte first): */
+/*  MAINS_COUNT: number of cycles measured (4 bytes) */
+/*  MAINS_MEAN: running mean, with 8 fractional bits (4 bytes) */
+/*  MAINS_VARIANCE: running variance, with 8 fractional bits (4 bytes) */
+/*  MAINS_MIN, MAINS_MAX: shortest and longest cycle (2 bytes each) */
+/* The mean and variance are exponential averages over about */
+/* 2^MAINS_SHIFT cycles. Cycles outside the range the dimmers accept */
+/* (see STATS_MISSEDZC) are left out. With MAINS_RESET, everything is */
+/* cleared after being read */
+#define MAINS_RESET      0x01
+#define MAINS_SHIFT      6
+#define MAINS_COUNT      0
+#define MAINS_MEAN       4
+#define MAINS_VARIANCE   8
+#define MAINS_MIN        12
+#define MAINS_MAX        14
+#define MAINS_SIZE       16
+
+/* COM_ZC_HISTORY takes no arguments. The response is the half-cycle */
+/* count (see COM_INFO) at the newest edge (4 bytes, low first), 1 if */
+/* the newest edge was rising or 0 if falling, then the time between */
+/* each of the last ZCHIST_SIZE edges and the one before it, oldest */
+/* first (2 bytes each, low first, in ticks of the zero-crossing timer). */
+/* Rising and falling edges alternate. Entries before the first edge */
+/* are zero */
+#define ZCHIST_SIZE      32
+#define ZCHIST_RESPONSE_SIZE (5+2*ZCHIST_SIZE)
+
+/* Size of the largest response payload */
+#if ZCHIST_RESPONSE_SIZE > INFO_DELTA_MAX
+#define PAYLOAD_MAX ZCHIST_RESPONSE_SIZE
+#else
+#define PAYLOAD_MAX INFO_DELTA_MAX
+#endif
+
+/* Maximum number of (id, level) pairs in a COM_BATCH command */
+/* so that the whole command fits in the command buffer, */
+/* even as a FRAME_START_CRC command */
+#define BATCH_MAX ((FRAME_LEN_MAX-3)/2)
 
 
 /* Responses & error codes */
@@ -40,6 +261,10 @@
 #define RES_INVALID_ID    3
 #define RES_NODIMMER      4
 #define RES_NOGENCLOCK    5
+#define RES_NOSCENE       6
+#define RES_TOOLATE       7
+#define RES_QUEUEFULL     8
+#define RES_BADCRC        9
 #define RES_FAILURE       126
 
 
@@ -2,6 +2,14 @@
 
 PROJECT=triaclight
 
+# Ticks of the dimmer timer per half-cycle (ONETWENTYHERTZ in triaclight.c)
+HALFCYCLE=16667
+
+# Generate the table of compare values for the levels
+gcc -Wall -Wextra -pedantic -o tools/mkleveltable tools/mkleveltable.c -lm && tools/mkleveltable $HALFCYCLE > leveltable.h
+
+if [ $? != 0 ]; then exit; fi;
+
 avr-gcc -Wall -Wextra -pedantic -mmcu=atmega1280 -Os -DF_CPU=16000000UL *.c -o $PROJECT.o 
 
 if [ $? != 0 ]; then exit; fi;
@@ -0,0 +1,46 @@
+/*! \file
+ *  \brief     Stand-in for avr/eeprom.h when running on a PC (see emulator.c)
+ *  \details   EEMEM variables are placed together in their own section,
+ *             which the emulator loads from and saves to a file
+ *  \author    Benjamin Pritchard (ben@bennyp.org)
+ *  \copyright 2013 Benjamin Pritchard. Released under the MIT License
+ */
+
+#ifndef EMU_AVR_EEPROM_H
+#define EMU_AVR_EEPROM_H
+
+#include <string.h>
+
+#include "../emulator.h"
+
+#define EEMEM __attribute__((section("emu_eeprom")))
+
+static inline uint8_t eeprom_read_byte(const uint8_t * addr)
+{
+    return *addr;
+}
+
+static inline void eeprom_read_block(void * dst, const void * src, size_t n)
+{
+    memcpy(dst, src, n);
+}
+
+static inline void eeprom_update_byte(uint8_t * addr, uint8_t value)
+{
+    if(*addr != value)
+    {
+        *addr = value;
+        Emu_eepromwrite();
+    }
+}
+
+static inline void eeprom_update_block(const void * src, void * dst, size_t n)
+{
+    if(memcmp(dst, src, n) != 0)
+    {
+        memcpy(dst, src, n);
+        Emu_eepromwrite();
+    }
+}
+
+#endif
@@ -0,0 +1,18 @@
+/*! \file
+ *  \brief     Stand-in for avr/interrupt.h when running on a PC (see emulator.c)
+ *  \author    Benjamin Pritchard (ben@bennyp.org)
+ *  \copyright 2013 Benjamin Pritchard. Released under the MIT License
+ */
+
+#ifndef EMU_AVR_INTERRUPT_H
+#define EMU_AVR_INTERRUPT_H
+
+#include "../emulator.h"
+
+/* The emulator calls Emu_<vector>() for each interrupt */
+#define ISR(vect) void Emu_##vect(void)
+
+#define sei() Emu_sei()
+#define cli() Emu_cli()
+
+#endif
@@ -0,0 +1,12 @@
+/*! \file
+ *  \brief     Stand-in for avr/io.h when running on a PC (see emulator.c)
+ *  \author    Benjamin Pritchard (ben@bennyp.org)
+ *  \copyright 2013 Benjamin Pritchard. Released under the MIT License
+ */
+
+#ifndef EMU_AVR_IO_H
+#define EMU_AVR_IO_H
+
+#include "../emulator.h"
+
+#endif
@@ -0,0 +1,17 @@
+/*! \file
+ *  \brief     Stand-in for avr/pgmspace.h when running on a PC (see emulator.c)
+ *  \author    Benjamin Pritchard (ben@bennyp.org)
+ *  \copyright 2013 Benjamin Pritchard. Released under the MIT License
+ */
+
+#ifndef EMU_AVR_PGMSPACE_H
+#define EMU_AVR_PGMSPACE_H
+
+#include <stdint.h>
+
+/* There is only one address space */
+#define PROGMEM
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+
+#endif
@@ -0,0 +1,20 @@
+/*! \file
+ *  \brief     Stand-in for avr/sleep.h when running on a PC (see emulator.c)
+ *  \author    Benjamin Pritchard (ben@bennyp.org)
+ *  \copyright 2013 Benjamin Pritchard. Released under the MIT License
+ */
+
+#ifndef EMU_AVR_SLEEP_H
+#define EMU_AVR_SLEEP_H
+
+#include "../emulator.h"
+
+/* Every sleep mode just waits for the next interrupt */
+#define SLEEP_MODE_IDLE 0
+
+#define set_sleep_mode(mode) ((void)(mode))
+#define sleep_enable()
+#define sleep_disable()
+#define sleep_cpu() Emu_sleep()
+
+#endif
@@ -0,0 +1,28 @@
+#!/bin/bash
+
+# Builds the firmware to run on a PC (see emulator.c)
+
+cd "$(dirname "$0")"
+
+PROJECT=triaclight-emu
+
+# Ticks of the dimmer timer per half-cycle (ONETWENTYHERTZ in triaclight.c)
+HALFCYCLE=16667
+
+CFLAGS="-Wall -Wextra -pedantic -O2 -g -pthread -DF_CPU=16000000UL"
+
+# Generate the table of compare values for the levels
+gcc -Wall -Wextra -pedantic -o ../tools/mkleveltable ../tools/mkleveltable.c -lm && ../tools/mkleveltable $HALFCYCLE > ../leveltable.h
+
+if [ $? != 0 ]; then exit 1; fi;
+
+# The firmware gets the stand-in avr-libc headers in this
+# directory, and its main() is started by the emulator
+gcc $CFLAGS -I. -Dmain=FirmwareMain -c ../triaclight.c -o triaclight.o && \
+gcc $CFLAGS -I. -Dmain=FirmwareMain -c ../serial.c -o serial.o && \
+gcc $CFLAGS -I. -c emulator.c -o emulator.o && \
+gcc $CFLAGS -o $PROJECT triaclight.o serial.o emulator.o
+
+if [ $? != 0 ]; then exit 1; fi;
+
+rm -f triaclight.o serial.o emulator.o
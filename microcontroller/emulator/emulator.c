@@ -0,0 +1,889 @@
+/*! \file
+ *  \brief     Runs the firmware on a PC, with the hardware emulated
+ *  \details   triaclight.c and serial.c are compiled against the stand-ins
+ *             for the avr-libc headers in this directory (see build.sh),
+ *             where the registers are plain variables. A second thread
+ *             plays the part of the hardware, in virtual time: the timers
+ *             count, zero-crossing edges arrive at the mains frequency,
+ *             and the USART sends and receives at whatever baud rate the
+ *             firmware has set, through a pseudo-terminal.
+ *
+ *             The firmware's main() runs in the main thread. Interrupts
+ *             are run from the hardware thread while it holds a lock, which
+ *             the firmware also holds while its interrupts are disabled.
+ *             The emulated CPU is infinitely fast, so an interrupt takes
+ *             no (virtual) time at all.
+ *
+ *             The pseudo-terminal can be opened by MCInterface like
+ *             a real serial port. As with an Arduino, opening the port
+ *             resets the microcontroller, so it sends the identification
+ *             string to each new connection.
+ *  \author    Benjamin Pritchard (ben@bennyp.org)
+ *  \copyright 2013 Benjamin Pritchard. Released under the MIT License
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <termios.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "emulator.h"
+
+/*! \brief CPU cycles per microsecond */
+#define CYCLES_PER_US (F_CPU/1000000ul)
+
+/*! \brief Longest the hardware thread waits while the firmware is running
+
+    The firmware may start sending at any time without the emulator
+    knowing about it, so while it isn't asleep, the hardware thread checks
+    this often (in microseconds)
+*/
+#define AWAKE_POLL_US 20
+
+/*! \brief Size of the buffer of bytes received from the pseudo-terminal */
+#define RXFIFO_SIZE 4096
+
+/*! \brief Never */
+#define EMU_NEVER UINT64_MAX
+
+
+/* The registers */
+volatile uint8_t UCSR0A;
+volatile uint8_t UCSR0B;
+volatile uint8_t UCSR0C;
+volatile uint8_t UBRR0H;
+volatile uint8_t UBRR0L;
+volatile uint16_t UDR0;
+
+volatile uint8_t TCCR1A;
+volatile uint8_t TCCR1B;
+volatile uint8_t TIMSK1;
+volatile uint16_t TCNT1;
+volatile uint16_t OCR1A;
+volatile uint16_t ICR1;
+
+volatile uint8_t TCCR4A;
+volatile uint8_t TCCR4B;
+volatile uint8_t TIMSK4;
+volatile uint16_t TCNT4;
+volatile uint16_t ICR4;
+
+volatile uint8_t PORTB;
+volatile uint8_t DDRB;
+volatile uint8_t PORTG;
+volatile uint8_t DDRG;
+volatile uint8_t PORTL;
+volatile uint8_t DDRL;
+
+/* EEMEM variables (see avr/eeprom.h). The linker provides these */
+extern uint8_t __start_emu_eeprom[];
+extern uint8_t __stop_emu_eeprom[];
+
+
+/*! \brief The firmware's main() (renamed by build.sh) */
+int FirmwareMain(void);
+
+
+/*! \brief A 16-bit timer
+
+    The count is only worked out when needed, from the virtual
+    time it was last known at.
+*/
+struct Timer
+{
+    volatile uint8_t * tccrb;  /*!< Control register B (clock select) */
+    volatile uint16_t * top;   /*!< Register holding TOP (NULL for 0xFFFF) */
+    uint64_t time;             /*!< Virtual time (in cycles) that count is for */
+    uint16_t count;            /*!< The count at that time */
+};
+
+/*! \brief Things that happen in the hardware */
+enum Event
+{
+    EV_NONE,
+    EV_ZEROCROSS,   /*!< An edge from the zero-crossing detector */
+    EV_T1TOP,       /*!< Timer 1 wraps around from TOP */
+    EV_T1COMPA,     /*!< Timer 1 reaches OCR1A */
+    EV_UDRE,        /*!< The USART can take another byte to send */
+    EV_TXDONE,      /*!< The USART has finished sending a byte */
+    EV_RX           /*!< The USART has received a byte */
+};
+
+
+/*! \brief Held while the firmware's interrupts are disabled, and while
+           the hardware thread is doing anything */
+static pthread_mutex_t emulock = PTHREAD_MUTEX_INITIALIZER;
+
+/*! \brief Signalled after each interrupt (see Emu_sleep()) */
+static pthread_cond_t irqcond = PTHREAD_COND_INITIALIZER;
+
+/*! \brief Set in a thread while it has interrupts enabled (the I bit) */
+static __thread uint8_t iflag;
+
+/*! \brief Number of interrupts that have run */
+static uint64_t irqcount;
+
+/*! \brief irqcount when interrupts were last enabled (see Emu_sleep()) */
+static uint64_t seicount;
+
+/*! \brief Cleared while the firmware is asleep */
+static volatile uint8_t mainawake = 1;
+
+/*! \brief Real time corresponding to a virtual time of zero */
+static struct timespec starttime;
+
+/*! \brief Virtual time (in cycles) of the event being handled */
+static uint64_t emutime;
+
+/*! \brief Mains frequency, in millihertz */
+static uint64_t mainsfreq = 60000;
+
+/*! \brief Number of the next zero-crossing edge */
+static uint64_t zcnumber;
+
+/*! \brief Virtual time of the last zero-crossing edge */
+static uint64_t zctime;
+
+/*! \brief Level of the zero-crossing detector's output */
+static uint8_t zclevel;
+
+static struct Timer timer1 = { &TCCR1B, &ICR1, 0, 0 };
+static struct Timer timer4 = { &TCCR4B, NULL, 0, 0 };
+
+/*! \brief Master side of the pseudo-terminal */
+static int ptyfd = -1;
+
+/*! \brief File holding the EEPROM */
+static int eepromfd = -1;
+
+/*! \brief Byte being sent by the USART */
+static uint8_t txbyte;
+
+/*! \brief Set while the USART is sending txbyte */
+static uint8_t txbusy;
+
+/*! \brief Virtual time at which the USART finishes sending txbyte */
+static uint64_t txdone;
+
+/*! \brief Bytes from the pseudo-terminal waiting to be received by the USART */
+static uint8_t rxfifo[RXFIFO_SIZE];
+
+/*! \brief Virtual time each byte in rxfifo arrived */
+static uint64_t rxarrival[RXFIFO_SIZE];
+
+/*! \brief Index of the next byte to be received in rxfifo */
+static unsigned int rxhead;
+
+/*! \brief Number of bytes in rxfifo */
+static unsigned int rxcount;
+
+/*! \brief Virtual time the USART received the last byte */
+static uint64_t rxlast;
+
+/*! \brief Print the time of each triac pulse */
+static int verbose;
+
+/*! \brief Symbolic link to the pseudo-terminal (or NULL) */
+static const char * linkpath;
+
+/*! \brief Arguments to restart the emulator with (see Reset()) */
+static char ** resetargv;
+
+
+
+/*! \brief Returns the current virtual time (in cycles) */
+static uint64_t VirtualNow(void)
+{
+    struct timespec ts;
+    uint64_t ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ns = (uint64_t)(ts.tv_sec - starttime.tv_sec) * 1000000000ull + ts.tv_nsec - starttime.tv_nsec;
+    return ns * CYCLES_PER_US / 1000;
+}
+
+
+/*! \brief Returns the timer's prescaler, or zero if it is stopped */
+static unsigned int Prescale(const struct Timer * t)
+{
+    switch(*(t->tccrb) & 0x07)
+    {
+    case 1:
+        return 1;
+    case 2:
+        return 8;
+    case 3:
+        return 64;
+    case 4:
+        return 256;
+    case 5:
+        return 1024;
+    default:
+        return 0; /* stopped, or an external clock */
+    }
+}
+
+
+/*! \brief Returns the highest count of a timer */
+static uint32_t Top(const struct Timer * t)
+{
+    return t->top ? *(t->top) : 0xFFFF;
+}
+
+
+/*! \brief Brings the count of a timer up to virtual time \p now */
+static void TimerAdvance(struct Timer * t, uint64_t now)
+{
+    unsigned int pre = Prescale(t);
+    uint32_t top = Top(t);
+    uint64_t ticks;
+    uint32_t toend;
+
+    if(pre == 0 || now < t->time)
+    {
+        t->time = (now > t->time ? now : t->time);
+        return;
+    }
+
+    ticks = (now - t->time) / pre;
+    t->time += ticks * pre;
+
+    /* Set above TOP, so it counts all the way to 0xFFFF first */
+    if(t->count > top)
+    {
+        toend = 0x10000 - t->count;
+        if(ticks < toend)
+        {
+            t->count += ticks;
+            return;
+        }
+        ticks -= toend;
+        t->count = 0;
+    }
+
+    t->count = (t->count + ticks) % (top + 1);
+}
+
+
+/*! \brief Returns the next virtual time (after the timer's time) that its count becomes \p value */
+static uint64_t TimerWhen(const struct Timer * t, uint16_t value)
+{
+    unsigned int pre = Prescale(t);
+    uint32_t top = Top(t);
+    uint64_t ticks;
+
+    if(pre == 0)
+        return EMU_NEVER;
+
+    if(t->count > top)
+    {
+        if(value > t->count)
+            ticks = value - t->count;
+        else if(value <= top)
+            ticks = (0x10000 - t->count) + value;
+        else
+            return EMU_NEVER;
+    }
+    else
+    {
+        if(value > top)
+            return EMU_NEVER;
+        else if(value > t->count)
+            ticks = value - t->count;
+        else
+            ticks = (top + 1 - t->count) + value;
+    }
+
+    return t->time + ticks * pre;
+}
+
+
+/*! \brief Returns the virtual time of zero-crossing edge \p n */
+static uint64_t ZeroCrossTime(uint64_t n)
+{
+    /* Two edges per cycle. Split up to avoid overflowing */
+    const uint64_t num = F_CPU * 1000ull;
+    const uint64_t den = 2 * mainsfreq;
+
+    return (n / den) * num + ((n % den) * num) / den;
+}
+
+
+/*! \brief Returns the number of cycles the USART takes for one byte (8N1) */
+static uint64_t ByteTime(void)
+{
+    uint64_t ubrr = (((uint16_t)UBRR0H << 8) | UBRR0L) & 0x0FFF;
+
+    return 10 * ((UCSR0A & (1<<U2X0)) ? 8 : 16) * (ubrr + 1);
+}
+
+
+/*! \brief Runs an interrupt routine
+
+    The counter registers are set from the emulated timers first, and the
+    timers follow anything the routine writes to them. emulock must be held.
+*/
+static void Interrupt(void (*isr)(void))
+{
+    uint8_t oldport = PORTG;
+    uint8_t bit;
+
+    TCNT1 = timer1.count;
+    TCNT4 = timer4.count;
+
+    isr();
+
+    if(TCNT1 != timer1.count)
+    {
+        timer1.count = TCNT1;
+        timer1.time = emutime;
+    }
+
+    if(TCNT4 != timer4.count)
+    {
+        timer4.count = TCNT4;
+        timer4.time = emutime;
+    }
+
+    if(verbose)
+    {
+        for(bit = 0; bit < 8; bit++)
+        {
+            if(!(oldport & (1<<bit)) && (PORTG & (1<<bit)))
+                printf("%12.3f ms  PG%d on %8.1f us after the zero crossing\n",
+                       emutime / (1000.0 * CYCLES_PER_US), bit,
+                       (emutime - zctime) / (double)CYCLES_PER_US);
+        }
+    }
+
+    /* Any interrupt wakes the CPU */
+    mainawake = 1;
+    irqcount++;
+    pthread_cond_broadcast(&irqcond);
+}
+
+
+/*! \brief Returns the next thing that will happen, and when (in \p when) */
+static enum Event NextEvent(uint64_t * when)
+{
+    enum Event ev = EV_NONE;
+    uint64_t t;
+
+    *when = EMU_NEVER;
+
+#define CONSIDER(event, time) \
+    do { t = (time); if(t < *when) { *when = t; ev = (event); } } while(0)
+
+    CONSIDER(EV_ZEROCROSS, ZeroCrossTime(zcnumber));
+
+    if(TIMSK1 & (1<<ICIE1))
+        CONSIDER(EV_T1TOP, TimerWhen(&timer1, 0));
+
+    if(TIMSK1 & (1<<OCIE1A))
+        CONSIDER(EV_T1COMPA, TimerWhen(&timer1, OCR1A));
+
+    if(txbusy)
+        CONSIDER(EV_TXDONE, txdone);
+    else if((UCSR0B & (1<<UDRIE0)) && (UCSR0B & (1<<TXEN0)))
+        CONSIDER(EV_UDRE, VirtualNow());
+
+    if(rxcount > 0)
+        CONSIDER(EV_RX, (rxarrival[rxhead] > rxlast + ByteTime()) ? rxarrival[rxhead] : rxlast + ByteTime());
+
+#undef CONSIDER
+
+    return ev;
+}
+
+
+/*! \brief Makes an event happen. emulock must be held */
+static void RunEvent(enum Event ev)
+{
+    uint8_t rising;
+    uint8_t c;
+
+    switch(ev)
+    {
+    case EV_ZEROCROSS:
+        zclevel = !zclevel;
+        rising = zclevel;
+        zctime = emutime;
+        zcnumber++;
+
+        /* Input capture on the edge selected by ICES4 */
+        if(rising == ((TCCR4B & (1<<ICES4)) != 0))
+        {
+            ICR4 = timer4.count;
+            if(TIMSK4 & (1<<ICIE4))
+                Interrupt(Emu_TIMER4_CAPT_vect);
+        }
+        break;
+
+    case EV_T1TOP:
+        Interrupt(Emu_TIMER1_CAPT_vect);
+        break;
+
+    case EV_T1COMPA:
+        Interrupt(Emu_TIMER1_COMPA_vect);
+        break;
+
+    case EV_UDRE:
+        UDR0 = EMU_UDR_EMPTY;
+        Interrupt(Emu_USART0_UDRE_vect);
+        if(UDR0 != EMU_UDR_EMPTY)
+        {
+            /* Writing TXC0 clears it */
+            UCSR0A &= ~(1<<TXC0);
+            txbyte = UDR0;
+            txbusy = 1;
+            txdone = emutime + ByteTime();
+        }
+        break;
+
+    case EV_TXDONE:
+        if(write(ptyfd, &txbyte, 1) != 1)
+        {
+            /* Nobody listening. Lost, like on a real serial line */
+        }
+        txbusy = 0;
+        UCSR0A |= (1<<TXC0);
+        break;
+
+    case EV_RX:
+        c = rxfifo[rxhead];
+        rxhead = (rxhead + 1) % RXFIFO_SIZE;
+        rxcount--;
+        rxlast = emutime;
+
+        /* Lost if the receiver (or its interrupt) is off */
+        if((UCSR0B & (1<<RXEN0)) && (UCSR0B & (1<<RXCIE0)))
+        {
+            UDR0 = c;
+            UCSR0A |= (1<<RXC0);
+            Interrupt(Emu_USART0_RX_vect);
+            UCSR0A &= ~(1<<RXC0);
+        }
+        break;
+
+    case EV_NONE:
+        break;
+    }
+}
+
+
+/*! \brief Restarts the emulator, which resets the firmware
+
+    The pseudo-terminal and the EEPROM are kept open (see main()).
+*/
+static void Reset(void)
+{
+    execv("/proc/self/exe", resetargv);
+    perror("Unable to restart");
+    exit(1);
+}
+
+
+/*! \brief Reads whatever has arrived on the pseudo-terminal into rxfifo */
+static void ReadSerial(void)
+{
+    uint8_t buf[256];
+    unsigned int space;
+    unsigned int i;
+    ssize_t n;
+    uint64_t now;
+
+    space = RXFIFO_SIZE - rxcount;
+    if(space == 0)
+        return;
+
+    n = read(ptyfd, buf, space < sizeof(buf) ? space : sizeof(buf));
+    if(n <= 0)
+        return;
+
+    now = VirtualNow();
+    for(i = 0; i < (unsigned int)n; i++)
+    {
+        rxfifo[(rxhead + rxcount) % RXFIFO_SIZE] = buf[i];
+        rxarrival[(rxhead + rxcount) % RXFIFO_SIZE] = now;
+        rxcount++;
+    }
+}
+
+
+/*! \brief Waits until virtual time \p until, or for something to arrive
+
+    emulock must not be held. If the port was closed, the emulator is reset.
+    If \p awake is set, the firmware may change the registers at any time,
+    so the wait is kept short. It must be read while emulock is held,
+    otherwise the firmware could start a transmission and go back to sleep
+    before it is checked.
+*/
+static void Wait(uint64_t until, uint8_t awake)
+{
+    struct pollfd pfd;
+    struct timespec ts;
+    uint64_t now = VirtualNow();
+    uint64_t us;
+
+    us = (until > now) ? (until - now) / CYCLES_PER_US : 0;
+    if(until == EMU_NEVER || us > 1000000)
+        us = 1000000;
+    if(awake && us > AWAKE_POLL_US)
+        us = AWAKE_POLL_US;
+
+    ts.tv_sec = us / 1000000;
+    ts.tv_nsec = (us % 1000000) * 1000;
+
+    pfd.fd = ptyfd;
+    pfd.events = (rxcount < RXFIFO_SIZE) ? POLLIN : 0;
+    pfd.revents = 0;
+
+    if(ppoll(&pfd, 1, &ts, NULL) > 0)
+    {
+        if(pfd.revents & POLLIN)
+            ReadSerial();
+        else if(pfd.revents & POLLHUP)
+            Reset();
+    }
+}
+
+
+/*! \brief The hardware thread */
+static void * Hardware(void * arg)
+{
+    enum Event ev;
+    uint64_t when;
+    uint8_t awake;
+
+    (void)arg;
+
+    pthread_mutex_lock(&emulock);
+
+    while(1)
+    {
+        ev = NextEvent(&when);
+
+        if(when > VirtualNow())
+        {
+            awake = mainawake;
+            pthread_mutex_unlock(&emulock);
+            Wait(when, awake);
+            pthread_mutex_lock(&emulock);
+            continue;
+        }
+
+        emutime = when;
+        TimerAdvance(&timer1, emutime);
+        TimerAdvance(&timer4, emutime);
+        RunEvent(ev);
+    }
+
+    return NULL;
+}
+
+
+
+void Emu_sei(void)
+{
+    if(!iflag)
+    {
+        seicount = irqcount;
+        iflag = 1;
+        pthread_mutex_unlock(&emulock);
+    }
+}
+
+
+void Emu_cli(void)
+{
+    if(iflag)
+    {
+        pthread_mutex_lock(&emulock);
+        iflag = 0;
+    }
+}
+
+
+uint8_t Emu_atomicbegin(void)
+{
+    uint8_t state = (iflag ? 2 : 1);
+
+    Emu_cli();
+    return state;
+}
+
+
+uint8_t Emu_atomicend(uint8_t state)
+{
+    if(state == 2)
+        Emu_sei();
+
+    return 0;
+}
+
+
+void Emu_sleep(void)
+{
+    /* Like the AVR, an interrupt between sei() and
+       sleep_cpu() still wakes it up */
+    pthread_mutex_lock(&emulock);
+    mainawake = 0;
+
+    while(irqcount == seicount)
+        pthread_cond_wait(&irqcond, &emulock);
+
+    seicount = irqcount;
+    mainawake = 1;
+    pthread_mutex_unlock(&emulock);
+}
+
+
+void Emu_eepromwrite(void)
+{
+    size_t size = __stop_emu_eeprom - __start_emu_eeprom;
+
+    if(pwrite(eepromfd, __start_emu_eeprom, size, 0) != (ssize_t)size)
+        perror("Unable to save the EEPROM");
+}
+
+
+/*! \brief Creates the pseudo-terminal and prints its name */
+static void OpenPty(void)
+{
+    struct termios tio;
+    const char * name;
+    int slave;
+
+    ptyfd = posix_openpt(O_RDWR | O_NOCTTY);
+    if(ptyfd < 0 || grantpt(ptyfd) != 0 || unlockpt(ptyfd) != 0 || (name = ptsname(ptyfd)) == NULL)
+    {
+        perror("Unable to create a pseudo-terminal");
+        exit(1);
+    }
+
+    /* Raw mode (otherwise what we send may be echoed back). Opening
+       and closing it also means the port reads as hung up until
+       somebody opens it (see WaitForOpen()) */
+    slave = open(name, O_RDWR | O_NOCTTY);
+    if(slave < 0 || tcgetattr(slave, &tio) != 0)
+    {
+        perror("Unable to set up the pseudo-terminal");
+        exit(1);
+    }
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+    close(slave);
+
+    if(linkpath)
+    {
+        unlink(linkpath);
+        if(symlink(name, linkpath) != 0)
+        {
+            perror("Unable to create the link");
+            exit(1);
+        }
+        printf("Serial port: %s (%s)\n", linkpath, name);
+    }
+    else
+        printf("Serial port: %s\n", name);
+
+    fflush(stdout);
+}
+
+
+/*! \brief Opens the file holding the EEPROM
+
+    If \p path is NULL, the EEPROM only lasts until the emulator is stopped
+*/
+static void OpenEeprom(const char * path)
+{
+    if(path)
+        eepromfd = open(path, O_RDWR | O_CREAT, 0644);
+    else
+        eepromfd = memfd_create("eeprom", 0);
+
+    if(eepromfd < 0)
+    {
+        perror("Unable to open the EEPROM");
+        exit(1);
+    }
+}
+
+
+/*! \brief Loads the EEPROM
+
+    If there isn't a whole EEPROM in the file yet, it
+    starts out erased (all 0xFF), like a new microcontroller
+*/
+static void LoadEeprom(void)
+{
+    size_t size = __stop_emu_eeprom - __start_emu_eeprom;
+
+    if(pread(eepromfd, __start_emu_eeprom, size, 0) != (ssize_t)size)
+    {
+        memset(__start_emu_eeprom, 0xFF, size);
+        Emu_eepromwrite();
+    }
+}
+
+
+/*! \brief Waits for the pseudo-terminal to be opened
+
+    Anything sent before then is thrown away
+*/
+static void WaitForOpen(void)
+{
+    struct pollfd pfd;
+    uint8_t buf[256];
+
+    pfd.fd = ptyfd;
+    pfd.events = POLLIN;
+
+    while(1)
+    {
+        pfd.revents = 0;
+        if(poll(&pfd, 1, 0) >= 0 && !(pfd.revents & POLLHUP))
+            break;
+        usleep(10000);
+    }
+
+    /* Like the Arduino's bootloader, take a moment before starting.
+       This gives the other side time to set up the port */
+    usleep(100000);
+
+    fcntl(ptyfd, F_SETFL, fcntl(ptyfd, F_GETFL) | O_NONBLOCK);
+    while(read(ptyfd, buf, sizeof(buf)) > 0);
+    fcntl(ptyfd, F_SETFL, fcntl(ptyfd, F_GETFL) & ~O_NONBLOCK);
+}
+
+
+/*! \brief Removes the link to the pseudo-terminal on the way out */
+static void Quit(int sig)
+{
+    (void)sig;
+
+    if(linkpath)
+        unlink(linkpath);
+    _exit(0);
+}
+
+
+/*! \brief Builds the arguments for Reset() */
+static void BuildResetArgs(int argc, char ** argv)
+{
+    static char fds[32];
+    int i, n = 0;
+
+    snprintf(fds, sizeof(fds), "%d,%d", ptyfd, eepromfd);
+
+    resetargv = calloc(argc + 3, sizeof(char *));
+    resetargv[n++] = argv[0];
+    resetargv[n++] = "-R";
+    resetargv[n++] = fds;
+
+    for(i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "-R") == 0)
+            i++;
+        else
+            resetargv[n++] = argv[i];
+    }
+
+    resetargv[n] = NULL;
+}
+
+
+static void Usage(const char * prog)
+{
+    fprintf(stderr, "Usage: %s [-m hz] [-e file] [-l link] [-v]\n"
+                    "  -m hz    Mains frequency (default 60)\n"
+                    "  -e file  Keep the EEPROM in this file (default: only while running)\n"
+                    "  -l link  Also make the serial port available as this path\n"
+                    "  -v       Print the time of each triac pulse\n", prog);
+    exit(1);
+}
+
+
+int main(int argc, char ** argv)
+{
+    const char * eeprompath = NULL;
+    const char * resetfds = NULL;
+    pthread_t hwthread;
+    double hz;
+    int opt;
+
+    while((opt = getopt(argc, argv, "m:e:l:vR:")) != -1)
+    {
+        switch(opt)
+        {
+        case 'm':
+            hz = atof(optarg);
+            if(hz <= 0)
+                Usage(argv[0]);
+            mainsfreq = (uint64_t)(hz * 1000.0 + 0.5);
+            break;
+        case 'e':
+            eeprompath = optarg;
+            break;
+        case 'l':
+            linkpath = optarg;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        case 'R':
+            /* Restarted by Reset() */
+            resetfds = optarg;
+            break;
+        default:
+            Usage(argv[0]);
+        }
+    }
+
+    if(resetfds)
+    {
+        if(sscanf(resetfds, "%d,%d", &ptyfd, &eepromfd) != 2)
+            Usage(argv[0]);
+    }
+    else
+    {
+        OpenPty();
+        OpenEeprom(eeprompath);
+    }
+
+    BuildResetArgs(argc, argv);
+    signal(SIGINT, Quit);
+    signal(SIGTERM, Quit);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    LoadEeprom();
+    WaitForOpen();
+
+    /* Starts with the mains detector high, so the first
+       edge is falling (ICES4 is clear after a reset) */
+    zclevel = 1;
+    zcnumber = 1;
+    clock_gettime(CLOCK_MONOTONIC, &starttime);
+
+    /* Interrupts are disabled after a reset */
+    pthread_mutex_lock(&emulock);
+    iflag = 0;
+
+    if(pthread_create(&hwthread, NULL, Hardware, NULL) != 0)
+    {
+        perror("Unable to start the hardware thread");
+        return 1;
+    }
+
+    return FirmwareMain();
+}
@@ -0,0 +1,128 @@
+/*! \file
+ *  \brief     Emulated registers and hooks for running the firmware on a PC
+ *  \details   Included by the stand-ins for the avr-libc headers in this
+ *             directory (avr/io.h, util/atomic.h, etc). The registers
+ *             and hooks are defined in emulator.c
+ *  \author    Benjamin Pritchard (ben@bennyp.org)
+ *  \copyright 2013 Benjamin Pritchard. Released under the MIT License
+ */
+
+#ifndef EMULATOR_H
+#define EMULATOR_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* USART0 */
+extern volatile uint8_t UCSR0A;
+extern volatile uint8_t UCSR0B;
+extern volatile uint8_t UCSR0C;
+extern volatile uint8_t UBRR0H;
+extern volatile uint8_t UBRR0L;
+
+/*! \brief USART0 data register
+
+    Wider than the real one, so the emulator can tell when a byte has
+    been written (it is set to EMU_UDR_EMPTY before the UDRE interrupt)
+*/
+extern volatile uint16_t UDR0;
+#define EMU_UDR_EMPTY 0x100
+
+/* Timer 1 (dimmer timer) */
+extern volatile uint8_t TCCR1A;
+extern volatile uint8_t TCCR1B;
+extern volatile uint8_t TIMSK1;
+extern volatile uint16_t TCNT1;
+extern volatile uint16_t OCR1A;
+extern volatile uint16_t ICR1;
+
+/* Timer 4 (zero-crossing input capture) */
+extern volatile uint8_t TCCR4A;
+extern volatile uint8_t TCCR4B;
+extern volatile uint8_t TIMSK4;
+extern volatile uint16_t TCNT4;
+extern volatile uint16_t ICR4;
+
+/* I/O ports */
+extern volatile uint8_t PORTB;
+extern volatile uint8_t DDRB;
+extern volatile uint8_t PORTG;
+extern volatile uint8_t DDRG;
+extern volatile uint8_t PORTL;
+extern volatile uint8_t DDRL;
+
+/* Bits of the registers above (same as the ATMega1280) */
+#define RXC0    7
+#define TXC0    6
+#define UDRE0   5
+#define FE0     4
+#define DOR0    3
+#define U2X0    1
+
+#define RXCIE0  7
+#define TXCIE0  6
+#define UDRIE0  5
+#define RXEN0   4
+#define TXEN0   3
+
+#define UMSEL01 7
+#define UMSEL00 6
+#define UCSZ01  2
+#define UCSZ00  1
+
+#define ICNC1   7
+#define ICES1   6
+#define WGM13   4
+#define WGM12   3
+#define CS12    2
+#define CS11    1
+#define CS10    0
+#define ICIE1   5
+#define OCIE1A  1
+
+#define ICNC4   7
+#define ICES4   6
+#define WGM43   4
+#define WGM42   3
+#define CS42    2
+#define CS41    1
+#define CS40    0
+#define ICIE4   5
+
+
+/*! \brief Interrupt routines
+
+    ISR(vect) defines Emu_vect (see avr/interrupt.h)
+*/
+void Emu_TIMER4_CAPT_vect(void);
+void Emu_TIMER1_COMPA_vect(void);
+void Emu_TIMER1_CAPT_vect(void);
+void Emu_USART0_RX_vect(void);
+void Emu_USART0_UDRE_vect(void);
+
+
+/*! \brief Enables interrupts (sei()) */
+void Emu_sei(void);
+
+/*! \brief Disables interrupts (cli()) */
+void Emu_cli(void);
+
+/*! \brief Starts an ATOMIC_BLOCK
+
+    Returns whether interrupts were enabled, for Emu_atomicend()
+*/
+uint8_t Emu_atomicbegin(void);
+
+/*! \brief Ends an ATOMIC_BLOCK started with Emu_atomicbegin()
+
+    Always returns zero
+*/
+uint8_t Emu_atomicend(uint8_t state);
+
+/*! \brief Waits for an interrupt (sleep_cpu()) */
+void Emu_sleep(void);
+
+/*! \brief Saves the EEPROM after it has been written */
+void Emu_eepromwrite(void);
+
+#endif
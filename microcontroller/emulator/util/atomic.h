@@ -0,0 +1,20 @@
+/*! \file
+ *  \brief     Stand-in for util/atomic.h when running on a PC (see emulator.c)
+ *  \author    Benjamin Pritchard (ben@bennyp.org)
+ *  \copyright 2013 Benjamin Pritchard. Released under the MIT License
+ */
+
+#ifndef EMU_UTIL_ATOMIC_H
+#define EMU_UTIL_ATOMIC_H
+
+#include "../emulator.h"
+
+/* Interrupts are always restored to what they were. As with
+   avr-libc, the block must not be left with break or return */
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_FORCEON
+
+#define ATOMIC_BLOCK(type) \
+    for(uint8_t emu_state = Emu_atomicbegin(), emu_once = 1; emu_once; emu_once = Emu_atomicend(emu_state))
+
+#endif
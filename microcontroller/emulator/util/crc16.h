@@ -0,0 +1,24 @@
+/*! \file
+ *  \brief     Stand-in for util/crc16.h when running on a PC (see emulator.c)
+ *  \author    Benjamin Pritchard (ben@bennyp.org)
+ *  \copyright 2013 Benjamin Pritchard. Released under the MIT License
+ */
+
+#ifndef EMU_UTIL_CRC16_H
+#define EMU_UTIL_CRC16_H
+
+#include <stdint.h>
+
+/* CRC-8, polynomial 0x07 (same as avr-libc) */
+static inline uint8_t _crc8_ccitt_update(uint8_t crc, uint8_t data)
+{
+    uint8_t i;
+
+    crc ^= data;
+    for(i = 0; i < 8; i++)
+        crc = (crc & 0x80) ? ((crc << 1) ^ 0x07) : (crc << 1);
+
+    return crc;
+}
+
+#endif
@@ -0,0 +1,15 @@
+/*! \file
+ *  \brief     Stand-in for util/delay.h when running on a PC (see emulator.c)
+ *  \author    Benjamin Pritchard (ben@bennyp.org)
+ *  \copyright 2013 Benjamin Pritchard. Released under the MIT License
+ */
+
+#ifndef EMU_UTIL_DELAY_H
+#define EMU_UTIL_DELAY_H
+
+#include <unistd.h>
+
+#define _delay_us(us) usleep(us)
+#define _delay_ms(ms) usleep(1000*(ms))
+
+#endif
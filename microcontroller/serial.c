@@ -6,15 +6,28 @@
  */
 
 #include <avr/io.h>
+#include <avr/interrupt.h>
 
 #include "bits.h"
+#include "commands.h"
 #include "serial.h"
 
+/*! \brief Bytes waiting to be sent */
+static volatile uint8_t txbuffer[TXBUFSIZE];
+
+/*! \brief Index to be written next in txbuffer */
+static volatile uint8_t txhead;
+
+/*! \brief Index to be sent next from txbuffer */
+static volatile uint8_t txtail;
+
 void Serial_init(void)
 {
     /* Synchronous mode */
     /*bit_set(UCSR0C, UMSEL00);*/
 
+    txhead = txtail = 0;
+
     /* Set baud rate */
     UBRR0H = (uint8_t)(MYUBRR>>8);
     UBRR0L = (uint8_t)MYUBRR;
@@ -42,18 +55,69 @@ uint8_t Serial_receive(void)
 }
 
 
+uint8_t Serial_setbaud(uint8_t code)
+{
+    uint16_t ubrr;
+
+    switch(code)
+    {
+    case BAUD_DEFAULT:
+        ubrr = MYUBRR;
+        break;
+    case BAUD_57600:
+        ubrr = SERIAL_UBRR_U2X(57600);
+        break;
+    case BAUD_115200:
+        ubrr = SERIAL_UBRR_U2X(115200);
+        break;
+    case BAUD_250000:
+        ubrr = SERIAL_UBRR_U2X(250000);
+        break;
+    case BAUD_500000:
+        ubrr = SERIAL_UBRR_U2X(500000);
+        break;
+    case BAUD_1000000:
+        ubrr = SERIAL_UBRR_U2X(1000000);
+        break;
+    default:
+        return 0;
+    }
+
+    /* let the transmit buffer drain, and the last
+       byte get all the way out (TXC0 is cleared
+       whenever a byte is sent). Something must have
+       been sent since starting up, or this never returns */
+    while(txhead != txtail);
+    while(!bit_get(UCSR0A, TXC0));
+
+    UBRR0H = (uint8_t)(ubrr>>8);
+    UBRR0L = (uint8_t)ubrr;
+
+    /* The flags in UCSR0A must be written as zero */
+    if(code == BAUD_DEFAULT)
+        UCSR0A = 0;
+    else
+        UCSR0A = (1<<U2X0);
+
+    return 1;
+}
+
+
 void Serial_flush(void)
 {
     /* disable interrupts */
     bit_clear(UCSR0B, RXCIE0);
 
+    /* let the transmit buffer drain, and the last byte get
+       all the way out, as in Serial_setbaud() (the id string
+       is always sent first, so TXC0 does get set) */
+    while(txhead != txtail);
+    while(!bit_get(UCSR0A, TXC0));
+
     /* disable the receiver and transmitter */
     bit_clear(UCSR0B, RXEN0);
     bit_clear(UCSR0B, TXEN0);
 
-    /* wait for any transmissions to finish */
-    while(bit_get(UCSR0A, TXC0));
-
     /* re-enable transmitter & receiver */
     bit_set(UCSR0B, RXEN0);
     bit_set(UCSR0B, TXEN0);
@@ -69,13 +133,24 @@ uint8_t Serial_needsreading(void)
 }
 
 
+uint8_t Serial_txfree(void)
+{
+    return (TXBUFSIZE-1) - ((uint8_t)(txhead - txtail) & (TXBUFSIZE-1));
+}
+
+
 void Serial_send( uint8_t c )
 {
-    /* Wait for empty transmit buffer */
-    while ( ! (bit_get(UCSR0A, UDRE0)) );
+    uint8_t next = (txhead + 1) & (TXBUFSIZE-1);
+
+    /* Wait for room in the transmit buffer */
+    while(next == txtail);
 
-    /* Put data into buffer, sends the data */
-    UDR0 = c;
+    txbuffer[txhead] = c;
+    txhead = next;
+
+    /* The interrupt turns itself off when the buffer is empty */
+    bit_set(UCSR0B, UDRIE0);
 }
 
 
@@ -147,3 +222,27 @@ void Serial_sendarr( const uint8_t * arr, uint8_t len)
         Serial_send(arr[i]);
 }
 
+
+/*! \brief Interrupt for when the transmit register is empty
+
+    Sends the next byte from the transmit buffer, and turns itself
+    off once the buffer is empty.
+*/
+ISR(USART0_UDRE_vect)
+{
+    if(txhead == txtail)
+    {
+        bit_clear(UCSR0B, UDRIE0);
+        return;
+    }
+
+    /* Clear the transmit complete flag (by writing a one)
+       so Serial_setbaud() can tell when this byte is out */
+    UCSR0A = (UCSR0A & (1<<U2X0)) | (1<<TXC0);
+
+    UDR0 = txbuffer[txtail];
+    txtail = (txtail + 1) & (TXBUFSIZE-1);
+
+    if(txhead == txtail)
+        bit_clear(UCSR0B, UDRIE0);
+}
@@ -28,18 +28,50 @@
 /* 38.4k baud */
 #define MYUBRR 25
 
+/* The rate set by MYUBRR is BAUD_DEFAULT. The faster rates */
+/* (see Serial_setbaud()) use double speed (U2X0), so that */
+/* 250k, 500k and 1M are exact at 16MHz. 57.6k and 115.2k */
+/* are off by about 0.8% and 2.1% */
+
+/*! \brief UBRR value for a baud rate in double speed mode (rounded) */
+#define SERIAL_UBRR_U2X(baud) (((F_CPU + 4ul*(baud)) / (8ul*(baud))) - 1)
+
+/*! \brief Bitmap of the baud rates Serial_setbaud() accepts (see commands.h) */
+#define SERIAL_BAUDS ((1<<BAUD_DEFAULT) | (1<<BAUD_57600) | (1<<BAUD_115200) | \
+                      (1<<BAUD_250000) | (1<<BAUD_500000) | (1<<BAUD_1000000))
+
+
+/*! \brief The size of the transmit buffer (in bytes)
+
+    Must be a power of two, and less than or equal to 256.
+    One byte of it is always unused.
+*/
+#define TXBUFSIZE 128
+
 
 /*! \brief Initializes the serial port
 
     Currently, the port is set to 8N1 and the baud rate specified
     by MYUBRR. This function also enables the receiver interrupt.
+    The transmit interrupt is enabled whenever there is something
+    in the transmit buffer.
 */
 void Serial_init(void);
 
 
+/*! \brief Changes the baud rate
+
+    \p code is one of the BAUD_xxx values from commands.h. Anything
+    in the transmit buffer is sent at the old rate first.
+    Returns zero (and changes nothing) if the rate isn't supported.
+*/
+uint8_t Serial_setbaud(uint8_t code);
+
+
 /*! \brief Flushes the serial port receive buffer 
 
-    It will block until it gets something to receive
+    It will block until it gets something to receive. Anything
+    in the transmit buffer is sent first.
 */
 void Serial_flush(void);
 
@@ -57,7 +89,18 @@ uint8_t Serial_needsreading(void);
 
 
 
-/*! \brief Sends a byte through the serial port */
+/*! \brief Returns the number of bytes that can be sent without waiting */
+uint8_t Serial_txfree(void);
+
+
+/*! \brief Sends a byte through the serial port
+
+    The byte is placed in the transmit buffer and sent from the
+    USART0_UDRE interrupt, so this returns immediately unless the buffer
+    is full. In that case, it waits for room rather than dropping the
+    byte, so it must not be called with interrupts disabled.
+    The Serial_send functions below all work this way.
+*/
 void Serial_send( uint8_t c );
 
 /*! \brief Sends 2 bytes through the serial port */
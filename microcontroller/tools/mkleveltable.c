@@ -0,0 +1,101 @@
+/*! \file
+ *  \brief     Generates the table of compare values for the dimmer levels
+ *  \details   Run on the build machine by compile.sh. The output
+ *             (leveltable.h) is included by triaclight.c
+ *  \author    Benjamin Pritchard (ben@bennyp.org)
+ *  \copyright 2013 Benjamin Pritchard. Released under the MIT License
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+
+/*! \brief Number of levels (0-100%) */
+#define LEVEL_COUNT 101
+
+
+/*! \brief Fraction of the power delivered when the triac fires
+           at the given fraction of the half-cycle
+
+    For a sine wave that is switched on at phase angle a (0 to pi),
+    the fraction of the full power delivered is
+    1 - a/pi + sin(2a)/(2pi).
+*/
+static double PowerFraction(double delay)
+{
+    return 1.0 - delay + sin(2.0*M_PI*delay)/(2.0*M_PI);
+}
+
+
+/*! \brief Finds the delay (as a fraction of the half-cycle) giving
+           the requested fraction of the power
+
+    PowerFraction() decreases from 1 to 0, so this is just a bisection.
+*/
+static double DelayForPower(double power)
+{
+    double lo = 0.0, hi = 1.0, mid;
+    int i;
+
+    for(i = 0; i < 60; i++)
+    {
+        mid = (lo + hi)/2.0;
+        if(PowerFraction(mid) > power)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+
+/*! \brief Prints leveltable.h to stdout
+
+    The only argument is the number of timer ticks in
+    a half-cycle (ONETWENTYHERTZ in triaclight.c).
+
+    The delay for each level is first rounded to a fraction
+    of 2^16 and then scaled with the same integer math that
+    the firmware used to do, so the values are exactly the same
+    as they were when they were calculated on the microcontroller.
+*/
+int main(int argc, char ** argv)
+{
+    unsigned long top;
+    unsigned long frac;
+    int level;
+
+    if(argc != 2 || (top = strtoul(argv[1], NULL, 10)) == 0 || top > 65535)
+    {
+        fprintf(stderr, "Usage: %s <ticks per half-cycle>\n", argv[0]);
+        return 1;
+    }
+
+    printf("/* Generated by tools/mkleveltable.c - do not edit */\n\n");
+    printf("#ifndef LEVELTABLE_H\n");
+    printf("#define LEVELTABLE_H\n\n");
+    printf("#include <avr/pgmspace.h>\n\n");
+    printf("/* Ticks per half-cycle the table was generated for */\n");
+    printf("#define LEVELTABLE_TOP %luul\n\n", top);
+    printf("/* Timer compare value for each level (0-100%%) */\n");
+    printf("const uint16_t levelcompare[%d] PROGMEM =\n{", LEVEL_COUNT);
+
+    for(level = 0; level < LEVEL_COUNT; level++)
+    {
+        frac = (unsigned long)floor(DelayForPower(level/100.0)*65536.0 + 0.5);
+        if(frac > 65535)
+            frac = 65535;
+
+        if(level % 10 == 0)
+            printf("\n    ");
+
+        printf("%lu%s", (frac * top) >> 16, (level == LEVEL_COUNT-1) ? "" : ",");
+    }
+
+    printf("\n};\n\n");
+    printf("#endif\n");
+
+    return 0;
+}
@@ -6,67 +6,111 @@
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
-/*#include <avr/pgmspace.h>*/
+#include <avr/pgmspace.h>
+#include <avr/eeprom.h>
+#include <avr/sleep.h>
 #include <util/delay.h>
+#include <util/atomic.h>
+#include <util/crc16.h>
 
 #include "serial.h"
 #include "commands.h"
 #include "bits.h"
+#include "leveltable.h"
 
 
+#ifndef NULL
 #define NULL 0x0
+#endif
 
 /*! \brief The size of the command received buffer (in bytes) 
 
     Note that the buffer is index using a uint8_t. Therefore,
-    BUFSIZE must be less than or equal to 256
+    BUFSIZE must be less than or equal to 256. This is shared with
+    the PC program (through CMDBUF_SIZE) so it can limit how much it
+    sends without waiting for a response.
 */
-#define BUFSIZE 64
+#define BUFSIZE CMDBUF_SIZE
 
 
 /*! \brief Pulse width required to turn on the triac, in microseconds 
 
-    Should be as short as possible
+    The pulse is ended by a later compare match (see SchedulerRun()),
+    so its length doesn't cost any time in the interrupts. It should
+    be longer than the interrupt latency, though, or the pulse will be
+    ended as soon as the interrupt notices the match was missed.
 */
-#define PULSE_WIDTH 3 /* microseconds */
+#define PULSE_WIDTH 10 /* microseconds */
 
+/*! \brief PULSE_WIDTH in ticks of the dimmer timer (running at F_CPU/8) */
+#define PULSE_TICKS (PULSE_WIDTH * (F_CPU/8000000ul))
 
-/*! \brief The number of clock ticks for half of a 60Hz sine wave */
+/*! \brief Feature bits returned by COM_CAPS */
+#define FEATURES (FEAT_SEQ | FEAT_BATCH | FEAT_INFO_DELTA | FEAT_SUBSCRIBE | \
+                  FEAT_FADE | FEAT_SCENES | FEAT_SCHEDULE | FEAT_BAUD | \
+                  FEAT_CRC | FEAT_STATS | FEAT_MAINS)
+
+#if ZCHIST_SIZE & (ZCHIST_SIZE - 1)
+#error ZCHIST_SIZE must be a power of two
+#endif
+
+/*! \brief Events closer than this (in timer ticks) are handled together
+
+    This is about the time it takes to get in and out of the compare
+    interrupt. Firing times closer than this can't be told apart anyway.
+*/
+#define SCHED_MARGIN 16
+
+/*! \brief Number of EEPROM cells the last scene is spread over
+
+    Recalling scenes one after another would otherwise rewrite the
+    same byte each time. Must be less than 16 (see LastSceneCell()).
+*/
+#define LASTSCENE_CELLS 8
+
+/*! \brief Fewest half-cycles between SUB_ONCHANGE status frames while fading
+
+    A fade changes the state every half-cycle, and a frame for each
+    would take nearly all of the link at the default rate. See
+    CheckSubscription().
+*/
+#define SUB_FADE_INTERVAL 6
+
+
+/*! \brief The number of clock ticks for half of a 60Hz sine wave
+
+    This is only the starting point. The actual length of the
+    half-cycle is measured from the zero-crossings (see halfperiod).
+*/
 #define ONETWENTYHERTZ 16667ul
 
+/*! \brief Shortest measured half-cycle that is believed (65Hz) */
+#define HALFPERIOD_MIN ((F_CPU/8ul)/130ul)
 
-/*! \brief Integers representing the fraction of 2^16 for the
-           different levels.
-
-   The level (as a %) is given as the index. This is
-   normalized so that the precentage represent the percentage
-   output power, rather than the percent phase-shift for the
-   sine wave.
-
-   For a given percentage, the level is stored as the fraction of
-   2^16, rather than the fraction of 100. This gets multiplied
-   by ONETWENTYHERTZ and then divided by 2^16, allowing only
-   bit shift operations and not floating point math.
-
-   \note I don't have much in ram at the moment.
-         this may be moved to PROGMEM eventually
-   \warning I don't remember exactly how I did this... 
-*/
- 
-const uint16_t levelarray[101] =
-{
-    65535,57934,55907,54462,53297,52300,51419,50621,49889,49208,
-    48568,47964,47390,46841,46314,45807,45317,44842,44381,43933,
-    43495,43068,42650,42240,41838,41443,41055,40672,40295,39923,
-    39556,39193,38834,38479,38127,37778,37432,37089,36748,36409,
-    36072,35737,35403,35071,34740,34410,34080,33752,33424,33096,
-    32768,32440,32112,31784,31456,31126,30796,30465,30133,29799,
-    29464,29127,28788,28447,28104,27758,27409,27057,26702,26343,
-    25980,25613,25241,24864,24481,24093,23698,23296,22886,22468,
-    22041,21603,21155,20694,20219,19729,19222,18695,18146,17572,
-    16968,16328,15647,14915,14117,13236,12239,11074,9629,7602,
-    00000
-};
+/*! \brief Longest measured half-cycle that is believed (45Hz) */
+#define HALFPERIOD_MAX ((F_CPU/8ul)/90ul)
+
+/*! \brief Fixed-point 1.0 for levelscale (Q15) */
+#define LEVELSCALE_ONE 32768u
+
+
+/*! \brief Timer compare values for the different levels
+
+   The level (as a %) is the index into levelcompare (in PROGMEM),
+   and the value is the time in the half-cycle at which to fire the
+   triac. This is normalized so that the percentage represents the
+   percentage output power, rather than the percent phase-shift for
+   the sine wave.
+
+   The table is generated by tools/mkleveltable.c when building
+   (see compile.sh), for a half-cycle of ONETWENTYHERTZ ticks. The
+   value is then scaled by levelscale for the measured half-cycle.
+*/
+#define LevelCompare(level) ((uint16_t)(((uint32_t)pgm_read_word(&levelcompare[(level)]) * levelscale) >> 15))
+
+#if LEVELTABLE_TOP != ONETWENTYHERTZ
+#error leveltable.h was generated for a different ONETWENTYHERTZ
+#endif
 
 struct DimmerClock;
 
@@ -94,32 +138,55 @@ struct PowerUnit
 
     /*! \brief Pointer to the dimmer that this is connected to */
     volatile struct DimmerClock * dimmer;
+
+    /*! \brief Set to turn the pin on at the start of the next half-cycle (see TurnOn()) */
+    uint8_t turnon;
+
+    /*! \brief The level being faded to (see Fade()) */
+    uint8_t fadetarget;
+
+    /*! \brief Half-cycles left in the fade (zero if not fading) */
+    uint16_t faderemaining;
+
+    /*! \brief The current level of the fade, times 2^16 */
+    uint32_t fadelevel;
+
+    /*! \brief Amount added to fadelevel each half-cycle */
+    int32_t fadestep;
 };
 
 
 /*! \brief A struct for a clock used for dimming a PowerUnit
 
-    The combination of interrupt and interrupt represents the
-    timer interrupt register and bit to be set/cleared when
-    dimming is started or stopped. This prevents unecessary
-    interrupts when thing are not being dimmed.
-    The compare register pointed to by comparereg
-    is set to the appropriate time that represents
-    when to turn on/pulse the triac.
+    Each DimmerClock is a slot in the firing scheduler (see SchedulerRun()).
+    The compare value is the time (on timer 1) in each half-cycle
+    at which to pulse the triac. All the DimmerClocks share the single
+    compare register OCR1A, so there can be more of them than there
+    are compare channels.
+
+    The main loop only writes nextcompare. It is copied to compare
+    at the start of the next half-cycle (see SchedulerRestart()),
+    so a half-cycle never sees a mix of the old and new values.
 */
 struct DimmerClock
 {
     /*! \brief The current level of the dimmer (0-100) */
     uint8_t level;
 
-    /*! \brief The timer interrupt register */
-    volatile uint8_t * interruptreg;
+    /*! \brief Nonzero if the pulse has been sent this half-cycle */
+    uint8_t fired;
 
-    /*! \brief The bit on the timer interrupt register */
-    uint8_t interruptbit;
+    /*! \brief Nonzero while the pulse to the triac is on */
+    uint8_t pulsing;
 
-    /*! \brief Time timer compare register to use */
-    volatile uint16_t * comparereg;
+    /*! \brief The timer value at which the pulse starts (this half-cycle) */
+    uint16_t compare;
+
+    /*! \brief The timer value at which the pulse starts (for the current level) */
+    uint16_t nextcompare;
+
+    /*! \brief The timer value at which the pulse ends (while pulsing) */
+    uint16_t pulseend;
 
     /*! \brief The currently-connected PowerUnit, if any */
     volatile struct PowerUnit * pu;
@@ -133,13 +200,213 @@ volatile struct PowerUnit punits[PU_COUNT];
 volatile struct DimmerClock dimclocks[DIMMER_COUNT];
 
 
-/* \brief Count of the number of zero-crossings */
-/* volatile uint16_t zerocrosscount; */
+/*! \brief Indices of the DimmerClocks in use, sorted by compare value
+
+    Rebuilt by SchedulerUpdate(). Only the first schedcount are valid.
+*/
+volatile uint8_t schedorder[DIMMER_COUNT];
+
+/*! \brief Number of DimmerClocks in schedorder */
+volatile uint8_t schedcount;
+
+/*! \brief The next schedorder, sorted by nextcompare
+
+    Copied to schedorder at the start of the next half-cycle
+*/
+volatile uint8_t nextorder[DIMMER_COUNT];
+
+/*! \brief Number of DimmerClocks in nextorder */
+volatile uint8_t nextcount;
+
+/*! \brief Set when nextorder and the nextcompare values should be used */
+volatile uint8_t schedpending;
+
+/*! \brief Position in schedorder of the next pulse to start */
+volatile uint8_t schednext;
+
+/*! \brief DimmerClocks with a pulse on, in the order they were started
+
+    Since all the pulses are the same width, they end in the same order.
+    A DimmerClock only fires once per half-cycle, so this can't overflow.
+*/
+volatile uint8_t pulsequeue[DIMMER_COUNT];
+
+/*! \brief Index of the oldest entry in pulsequeue */
+volatile uint8_t pulsehead;
+
+/*! \brief Index of the next free entry in pulsequeue */
+volatile uint8_t pulsetail;
+
+
+/*! \brief Count of the number of zero-crossings (half-cycles)
+
+    Incremented on each edge in TIMER4_CAPT_vect, and allowed to wrap
+    (after about a year at 60Hz). Since it is 32 bits, it must be read
+    with interrupts off.
+*/
+volatile uint32_t zerocrosscount;
+
+/*! \brief Count of the times timer 1 has reached TOP
+
+    Incremented in TIMER1_CAPT_vect, and allowed to wrap. This is
+    once per half-cycle, but unlike zerocrosscount it keeps going
+    (at 120Hz) when there is no mains.
+*/
+volatile uint8_t topcount;
 
 /*! \brief The times from the zero-crossing timer represing the
            falling edge [0] and the rising edge [1] */ 
 volatile uint16_t zerocrossstamp[2];
 
+/*! \brief Measured length of a half-cycle, in ticks of the dimmer timer
+
+    Filtered in TIMER4_CAPT_vect, which also uses it as the TOP of
+    timer 1. Starts out as ONETWENTYHERTZ.
+*/
+volatile uint16_t halfperiod;
+
+/*! \brief Set by TIMER4_CAPT_vect when halfperiod has changed */
+volatile uint8_t halfperiodchanged;
+
+/*! \brief TCNT4 when TIMER4_CAPT_vect last zeroed it
+
+    So something that spans a zero crossing can still be
+    timed with timer 4 (see CheckLoopTime())
+*/
+volatile uint16_t zctop;
+
+/*! \brief Time between each of the last ZCHIST_SIZE edges and the one before it
+
+    A ring buffer written by TIMER4_CAPT_vect (see COM_ZC_HISTORY).
+    The next edge goes in zchisthead, which is also the oldest entry.
+*/
+volatile uint16_t zchist[ZCHIST_SIZE];
+
+/*! \brief Index of the entry in zchist for the next edge */
+volatile uint8_t zchisthead;
+
+/*! \brief Statistics of the length of a mains cycle (see COM_MAINS)
+
+    Updated by TIMER4_CAPT_vect on each rising edge. Lengths are in
+    ticks of timer 4.
+*/
+struct Mains
+{
+    uint32_t count;     /*!< Number of cycles measured (zero to start over) */
+    uint32_t mean;      /*!< Running mean, with 8 fractional bits */
+    uint32_t variance;  /*!< Running variance, with 8 fractional bits */
+    uint16_t min;       /*!< Shortest cycle */
+    uint16_t max;       /*!< Longest cycle */
+};
+
+/*! \brief The mains statistics */
+volatile struct Mains mains;
+
+/*! \brief Ratio of halfperiod to LEVELTABLE_TOP (Q15)
+
+    The compare values in levelcompare are multiplied by this.
+    It is only changed in the main loop (see CheckMains()), since
+    calculating it needs a division.
+*/
+uint16_t levelscale;
+
+/*! \brief Version of the state reported through COM_INFO_DELTA
+
+    See UpdateInfoVersions()
+*/
+uint16_t infoversion;
+
+/*! \brief The infoversion at which each COM_INFO field last changed
+
+    Dimmers first, then PowerUnits (see InfoField())
+*/
+uint16_t fieldversion[DIMMER_COUNT+PU_COUNT];
+
+/*! \brief The COM_INFO fields the last time UpdateInfoVersions() was called */
+uint8_t lastinfo[INFO_SIZE];
+
+/*! \brief Subscription flags set by COM_SUBSCRIBE (SUB_ONCHANGE) */
+uint8_t subflags;
+
+/*! \brief Heartbeat period for status frames, in half-cycles (zero for none) */
+uint16_t subperiod;
+
+/*! \brief The infoversion sent in the last status frame (zero for none) */
+uint16_t pushversion;
+
+/*! \brief zerocrosscount when the last status frame was sent */
+uint32_t pushcount;
+
+/*! \brief zerocrosscount the last time the fades were stepped */
+uint32_t fadecount;
+
+/*! \brief Levels waiting to be applied on a given half-cycle (COM_SCHEDULE) */
+struct ScheduledLevels
+{
+    /*! \brief The zerocrosscount on which to apply the levels */
+    uint32_t when;
+
+    /*! \brief Length of the fade to the levels (see Fade()) */
+    uint16_t duration;
+
+    /*! \brief Number of (id, level) pairs (zero if this entry is free) */
+    uint8_t count;
+
+    /*! \brief PowerUnit ids (or PU_ALL) */
+    uint8_t ids[SCHEDULE_MAX];
+
+    /*! \brief Levels for each of the ids */
+    uint8_t levels[SCHEDULE_MAX];
+};
+
+/*! \brief Commands waiting for their half-cycle */
+struct ScheduledLevels schedule[SCHEDULE_QUEUE];
+
+/*! \brief Set after changing the baud rate, until a command arrives at the new rate */
+uint8_t baudpending;
+
+/*! \brief topcount when the baud rate was changed */
+uint8_t baudcount;
+
+/*! \brief Layout of the scenes in the EEPROM
+
+    pucount and scenecount are checked at power-up. If they don't
+    match (never been written, or the layout has changed), the
+    scenes are all cleared.
+*/
+struct SceneStore
+{
+    /*! \brief PU_COUNT when this was written */
+    uint8_t pucount;
+
+    /*! \brief SCENE_COUNT when this was written */
+    uint8_t scenecount;
+
+    /*! \brief What to do at power-up (SCENE_BOOT_OFF or SCENE_BOOT_LAST) */
+    uint8_t bootmode;
+
+    /*! \brief Held the last scene before it was spread over lastscene
+
+        Kept so the scenes stored by older firmware are still found
+    */
+    uint8_t reserved;
+
+    /*! \brief The level of each PowerUnit in each scene (0xFF if the slot is empty) */
+    uint8_t levels[SCENE_COUNT][PU_COUNT];
+
+    /*! \brief The last scene stored or recalled, as a ring of cells
+
+        Each cell has a sequence number in the high four bits, and
+        the slot in the low four bits (0xF for none). A change goes in
+        the cell after the newest one, with the next sequence number.
+        See LastSceneCell().
+    */
+    uint8_t lastscene[LASTSCENE_CELLS];
+};
+
+/*! \brief The scenes (in the EEPROM) */
+struct SceneStore EEMEM scenes;
+
 /*! \brief A buffer for receiving input from the serial port */
 volatile uint8_t serbuffer[BUFSIZE];
 
@@ -150,15 +417,167 @@ volatile uint8_t curRead;
 volatile uint8_t curWrite;
 
 
+/*! \brief Set if the command being processed started with FRAME_START_SEQ */
+uint8_t cmdHasSeq;
+
+/*! \brief The sequence byte of the command being processed
+
+    Only valid if cmdHasSeq is set
+*/
+uint8_t cmdSeq;
+
+/*! \brief Set if the command being processed was CRC-checked (FRAME_START_CRC)
+
+    Its response then has a CRC as well
+*/
+uint8_t cmdHasCrc;
+
+/*! \brief Set in CRC mode (see COM_CRC)
+
+    Only FRAME_START_CRC commands are accepted, and
+    status frames have a CRC
+*/
+uint8_t crcmode;
+
+/*! \brief Set after a bad CRC-checked command
+
+    Anything up to the next start byte is skipped rather than
+    being treated as an invalid start
+*/
+uint8_t resync;
+
+/*! \brief Number of bytes the command at the start of the input buffer takes up
+
+    Zero until enough of it has arrived to tell (see FrameLength()).
+    The command isn't processed until all of it is in the buffer.
+*/
+uint8_t frameneed;
+
+/*! \brief Set if a command was read past the end of what has arrived
+
+    See ReadNextBuff(). The main loop then drops
+    the input, since it has lost track of the commands.
+*/
+uint8_t underrun;
+
+/*! \brief Set by the interrupts that give the main loop something to do
+
+    (received bytes and zero crossings). The main loop sleeps
+    until this is set. See Idle().
+*/
+volatile uint8_t wakeup;
+
+/*! \brief Performance counters (see COM_STATS)
+
+    Times are in ticks of timer 4 (8 CPU cycles). Timer 4 counts up from
+    zero after each zero crossing, and an interrupt can't be interrupted,
+    so the length of an interrupt is just the difference in TCNT4.
+    Counters stop at their maximum rather than wrapping.
+*/
+struct Stats
+{
+    uint16_t rxoverflow;               /*!< Bytes dropped because serbuffer was full */
+    uint16_t overrun;                  /*!< Bytes lost in the USART (DOR0) */
+    uint16_t frameerror;               /*!< Bytes received with a framing error (FE0) */
+    uint8_t buffhigh;                  /*!< Most bytes ever waiting in serbuffer */
+    uint16_t missedzc;                 /*!< Zero crossings that didn't arrive when expected */
+    uint16_t loopmax;                  /*!< Longest main loop iteration */
+    uint16_t isrmax[STATS_ISR_COUNT];  /*!< Longest run of each interrupt (by STATS_ISR_xxx) */
+};
+
+/*! \brief The performance counters */
+volatile struct Stats stats;
+
+/*! \brief TCNT4 when the current main loop iteration started */
+uint16_t loopstart;
+
+/*! \brief Low byte of zerocrosscount when the current main loop iteration started */
+uint8_t loopzc;
+
+
+/*! \brief Adds one to a performance counter, unless it is at its maximum */
+static inline void StatCount(volatile uint16_t * counter)
+{
+    if(*counter != 0xFFFF)
+        (*counter)++;
+}
+
+/*! \brief Records the length of an interrupt, if it is the longest so far
+
+    \p n is the STATS_ISR_xxx number of the interrupt, and \p start
+    is TCNT4 at the start of it.
+*/
+static inline void IsrTime(uint8_t n, uint16_t start)
+{
+    uint16_t t = TCNT4 - start;
+
+    if(t > stats.isrmax[n])
+        stats.isrmax[n] = t;
+}
+
+
+/*! \brief Adds the length of a mains cycle to the statistics
+
+    Called from TIMER4_CAPT_vect. The mean and variance are exponential
+    averages, so this is just shifts and one 16-bit multiplication.
+    The deviation is limited to what fits in 16 bits (with 4 fractional
+    bits), which is about a millisecond.
+*/
+static inline void MainsUpdate(uint16_t cycle)
+{
+    int32_t dev;
+    int16_t d;
+
+    if(mains.count == 0)
+    {
+        mains.mean = (uint32_t)cycle << 8;
+        mains.variance = 0;
+        mains.min = cycle;
+        mains.max = cycle;
+    }
+    else
+    {
+        dev = ((int32_t)cycle << 8) - (int32_t)mains.mean;
+        mains.mean += (dev >> MAINS_SHIFT);
+
+        dev >>= 4;
+        if(dev > 0x7FFF)
+            d = 0x7FFF;
+        else if(dev < -0x7FFF)
+            d = -0x7FFF;
+        else
+            d = dev;
+
+        dev = (int32_t)d * d;
+        mains.variance += ((dev - (int32_t)mains.variance) >> MAINS_SHIFT);
+
+        if(cycle < mains.min)
+            mains.min = cycle;
+        if(cycle > mains.max)
+            mains.max = cycle;
+    }
+
+    mains.count++;
+}
+
+
 /*! \brief Read the next entry in the input buffer
 
-    This takes care of wrapping around the end of the buffer
+    This takes care of wrapping around the end of the buffer. Commands
+    aren't processed until all of it has arrived (see FrameLength()),
+    so the buffer should never be empty. If it is, this doesn't wait
+    for more (which would take the next command's bytes, or hang).
+    It sets underrun and returns zero instead.
 */
 uint8_t ReadNextBuff(void)
 {
     char c;
 
-    while(curRead == curWrite);
+    if(curRead == curWrite)
+    {
+        underrun = 1;
+        return 0;
+    }
 
     c = serbuffer[curRead++];
 
@@ -168,22 +587,238 @@ uint8_t ReadNextBuff(void)
     return c;
 }
 
+/*! \brief Returns the number of bytes in the input buffer */
+uint8_t BuffCount(void)
+{
+    uint8_t w = curWrite;
+
+    if(w >= curRead)
+        return w - curRead;
+    else
+        return BUFSIZE - (curRead - w);
+}
+
+/*! \brief Returns an entry in the input buffer without removing it
+
+    \p offset is from the next entry to be read. As for ReadNextBuff(),
+    if it hasn't been received, underrun is set and zero is returned.
+*/
+uint8_t PeekBuff(uint8_t offset)
+{
+    uint16_t i = curRead + offset;
+
+    if(BuffCount() <= offset)
+    {
+        underrun = 1;
+        return 0;
+    }
+
+    if(i >= BUFSIZE)
+        i -= BUFSIZE;
+
+    return serbuffer[i];
+}
+
 /*! \brief Write the next entry in the input buffer
 
-    This takes care of wrapping around the end of the buffer
+    This takes care of wrapping around the end of the buffer. If the
+    buffer is full, the byte is dropped (and counted in stats) rather than
+    overwriting bytes that haven't been read yet, so at most BUFSIZE-1
+    bytes can be waiting.
 */
 void WriteNextBuff(const uint8_t c)
 {
-    serbuffer[curWrite++] = c;
-    if(curWrite >= BUFSIZE)
-        curWrite = 0;
+    uint8_t next = curWrite + 1;
+    uint8_t count;
+
+    if(next >= BUFSIZE)
+        next = 0;
+
+    if(next == curRead)
+    {
+        StatCount(&stats.rxoverflow);
+        return;
+    }
+
+    serbuffer[curWrite] = c;
+    curWrite = next;
+
+    count = BuffCount();
+    if(count > stats.buffhigh)
+        stats.buffhigh = count;
+}
+
+
+/*! \brief Starts and ends any pulses that are due and sets up the next compare match
+
+    This is the scheduler. Pulses are started in the order of schedorder
+    and ended in the order of pulsequeue, so finding the next event
+    only means looking at the head of each. OCR1A is then set to
+    whichever comes first. Events within SCHED_MARGIN of the counter
+    are handled now rather than taking another interrupt. If the counter
+    gets past the new compare value before it is written, the loop goes
+    around again rather than missing it.
+
+    If there is nothing left to do in this half-cycle, the compare
+    interrupt is turned off until TIMER1_CAPT_vect starts the next one.
+
+    \note Must be run with interrupts off
+*/
+static inline void SchedulerRun(void)
+{
+    volatile struct DimmerClock * dim;
+    uint16_t now, next;
+    uint8_t idx;
+
+    while(1)
+    {
+        now = TCNT1 + SCHED_MARGIN;
+
+        /* End the pulses that are due. Ones that were stopped in the
+           meantime are just dropped */
+        while(pulsehead != pulsetail)
+        {
+            dim = &dimclocks[pulsequeue[pulsehead]];
+            if(dim->pulsing)
+            {
+                if(dim->pulseend > now)
+                    break;
+                bit_clear(*(dim->pu->portreg), dim->pu->portbit);
+                dim->pulsing = 0;
+            }
+            pulsehead++;
+        }
+
+        /* Start the pulses that are due */
+        while(schednext < schedcount)
+        {
+            idx = schedorder[schednext];
+            dim = &dimclocks[idx];
+            if(!dim->fired && dim->pu != NULL)
+            {
+                if(dim->compare > now)
+                    break;
+                bit_set(*(dim->pu->portreg), dim->pu->portbit);
+                dim->fired = 1;
+                dim->pulsing = 1;
+                dim->pulseend = TCNT1 + PULSE_TICKS;
+                pulsequeue[pulsetail++] = idx;
+            }
+            schednext++;
+        }
+
+        /* Find the next event */
+        next = ICR1;
+        if(pulsehead != pulsetail)
+            next = dimclocks[pulsequeue[pulsehead]].pulseend;
+        if(schednext < schedcount && dimclocks[schedorder[schednext]].compare < next)
+            next = dimclocks[schedorder[schednext]].compare;
+
+        if(next >= ICR1)
+        {
+            /* Nothing else this half-cycle */
+            bit_clear(TIMSK1, OCIE1A);
+            return;
+        }
+
+        OCR1A = next;
+        bit_set(TIMSK1, OCIE1A);
+
+        if(TCNT1 < next)
+            return;
+    }
+}
+
+
+/*! \brief Starts a new half-cycle in the scheduler
+
+    Ends any pulses still on, turns on any PowerUnits waiting
+    to be (see TurnOn()), and lets all the DimmerClocks fire again.
+    If the main loop has changed any levels (see SchedulerUpdate()),
+    the new compare values and order are put in place here, between
+    half-cycles, so a level change always starts on a clean half-cycle.
+
+    \note Must be run with interrupts off
+*/
+static inline void SchedulerRestart(void)
+{
+    uint8_t i;
+
+    for(i = 0; i < DIMMER_COUNT; i++)
+    {
+        if(dimclocks[i].pulsing)
+            bit_clear(*(dimclocks[i].pu->portreg), dimclocks[i].pu->portbit);
+        dimclocks[i].pulsing = 0;
+        dimclocks[i].fired = 0;
+    }
+
+    for(i = 0; i < PU_COUNT; i++)
+    {
+        if(punits[i].turnon)
+        {
+            bit_set(*(punits[i].portreg), punits[i].portbit);
+            punits[i].turnon = 0;
+        }
+    }
+
+    if(schedpending)
+    {
+        for(i = 0; i < DIMMER_COUNT; i++)
+            dimclocks[i].compare = dimclocks[i].nextcompare;
+        for(i = 0; i < nextcount; i++)
+            schedorder[i] = nextorder[i];
+        schedcount = nextcount;
+        schedpending = 0;
+    }
+
+    pulsehead = pulsetail = 0;
+    schednext = 0;
+
+    SchedulerRun();
+}
+
+
+/*! \brief Rebuilds the firing order after a DimmerClock was changed
+
+    The DimmerClocks in use are sorted by their nextcompare value
+    (an insertion sort, since there are only a few of them). The
+    new order is used starting with the next half-cycle (see
+    SchedulerRestart()). Calling this again before then just
+    replaces it, so only the latest levels are used.
+*/
+void SchedulerUpdate(void)
+{
+    uint8_t order[DIMMER_COUNT];
+    uint8_t count = 0;
+    uint8_t i, j, k;
+
+    for(i = 0; i < DIMMER_COUNT; i++)
+    {
+        if(dimclocks[i].pu == NULL)
+            continue;
+
+        for(j = count; j > 0 && dimclocks[order[j-1]].nextcompare > dimclocks[i].nextcompare; j--)
+            order[j] = order[j-1];
+        order[j] = i;
+        count++;
+    }
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        for(k = 0; k < count; k++)
+            nextorder[k] = order[k];
+        nextcount = count;
+        schedpending = 1;
+    }
 }
 
 
 /*! \brief Start dimming a power unit at the given level 
 
     Finds the next available dimmer. If no dimmer is available, it
-    returns RES_NODIMMER. Otherwise, returns RES_SUCCESS.
+    returns RES_NODIMMER. Otherwise, returns RES_SUCCESS. A unit that
+    was fully on has its pin cleared right away, so the triac stops
+    conducting at the next zero-crossing and the new level starts there.
     \note pu->dimmer should be checked for NULL prior
           to calling this
 */
@@ -205,130 +840,1199 @@ uint8_t StartDimming(volatile struct PowerUnit * pu, uint8_t level)
     if(dim == NULL)
         return RES_NODIMMER; /* No available dimmers */
 
-    dim->pu = pu;
-
     dim->level = level;
 
-    /* NOT using PROGMEM */
-    *(dim->comparereg) = (((uint32_t)levelarray[level] * (uint32_t)ONETWENTYHERTZ) >> 16);
+    dim->nextcompare = LevelCompare(level);
+
+    /* The dimmer may still be in this half-cycle's schedule
+       (if it was just stopped). Don't let it fire until the
+       new schedule is in place */
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        dim->fired = 1;
+        dim->pu = pu;
+        pu->turnon = 0;
+
+        /* SchedulerRestart() only clears the pins of dimmers
+           that are pulsing, not one held high by TurnOn() */
+        if(pu->state == PUSTATE_ON)
+            bit_clear(*(pu->portreg), pu->portbit);
+    }
+    pu->dimmer = dim;
+
+    pu->state = PUSTATE_DIM;
+
+    /* Add it to the scheduler (starting next half-cycle) */
+    SchedulerUpdate();
+
+    return RES_SUCCESS;
+}
+
+/*! \brief Stops dimming on a given PowerUnit
+
+    \note This does not turn off the pin - it may be left on! 
+*/
+void StopDimming(volatile struct PowerUnit* pu)
+{
+    /* Take it out of the scheduler right away. If a pulse is on, the
+       scheduler will forget about it. It will be skipped for
+       the rest of this half-cycle */
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        pu->dimmer->level = 0;
+        pu->dimmer->pulsing = 0;
+        pu->dimmer->pu = NULL;
+    }
+
+    pu->dimmer = NULL;
+    SchedulerUpdate();
+}
+
+
+/*! \brief Completely turns on a PowerUnit
+
+    This will force the output on the IO pin to be set continuously to 1.
+    As for a dimming level, the pin is set at the start of the
+    next half-cycle (see SchedulerRestart()), so units turned on and
+    dimmed together (ie, by a scheduled command) change on the
+    same half-cycle.
+*/
+void TurnOn(volatile struct PowerUnit* pu)
+{
+    /* Is it currently being dimmed? */
+    if(pu->dimmer == NULL) /* Nope, not being dimmed */
+    {
+            pu->turnon = 1;
+            pu->state = PUSTATE_ON;
+    }
+    else /* It is being dimmed */ 
+    {
+            /* Stop dimming, turn on completely */
+            /**(pu->dimmer->comparereg) = 1000; */ /* may prevent flashes */
+            StopDimming(pu);
+            pu->turnon = 1;
+            pu->state = PUSTATE_ON;
+    }
+}
+
+
+/*! \brief Completely turns off a PowerUnit
+
+    This will force the output on the IO pin to be set continuously to 0.
+    This is done right away, which still only takes effect at the end
+    of the half-cycle: a triac that has been fired keeps conducting
+    until the next zero-crossing.
+*/
+void TurnOff(volatile struct PowerUnit* pu)
+{
+    pu->turnon = 0;
+
+    /* Is it currently being dimmed? */
+    if(pu->dimmer == NULL) /* Nope, not being dimmed */
+    {
+            bit_clear(*(pu->portreg), pu->portbit);
+            pu->state = PUSTATE_OFF;
+    }
+    else /* It is being dimmed */
+    {
+            /* Stop dimming, turn off completely */
+            /**(pu->dimmer->comparereg) = 65535; */ /* may prevent flashes */
+            StopDimming(pu);
+            bit_clear(*(pu->portreg), pu->portbit);
+            pu->state = PUSTATE_OFF;
+    }
+}
+
+
+/*! \brief Change the dimming level of a PowerUnit 
+
+    This stops any fade on the PowerUnit. A new dimming level takes effect at the start of the next
+    half-cycle, so the timer never sees a compare value change
+    partway through one (that used to cause the light to flash
+    momentarily). So does turning a unit fully on (see TurnOn()).
+*/
+uint8_t Level(volatile struct PowerUnit* pu, uint8_t level)
+{
+    uint8_t ret = RES_SUCCESS;
+    uint16_t newreg = 0;
+
+    pu->faderemaining = 0;
+
+    if(level >= 100)
+	TurnOn(pu);
+    else if(level == 0)
+        TurnOff(pu);
+    else
+    {
+        if(pu->dimmer == NULL)
+            ret = StartDimming(pu, level);
+        else
+        {
+            /* see documentation for levelcompare */
+            newreg = LevelCompare(level);
+
+            pu->dimmer->level = level;
+            pu->dimmer->nextcompare = newreg;
+
+            SchedulerUpdate();
+        }
+    }
+
+    return ret;
+}
+
+
+/*! \brief Rescales the dimmers for the measured length of the half-cycle
+
+    If TIMER4_CAPT_vect has measured a new halfperiod, levelscale
+    is recalculated (this is the only division, and it is done here
+    rather than in an interrupt). The compare values of all the
+    dimmers in use are then recalculated from their levels.
+*/
+void CheckMains(void)
+{
+    uint16_t period;
+    uint16_t scale;
+    uint8_t i;
+
+    if(!halfperiodchanged)
+        return;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        period = halfperiod;
+        halfperiodchanged = 0;
+    }
+
+    scale = (((uint32_t)period << 15) + LEVELTABLE_TOP/2) / LEVELTABLE_TOP;
+    if(scale == levelscale)
+        return;
+
+    levelscale = scale;
+
+    for(i = 0; i < DIMMER_COUNT; i++)
+    {
+        if(dimclocks[i].pu != NULL)
+            dimclocks[i].nextcompare = LevelCompare(dimclocks[i].level);
+    }
+
+    SchedulerUpdate();
+}
+
+
+/*! \brief Starts fading a PowerUnit to the given level
+
+    The level is changed a little every half-cycle (see CheckFades()),
+    reaching \p target after \p duration half-cycles. The fade starts
+    from wherever the PowerUnit is (including partway through another fade).
+    A dimmer is needed for the whole fade, even if the PowerUnit starts or
+    ends fully on or off, so this returns RES_NODIMMER if there isn't one.
+    A duration of zero is the same as Level().
+*/
+uint8_t Fade(volatile struct PowerUnit * pu, uint8_t target, uint16_t duration)
+{
+    uint8_t ret;
+    uint8_t from;
+    uint32_t start;
+
+    if(target > 100)
+        target = 100;
+
+    if(pu->state == PUSTATE_ON)
+        from = 100;
+    else if(pu->state == PUSTATE_OFF)
+        from = 0;
+    else
+        from = pu->dimmer->level;
+
+    if(duration == 0 || (from == target && pu->faderemaining == 0))
+        return Level(pu, target);
+
+    if(pu->faderemaining)
+        start = pu->fadelevel;
+    else
+        start = (uint32_t)from << 16;
+
+    if(pu->dimmer == NULL)
+    {
+        ret = StartDimming(pu, (from == 0 ? 1 : 99));
+        if(ret != RES_SUCCESS)
+            return ret;
+    }
+
+    pu->fadelevel = start;
+    pu->fadestep = (((int32_t)target << 16) - (int32_t)start) / (int32_t)duration;
+    pu->fadetarget = target;
+    pu->faderemaining = duration;
+
+    return RES_SUCCESS;
+}
+
+
+/*! \brief Steps any fades that are running
+
+    Each fade is moved along by the number of half-cycles since the
+    last call. Rather than jumping a whole percent at a time, the
+    compare value is interpolated between the levels on either side
+    of the fade's level. The new values are used from the next
+    half-cycle (see SchedulerUpdate()). When a fade is done, the
+    PowerUnit is set to the target with Level().
+
+    Returns nonzero if anything changed
+*/
+uint8_t CheckFades(void)
+{
+    volatile struct PowerUnit * pu;
+    uint32_t count;
+    uint16_t elapsed;
+    uint16_t c0, c1;
+    uint8_t whole, frac;
+    uint8_t changed = 0;
+    uint8_t i;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        count = zerocrosscount;
+    }
+
+    elapsed = (uint16_t)(count - fadecount);
+    if(elapsed == 0)
+        return 0;
+    fadecount = count;
+
+    for(i = 0; i < PU_COUNT; i++)
+    {
+        pu = &punits[i];
+        if(pu->faderemaining == 0)
+            continue;
+
+        changed = 1;
+
+        if(elapsed >= pu->faderemaining)
+        {
+            Level(pu, pu->fadetarget);
+            continue;
+        }
+
+        pu->faderemaining -= elapsed;
+        pu->fadelevel += pu->fadestep * (int32_t)elapsed;
+
+        whole = (pu->fadelevel >> 16);
+        frac = (pu->fadelevel >> 8);
+        if(whole > 99)
+        {
+            whole = 99;
+            frac = 255;
+        }
+
+        /* levelcompare goes down as the level goes up */
+        c0 = LevelCompare(whole);
+        c1 = LevelCompare(whole+1);
+
+        pu->dimmer->level = (whole == 0 ? 1 : whole);
+        pu->dimmer->nextcompare = c0 - (uint16_t)(((uint32_t)(c0 - c1) * frac) >> 8);
+    }
+
+    if(changed)
+        SchedulerUpdate();
+
+    return changed;
+}
+
+
+/*! \brief Returns nonzero if any PowerUnit is fading */
+uint8_t Fading(void)
+{
+    uint8_t i;
+
+    for(i = 0; i < PU_COUNT; i++)
+    {
+        if(punits[i].faderemaining)
+            return 1;
+    }
+
+    return 0;
+}
+
+
+/*! \brief Returns the level a PowerUnit is at (or fading to) */
+uint8_t CurrentLevel(volatile struct PowerUnit * pu)
+{
+    if(pu->faderemaining)
+        return pu->fadetarget;
+    else if(pu->state == PUSTATE_ON)
+        return 100;
+    else if(pu->state == PUSTATE_DIM)
+        return pu->dimmer->level;
+    else
+        return 0;
+}
+
+
+/*! \brief Checks the scenes in the EEPROM, clearing them if needed
+
+    See the SceneStore struct.
+*/
+void InitScenes(void)
+{
+    uint8_t empty[PU_COUNT];
+    uint8_t i;
+
+    if(eeprom_read_byte(&scenes.pucount) == PU_COUNT
+       && eeprom_read_byte(&scenes.scenecount) == SCENE_COUNT)
+        return;
+
+    for(i = 0; i < PU_COUNT; i++)
+        empty[i] = 0xFF;
+
+    for(i = 0; i < SCENE_COUNT; i++)
+        eeprom_update_block(empty, scenes.levels[i], PU_COUNT);
+
+    /* The last cell is the newest */
+    for(i = 0; i < LASTSCENE_CELLS; i++)
+        eeprom_update_byte(&scenes.lastscene[i], (i << 4) | 0x0F);
+
+    eeprom_update_byte(&scenes.bootmode, SCENE_BOOT_OFF);
+    eeprom_update_byte(&scenes.scenecount, SCENE_COUNT);
+    eeprom_update_byte(&scenes.pucount, PU_COUNT);
+}
+
+
+/*! \brief Returns the index of the newest cell of scenes.lastscene
+
+    That is the one whose next cell doesn't have the next sequence
+    number. Since there are fewer than 16 cells, there is always one.
+    If they have never been written (all 0xFF), this is the first.
+*/
+uint8_t LastSceneCell(void)
+{
+    uint8_t i;
+    uint8_t cur, next;
+
+    cur = eeprom_read_byte(&scenes.lastscene[0]);
+
+    for(i = 0; i < LASTSCENE_CELLS-1; i++)
+    {
+        next = eeprom_read_byte(&scenes.lastscene[i+1]);
+        if((next & 0xF0) != (uint8_t)((cur & 0xF0) + 0x10))
+            return i;
+        cur = next;
+    }
+
+    return LASTSCENE_CELLS-1;
+}
+
+
+/*! \brief Returns the last scene stored or recalled (0xFF for none) */
+uint8_t GetLastScene(void)
+{
+    uint8_t slot = eeprom_read_byte(&scenes.lastscene[LastSceneCell()]) & 0x0F;
+
+    return (slot == 0x0F) ? 0xFF : slot;
+}
+
+
+/*! \brief Remembers the last scene stored or recalled
+
+    This is only written if it will be used at power-up, and only
+    if it has changed. Each change goes in the next of the
+    LASTSCENE_CELLS cells, so going back and forth between two
+    scenes doesn't wear out one byte of the EEPROM.
+*/
+void SetLastScene(uint8_t slot)
+{
+    uint8_t i;
+    uint8_t cell;
+
+    if(eeprom_read_byte(&scenes.bootmode) != SCENE_BOOT_LAST)
+        return;
+
+    i = LastSceneCell();
+    cell = eeprom_read_byte(&scenes.lastscene[i]);
+    if((cell & 0x0F) == slot)
+        return;
+
+    if(++i >= LASTSCENE_CELLS)
+        i = 0;
+
+    eeprom_update_byte(&scenes.lastscene[i], (uint8_t)((cell & 0xF0) + 0x10) | slot);
+}
+
+
+/*! \brief Stores the current levels of all the PowerUnits in a scene
+
+    Fades are stored as the level they are fading to.
+    Returns RES_INVALID_ID if the slot is out of range.
+*/
+uint8_t StoreScene(uint8_t slot)
+{
+    uint8_t levels[PU_COUNT];
+    uint8_t i;
+
+    if(slot >= SCENE_COUNT)
+        return RES_INVALID_ID;
+
+    for(i = 0; i < PU_COUNT; i++)
+        levels[i] = CurrentLevel(&punits[i]);
+
+    eeprom_update_block(levels, scenes.levels[slot], PU_COUNT);
+    SetLastScene(slot);
+
+    return RES_SUCCESS;
+}
+
+
+/*! \brief Sets all the PowerUnits to the levels in a scene
+
+    The levels are faded to over \p duration half-cycles (see Fade()).
+    Returns RES_INVALID_ID if the slot is out of range, or
+    RES_NOSCENE if nothing has been stored in it. Otherwise, returns
+    the first error from setting the levels.
+*/
+uint8_t RecallScene(uint8_t slot, uint16_t duration)
+{
+    uint8_t ret = RES_SUCCESS;
+    uint8_t res;
+    uint8_t levels[PU_COUNT];
+    uint8_t i;
+
+    if(slot >= SCENE_COUNT)
+        return RES_INVALID_ID;
+
+    eeprom_read_block(levels, scenes.levels[slot], PU_COUNT);
+
+    for(i = 0; i < PU_COUNT; i++)
+    {
+        if(levels[i] > 100)
+            return RES_NOSCENE;
+    }
+
+    for(i = 0; i < PU_COUNT; i++)
+    {
+        res = Fade(&punits[i], levels[i], duration);
+        if(res != RES_SUCCESS && ret == RES_SUCCESS)
+            ret = res;
+    }
+
+    SetLastScene(slot);
+
+    return ret;
+}
+
+
+/*! \brief Reads a COM_BATCH command from the buffer and applies it
+
+    The command consists of the number of pairs, followed by that
+    many (id, level) pairs. An id of PU_ALL applies the level to all
+    PowerUnits. All the ids are checked before any levels are changed,
+    and then all the levels are applied in one pass.
+
+    Returns the first error (or RES_SUCCESS), and stores the id of the
+    unit that caused it in failid. If there are too many pairs, it
+    returns RES_INVALID_COM without reading them.
+*/
+uint8_t Batch(uint8_t * failid)
+{
+    uint8_t ret = RES_SUCCESS;
+    uint8_t res;
+    uint8_t count;
+    uint8_t i, j;
+    uint8_t ids[BATCH_MAX];
+    uint8_t levels[BATCH_MAX];
+
+    count = ReadNextBuff();
+    if(count > BATCH_MAX)
+        return RES_INVALID_COM;
+
+    for(i = 0; i < count; i++)
+    {
+        ids[i] = ReadNextBuff();
+        levels[i] = ReadNextBuff();
+
+        if(ret == RES_SUCCESS && ids[i] != PU_ALL && (ids[i] > PU_COUNT || ids[i] == 0))
+        {
+            ret = RES_INVALID_ID;
+            *failid = ids[i];
+        }
+    }
+
+    if(ret != RES_SUCCESS)
+        return ret;
+
+    for(i = 0; i < count; i++)
+    {
+        for(j = 0; j < PU_COUNT; j++)
+        {
+            if(ids[i] != PU_ALL && ids[i] != punits[j].id)
+                continue;
+
+            res = Level(&punits[j], levels[i]);
+            if(res != RES_SUCCESS && ret == RES_SUCCESS)
+            {
+                ret = res;
+                *failid = punits[j].id;
+            }
+        }
+    }
+
+    return ret;
+}
+
+
+/*! \brief Reads a COM_SCHEDULE command from the buffer and queues it
+
+    The ids are checked as in Batch(), but the levels aren't applied
+    until CheckSchedule() finds that their half-cycle has come.
+    The current zerocrosscount is stored in \p now. Returns RES_TOOLATE
+    if the half-cycle has already passed, or RES_QUEUEFULL if there
+    is no room. If there are too many pairs, it returns RES_INVALID_COM
+    without reading them.
+*/
+uint8_t Schedule(uint8_t * failid, uint32_t * now)
+{
+    uint8_t ret = RES_SUCCESS;
+    uint8_t i;
+    uint8_t count;
+    uint8_t slot = SCHEDULE_QUEUE;
+    uint16_t duration;
+    uint32_t when = 0;
+    uint8_t ids[SCHEDULE_MAX];
+    uint8_t levels[SCHEDULE_MAX];
+
+    for(i = 0; i < 4; i++)
+        when |= ((uint32_t)ReadNextBuff() << (8*i));
+
+    i = ReadNextBuff(); /* low part */
+    duration = i | ((uint16_t)ReadNextBuff() << 8);
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        *now = zerocrosscount;
+    }
+
+    count = ReadNextBuff();
+    if(count > SCHEDULE_MAX)
+        return RES_INVALID_COM;
+
+    for(i = 0; i < count; i++)
+    {
+        ids[i] = ReadNextBuff();
+        levels[i] = ReadNextBuff();
+
+        if(ret == RES_SUCCESS && ids[i] != PU_ALL && (ids[i] > PU_COUNT || ids[i] == 0))
+        {
+            ret = RES_INVALID_ID;
+            *failid = ids[i];
+        }
+    }
+
+    if(ret != RES_SUCCESS)
+        return ret;
+
+    if((int32_t)(when - *now) <= 0)
+        return RES_TOOLATE;
+
+    for(i = 0; i < SCHEDULE_QUEUE; i++)
+    {
+        if(schedule[i].count == 0)
+        {
+            slot = i;
+            break;
+        }
+    }
+
+    if(slot == SCHEDULE_QUEUE)
+        return RES_QUEUEFULL;
+
+    /* Nothing to do, but still counts as success */
+    if(count == 0)
+        return RES_SUCCESS;
+
+    schedule[slot].when = when;
+    schedule[slot].duration = duration;
+    for(i = 0; i < count; i++)
+    {
+        schedule[slot].ids[i] = ids[i];
+        schedule[slot].levels[i] = levels[i];
+    }
+    schedule[slot].count = count;
+
+    return RES_SUCCESS;
+}
+
+
+/*! \brief Applies any scheduled levels whose half-cycle has come
+
+    This is run on every pass through the main loop. Everything that
+    is due is applied in the same pass, so dimming levels all go into
+    the same update of the dimmer schedule and take effect on the same
+    half-cycle (see SchedulerRestart()), as do units being turned on (see
+    TurnOn()). Turning off is done right away, but a triac that has been
+    fired keeps conducting to the end of the half-cycle, so that lines up
+    too. This is done here rather than
+    in TIMER4_CAPT_vect since Level() is far too slow for an interrupt.
+
+    Returns nonzero if anything was applied
+*/
+uint8_t CheckSchedule(void)
+{
+    uint8_t i, j, k;
+    uint8_t changed = 0;
+    uint32_t count;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        count = zerocrosscount;
+    }
+
+    for(i = 0; i < SCHEDULE_QUEUE; i++)
+    {
+        if(schedule[i].count == 0 || (int32_t)(count - schedule[i].when) < 0)
+            continue;
+
+        for(j = 0; j < schedule[i].count; j++)
+        {
+            for(k = 0; k < PU_COUNT; k++)
+            {
+                if(schedule[i].ids[j] == PU_ALL || schedule[i].ids[j] == punits[k].id)
+                    Fade(&punits[k], schedule[i].levels[j], schedule[i].duration);
+            }
+        }
+
+        schedule[i].count = 0;
+        changed = 1;
+    }
+
+    return changed;
+}
+
+
+/*! \brief Changes the baud rate after a COM_BAUD command
+
+    The response has already been sent at the old rate. Anything
+    received in the meantime was sent at the old rate, and is thrown
+    away. If no command arrives at the new rate within BAUD_FALLBACK
+    half-cycles (counted with topcount, so this works without mains),
+    CheckBaud() goes back to BAUD_DEFAULT.
+*/
+void ChangeBaud(uint8_t code)
+{
+    Serial_setbaud(code);
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        curRead = curWrite = 0;
+    }
+    baudcount = topcount;
+    frameneed = 0;
+
+    baudpending = (code != BAUD_DEFAULT);
+}
+
+
+/*! \brief Goes back to the default baud rate if a change wasn't confirmed
+
+    See ChangeBaud(). A change is confirmed by receiving a COM_NOTHING
+    at the new rate (anything less could just be noise at the wrong rate).
+*/
+void CheckBaud(void)
+{
+    if(!baudpending)
+        return;
+
+    if((uint8_t)(topcount - baudcount) >= BAUD_FALLBACK)
+        ChangeBaud(BAUD_DEFAULT);
+}
+
+
+/*! \brief Starts timing an iteration of the main loop (see CheckLoopTime()) */
+void StartLoopTime(void)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        loopstart = TCNT4;
+        loopzc = (uint8_t)zerocrosscount;
+    }
+}
+
+
+/*! \brief Records the length of the main loop iteration, if it is the longest so far
+
+    This is the time since StartLoopTime(), which doesn't include
+    sleeping. Timer 4 is zeroed at each zero crossing, so if there
+    has been one since, the time before it is added from zctop. An
+    iteration spanning more than one zero crossing is counted as the longest possible.
+*/
+void CheckLoopTime(void)
+{
+    uint16_t now;
+    uint16_t top;
+    uint16_t t;
+    uint8_t zc;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        now = TCNT4;
+        top = zctop;
+        zc = (uint8_t)zerocrosscount;
+    }
+
+    if(zc == loopzc)
+        t = now - loopstart;
+    else if(zc == (uint8_t)(loopzc + 1))
+        t = (top - loopstart) + now;
+    else
+        t = 0xFFFF;
+
+    if(t > stats.loopmax)
+        stats.loopmax = t;
+}
+
+
+/*! \brief Fills buf with the COM_STATS response
+
+    buf must be at least STATS_SIZE bytes. The times are converted
+    from timer ticks to CPU cycles.
+*/
+void BuildStats(uint8_t * buf)
+{
+    struct Stats s;
+    uint32_t cycles;
+    uint8_t i;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        s = stats;
+    }
+
+    buf[STATS_RXOVERFLOW] = s.rxoverflow;
+    buf[STATS_RXOVERFLOW+1] = (s.rxoverflow >> 8);
+    buf[STATS_OVERRUN] = s.overrun;
+    buf[STATS_OVERRUN+1] = (s.overrun >> 8);
+    buf[STATS_FRAMEERROR] = s.frameerror;
+    buf[STATS_FRAMEERROR+1] = (s.frameerror >> 8);
+    buf[STATS_BUFFHIGH] = s.buffhigh;
+    buf[STATS_MISSEDZC] = s.missedzc;
+    buf[STATS_MISSEDZC+1] = (s.missedzc >> 8);
+
+    cycles = (uint32_t)s.loopmax << 3;
+    buf[STATS_LOOPMAX] = cycles;
+    buf[STATS_LOOPMAX+1] = (cycles >> 8);
+    buf[STATS_LOOPMAX+2] = (cycles >> 16);
+    buf[STATS_LOOPMAX+3] = (cycles >> 24);
+
+    for(i = 0; i < STATS_ISR_COUNT; i++)
+    {
+        cycles = (uint32_t)s.isrmax[i] << 3;
+        if(cycles > 0xFFFF)
+            cycles = 0xFFFF;
+
+        buf[STATS_ISRMAX+2*i] = cycles;
+        buf[STATS_ISRMAX+2*i+1] = (cycles >> 8);
+    }
+}
+
+
+/*! \brief Fills buf with the COM_MAINS response
+
+    buf must be at least MAINS_SIZE bytes
+*/
+void BuildMains(uint8_t * buf)
+{
+    struct Mains m;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        m = mains;
+    }
+
+    buf[MAINS_COUNT] = m.count;
+    buf[MAINS_COUNT+1] = (m.count >> 8);
+    buf[MAINS_COUNT+2] = (m.count >> 16);
+    buf[MAINS_COUNT+3] = (m.count >> 24);
+    buf[MAINS_MEAN] = m.mean;
+    buf[MAINS_MEAN+1] = (m.mean >> 8);
+    buf[MAINS_MEAN+2] = (m.mean >> 16);
+    buf[MAINS_MEAN+3] = (m.mean >> 24);
+    buf[MAINS_VARIANCE] = m.variance;
+    buf[MAINS_VARIANCE+1] = (m.variance >> 8);
+    buf[MAINS_VARIANCE+2] = (m.variance >> 16);
+    buf[MAINS_VARIANCE+3] = (m.variance >> 24);
+    buf[MAINS_MIN] = m.min;
+    buf[MAINS_MIN+1] = (m.min >> 8);
+    buf[MAINS_MAX] = m.max;
+    buf[MAINS_MAX+1] = (m.max >> 8);
+}
+
+
+/*! \brief Clears the mains statistics */
+void ResetMains(void)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        mains.count = 0;
+        mains.mean = 0;
+        mains.variance = 0;
+        mains.min = 0;
+        mains.max = 0;
+    }
+}
+
+
+/*! \brief Fills buf with the COM_ZC_HISTORY response
+
+    buf must be at least ZCHIST_RESPONSE_SIZE bytes. Copying zchist
+    with interrupts off would hold up the dimmers, so it is copied
+    with them on, and copied again if an edge arrived in the meantime.
+*/
+void BuildHistory(uint8_t * buf)
+{
+    uint32_t count;
+    uint16_t t;
+    uint8_t head;
+    uint8_t i;
+
+    do
+    {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        {
+            count = zerocrosscount;
+            head = zchisthead;
+
+            /* ICES4 has already been flipped for the next edge */
+            buf[4] = bit_get(TCCR4B, ICES4) ? 0 : 1;
+        }
+
+        for(i = 0; i < ZCHIST_SIZE; i++)
+        {
+            t = zchist[(head + i) & (ZCHIST_SIZE - 1)];
+            buf[5+2*i] = t;
+            buf[6+2*i] = (t >> 8);
+        }
+    } while(zchisthead != head);
+
+    buf[0] = count;
+    buf[1] = (count >> 8);
+    buf[2] = (count >> 16);
+    buf[3] = (count >> 24);
+}
+
+
+/*! \brief Clears the performance counters */
+void ResetStats(void)
+{
+    uint8_t i;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        stats.rxoverflow = 0;
+        stats.overrun = 0;
+        stats.frameerror = 0;
+        stats.buffhigh = 0;
+        stats.missedzc = 0;
+        stats.loopmax = 0;
+        for(i = 0; i < STATS_ISR_COUNT; i++)
+            stats.isrmax[i] = 0;
+    }
+}
+
+
+/*! \brief Fills info with the COM_INFO fields
+
+    info must be at least INFO_SIZE bytes
+*/
+void BuildInfo(uint8_t * info)
+{
+    uint8_t i;
+    uint8_t counter;
+    uint32_t count;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        count = zerocrosscount;
+    }
+
+    info[0] = zerocrossstamp[0]; /* low part */
+    info[1] = (zerocrossstamp[0] >> 8); /* high part */
+    info[2] = zerocrossstamp[1]; /* low part */
+    info[3] = (zerocrossstamp[1] >> 8); /* high part */
+    info[4] = count;
+    info[5] = (count >> 8);
+    info[6] = (count >> 16);
+    info[7] = (count >> 24);
+    counter = INFO_ZC_SIZE;
+    for(i = 0; i < DIMMER_COUNT; i++)
+    {
+        if(dimclocks[i].pu == NULL)
+        {
+            info[counter++] = 0;
+            info[counter++] = 0;
+            info[counter++] = 0;
+            info[counter++] = 0;
+        }
+        else
+        {
+            info[counter++] = dimclocks[i].pu->id;
+            info[counter++] = dimclocks[i].level;
+            info[counter++] = dimclocks[i].nextcompare;
+            info[counter++] = (dimclocks[i].nextcompare >> 8);
+        }
+    }
+
+    for(i = 0; i < PU_COUNT; i++)
+    {
+        info[counter++] = punits[i].id;
+        info[counter++] = punits[i].state;
+
+        if(punits[i].dimmer == NULL)
+            info[counter++] = 0;
+        else
+            info[counter++] = punits[i].dimmer->level;
+
+        info[counter++] = punits[i].fadetarget;
+        info[counter++] = punits[i].faderemaining; /* low part */
+        info[counter++] = (punits[i].faderemaining >> 8); /* high part */
+    }
+}
+
+
+/*! \brief Returns the offset of a field in the COM_INFO response
+
+    Fields 0 to DIMMER_COUNT-1 are the dimmers, followed
+    by the PowerUnits. The size of the field is stored in size.
+*/
+uint8_t InfoField(uint8_t field, uint8_t * size)
+{
+    if(field < DIMMER_COUNT)
+    {
+        *size = INFO_DIMMER_SIZE;
+        return INFO_ZC_SIZE + field*INFO_DIMMER_SIZE;
+    }
+
+    *size = INFO_PU_SIZE;
+    return INFO_ZC_SIZE + DIMMER_COUNT*INFO_DIMMER_SIZE + (field-DIMMER_COUNT)*INFO_PU_SIZE;
+}
+
+
+/*! \brief Checks which COM_INFO fields have changed and updates their versions
+
+    Compares the fields to what they were the last time this was called.
+    If any of them have changed, infoversion is incremented (skipping zero)
+    and the changed fields are stamped with the new version. The zero-crossing
+    stamps are not tracked, since they change every half-cycle.
+*/
+void UpdateInfoVersions(void)
+{
+    uint8_t info[INFO_SIZE];
+    uint8_t field, off, size, i;
+    uint8_t changed = 0;
+    uint16_t newversion = infoversion + 1;
+
+    if(newversion == 0)
+        newversion = 1;
+
+    BuildInfo(info);
+
+    for(field = 0; field < DIMMER_COUNT+PU_COUNT; field++)
+    {
+        off = InfoField(field, &size);
+        for(i = off; i < off+size; i++)
+        {
+            if(info[i] != lastinfo[i])
+            {
+                fieldversion[field] = newversion;
+                changed = 1;
+                break;
+            }
+        }
+    }
+
+    if(changed)
+        infoversion = newversion;
+
+    for(i = 0; i < INFO_SIZE; i++)
+        lastinfo[i] = info[i];
+}
+
+
+/*! \brief Builds a COM_INFO_DELTA response
+
+    Only the fields that changed after version \p since are
+    included. If \p since is zero (or is newer than our version,
+    ie we have been reset) all the fields are included.
+    See commands.h for the format. delta must be at least
+    INFO_DELTA_MAX bytes.
+
+    Returns the length of the response
+*/
+uint8_t InfoDelta(uint16_t since, uint8_t * delta)
+{
+    uint8_t info[INFO_SIZE];
+    uint8_t field, off, size, i;
+    uint8_t all;
+    uint8_t len;
+
+    UpdateInfoVersions();
+    BuildInfo(info);
+
+    all = (since == 0 || (int16_t)(infoversion - since) < 0);
+
+    delta[0] = infoversion; /* low part */
+    delta[1] = (infoversion >> 8); /* high part */
+    len = 2;
+
+    for(i = 0; i < INFO_ZC_SIZE; i++)
+        delta[len++] = info[i];
+
+    for(i = 0; i < INFO_BITMAP_SIZE; i++)
+        delta[len++] = 0;
+
+    for(field = 0; field < DIMMER_COUNT+PU_COUNT; field++)
+    {
+        if(all || (int16_t)(fieldversion[field] - since) > 0)
+        {
+            bit_set(delta[2+INFO_ZC_SIZE+(field>>3)], (field & 7));
+
+            off = InfoField(field, &size);
+            for(i = off; i < off+size; i++)
+                delta[len++] = info[i];
+        }
+    }
+
+    return len;
+}
+
+
+/*! \brief Sends a frame (a response or status frame)
+
+    The frame is the length, the header, and then the payload.
+    If \p crc is nonzero, RES_CRC_FLAG is set in the length
+    and the CRC follows the payload.
+*/
+void SendFrame(const uint8_t * header, uint8_t headerlen,
+               const uint8_t * payload, uint8_t len, uint8_t crc)
+{
+    uint8_t i;
+    uint8_t c;
+    uint8_t sum = 0;
 
-    /* If using PROGMEM */
-    /**(dim->comparereg) = (((uint32_t)pgm_read_word(&levelarray[level]) * (uint32_t)ONETWENTYHERTZ) >> 16);*/
+    c = headerlen + len;
+    if(crc)
+        c |= RES_CRC_FLAG;
 
-    /* Enable the timer interrupt */
-    bit_set(*(dim->interruptreg), dim->interruptbit);
+    Serial_send(c);
+    sum = _crc8_ccitt_update(sum, c);
 
-    pu->dimmer = dim;
+    for(i = 0; i < headerlen; i++)
+    {
+        Serial_send(header[i]);
+        sum = _crc8_ccitt_update(sum, header[i]);
+    }
 
-    pu->state = PUSTATE_DIM;
+    for(i = 0; i < len; i++)
+    {
+        Serial_send(payload[i]);
+        sum = _crc8_ccitt_update(sum, payload[i]);
+    }
 
-    return RES_SUCCESS;
+    if(crc)
+        Serial_send(sum);
 }
 
-/*! \brief Stops dimming on a given PowerUnit
 
-    \note This does not turn off the pin - it may be left on! 
+/*! \brief Sends an unsolicited status frame (COM_STATUS)
+
+    The payload contains whatever changed since the last status frame
+    (see InfoDelta()).
 */
-void StopDimming(volatile struct PowerUnit* pu)
+void PushStatus(void)
 {
-    /* Turn off the timer interrupt */
-    bit_clear(*(pu->dimmer->interruptreg), pu->dimmer->interruptbit);
-    pu->dimmer->level = 0;
-
-    /* turn off the interrupts before doing this! */
-    pu->dimmer->pu = NULL;
-    pu->dimmer = NULL;
-}
+    uint8_t frame[3+INFO_DELTA_MAX];
+    uint8_t len;
 
+    frame[0] = RES_SUCCESS;
+    frame[1] = COM_STATUS;
+    frame[2] = 0;
+    len = InfoDelta(pushversion, frame+3);
 
-/*! \brief Completely turns on a PowerUnit
+    SendFrame(frame, len+3, NULL, 0, crcmode);
 
-    This will force the output on the IO pin to be set continuously to 1
-*/
-void TurnOn(volatile struct PowerUnit* pu)
-{
-    /* Is it currently being dimmed? */
-    if(pu->dimmer == NULL) /* Nope, not being dimmed */
-    {
-            bit_set(*(pu->portreg), pu->portbit);
-            pu->state = PUSTATE_ON;
-    }
-    else /* It is being dimmed */ 
+    pushversion = infoversion;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
     {
-            /* Stop dimming, turn on completely */
-            /**(pu->dimmer->comparereg) = 1000; */ /* may prevent flashes */
-            StopDimming(pu);
-            bit_set(*(pu->portreg), pu->portbit);
-            pu->state = PUSTATE_ON;
+        pushcount = zerocrosscount;
     }
 }
 
 
-/*! \brief Completely turns off a PowerUnit
+/*! \brief Sends status frames if subscribed and they are due
 
-    This will force the output on the IO pin to be set continuously to 0
+    A frame is sent if SUB_ONCHANGE is set and the state has changed
+    since the last one, or if the heartbeat period has passed.
+    \p checkstate should be nonzero if the state may have changed since
+    the last call. While anything is fading, changes are sent at most
+    every SUB_FADE_INTERVAL half-cycles. The end of the fade is sent
+    right away.
 */
-void TurnOff(volatile struct PowerUnit* pu)
+void CheckSubscription(uint8_t checkstate)
 {
-    /* Is it currently being dimmed? */
-    if(pu->dimmer == NULL) /* Nope, not being dimmed */
+    uint32_t count;
+
+    if(subflags == 0 && subperiod == 0)
+        return;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
     {
-            bit_clear(*(pu->portreg), pu->portbit);
-            pu->state = PUSTATE_OFF;
+        count = zerocrosscount;
     }
-    else /* It is being dimmed */
+
+    /* Changes can also wait until there is room to send
+       them. They are all sent together in the next frame */
+    if((subflags & SUB_ONCHANGE) && checkstate)
     {
-            /* Stop dimming, turn off completely */
-            /**(pu->dimmer->comparereg) = 65535; */ /* may prevent flashes */
-            StopDimming(pu);
-            bit_clear(*(pu->portreg), pu->portbit);
-            pu->state = PUSTATE_OFF;
+        UpdateInfoVersions();
+        if(infoversion != pushversion && Serial_txfree() >= 4+INFO_DELTA_MAX &&
+           ((count - pushcount) >= SUB_FADE_INTERVAL || !Fading()))
+        {
+            PushStatus();
+            return;
+        }
+    }
+
+    if(subperiod != 0)
+    {
+        /* A heartbeat can wait until it fits in the transmit buffer,
+           rather than holding up the main loop */
+        if((count - pushcount) >= subperiod && Serial_txfree() >= 4+INFO_DELTA_MAX)
+            PushStatus();
     }
 }
 
 
-/*! \brief Change the dimming level of a PowerUnit 
+/*! \brief Sends the response to the command being processed
 
-    \bug Sometimes the light will flash momentarily. This
-         is possibly due to some timing issues when changing
-         the level while the timer is still running (ie there
-         is a timer interrupt at an inopportune time, or
-         the compare value changes at a bad time)
+    The response consists of the length, the result code, the command,
+    and the unit id. If the command had a sequence byte, RES_SEQ_FLAG
+    is set on the command and the sequence byte follows the id.
+    After that, len bytes of payload are sent. Responses to
+    CRC-checked commands, and all responses in CRC mode, end with a CRC.
 */
-uint8_t Level(volatile struct PowerUnit* pu, uint8_t level)
+void SendResponse(uint8_t ret, uint8_t command, uint8_t id,
+                  const uint8_t * payload, uint8_t len)
 {
-    uint8_t ret = RES_SUCCESS;
-    uint16_t newreg = 0;
-
-    if(level >= 100)
-	TurnOn(pu);
-    else if(level == 0)
-        TurnOff(pu);
-    else
-    {
-        if(pu->dimmer == NULL)
-            ret = StartDimming(pu, level);
-        else
-        {
-            /* see documentation for levelarray */
-            newreg = (((uint32_t)levelarray[level] * (uint32_t)ONETWENTYHERTZ) >> 16);
+    uint8_t header[4];
 
-            /* may prevent some flashes due to errors in timing ? */
-            if(level > pu->dimmer->level && ICR4 >= newreg)
-            {
-               
-               bit_set(PORTB,7);
-               bit_set(*(pu->portreg), pu->portbit);
-               _delay_us(PULSE_WIDTH);
-               bit_clear(*(pu->portreg), pu->portbit);
-            }
+    header[0] = ret;
+    header[1] = command;
+    header[2] = id;
 
-            pu->dimmer->level = level;
-            *(pu->dimmer->comparereg) = newreg;
-        }
+    if(cmdHasSeq)
+    {
+        header[1] |= RES_SEQ_FLAG;
+        header[3] = cmdSeq;
     }
 
-    return ret;
+    SendFrame(header, cmdHasSeq ? 4 : 3, payload, len, cmdHasCrc || crcmode);
 }
 
 
@@ -338,20 +2042,24 @@ uint8_t Level(volatile struct PowerUnit* pu, uint8_t level)
     further information is obtained directly from the buffer
 
     This function also returns the appropriate response through the
-    serial port
+    serial port (see SendResponse())
 */
 uint8_t ProcessCommand(uint8_t command)
 {
     uint8_t ret = RES_SUCCESS;
     uint8_t id = 0;
     uint8_t level = 0;
-    uint8_t i;
     uint8_t counter = 0;
-    uint8_t info[3+INFO_SIZE];
+    uint16_t duration;
+    uint32_t now;
+    uint8_t info[PAYLOAD_MAX];
 
     switch (command)
     {
     case COM_NOTHING:
+        /* Confirms a baud rate change (see CheckBaud()) */
+        baudpending = 0;
+        SendResponse(ret, command, id, NULL, 0);
         break;
 
     case COM_LEVEL:
@@ -362,7 +2070,7 @@ uint8_t ProcessCommand(uint8_t command)
         else
             ret = Level(&punits[id-1], level);
 
-        Serial_send3(ret, command, id);
+        SendResponse(ret, command, id, NULL, 0);
         break;
 
     case COM_ON:
@@ -372,7 +2080,7 @@ uint8_t ProcessCommand(uint8_t command)
         else
             ret = Level(&punits[id-1], 100);
 
-        Serial_send3(ret, command, id);
+        SendResponse(ret, command, id, NULL, 0);
         break;
 
     case COM_OFF:
@@ -382,52 +2090,148 @@ uint8_t ProcessCommand(uint8_t command)
         else
             ret = Level(&punits[id-1], 0);
 
-        Serial_send3(ret, command, id);
+        SendResponse(ret, command, id, NULL, 0);
+        break;
+
+    case COM_BATCH:
+        ret = Batch(&id);
+        SendResponse(ret, command, id, NULL, 0);
         break;
 
     case COM_INFO:
-        info[0] = RES_SUCCESS;
-        info[1] = COM_INFO;
-        info[2] = 0;
-        info[3] = zerocrossstamp[0]; /* low part */
-        info[4] = (zerocrossstamp[0] >> 8); /* high part */
-        info[5] = zerocrossstamp[1]; /* low part */
-        info[6] = (zerocrossstamp[1] >> 8); /* high part */
-        counter = 7;
-        for(i = 0; i < DIMMER_COUNT; i++)
+        BuildInfo(info);
+        SendResponse(ret, command, id, info, INFO_SIZE);
+        break;
+
+    case COM_SUBSCRIBE:
+        subflags = ReadNextBuff();
+        level = ReadNextBuff(); /* low part */
+        subperiod = level | ((uint16_t)ReadNextBuff() << 8);
+
+        /* Next status frame has everything */
+        pushversion = 0;
+        SendResponse(ret, command, id, NULL, 0);
+
+        if(subflags != 0 || subperiod != 0)
+            PushStatus();
+        break;
+
+    case COM_FADE:
+        id = ReadNextBuff();
+        level = ReadNextBuff();
+        counter = ReadNextBuff(); /* low part */
+        duration = counter | ((uint16_t)ReadNextBuff() << 8);
+        if(id > PU_COUNT || id == 0)
+            ret = RES_INVALID_ID;
+        else
+            ret = Fade(&punits[id-1], level, duration);
+
+        SendResponse(ret, command, id, NULL, 0);
+        break;
+
+    case COM_SCENE_STORE:
+        id = ReadNextBuff();
+        ret = StoreScene(id);
+        SendResponse(ret, command, id, NULL, 0);
+        break;
+
+    case COM_SCENE_RECALL:
+        id = ReadNextBuff();
+        counter = ReadNextBuff(); /* low part */
+        duration = counter | ((uint16_t)ReadNextBuff() << 8);
+        ret = RecallScene(id, duration);
+        SendResponse(ret, command, id, NULL, 0);
+        break;
+
+    case COM_SCENE_BOOT:
+        id = ReadNextBuff();
+        if(id != SCENE_BOOT_OFF && id != SCENE_BOOT_LAST)
+            ret = RES_INVALID_ID;
+        else
+            eeprom_update_byte(&scenes.bootmode, id);
+
+        SendResponse(ret, command, id, NULL, 0);
+        break;
+
+    case COM_SCHEDULE:
+        ret = Schedule(&id, &now);
+        if(ret == RES_INVALID_COM)
+            SendResponse(ret, command, id, NULL, 0);
+        else
         {
-            if(dimclocks[i].pu == NULL)
-            {
-                info[counter++] = 0;
-                info[counter++] = 0;
-                info[counter++] = 0;
-                info[counter++] = 0;
-            }
-            else
-            {
-                info[counter++] = dimclocks[i].pu->id;
-                info[counter++] = dimclocks[i].level;
-                info[counter++] = *(dimclocks[i].comparereg);
-                info[counter++] = (*(dimclocks[i].comparereg) >> 8);
-            }
+            info[0] = now;
+            info[1] = (now >> 8);
+            info[2] = (now >> 16);
+            info[3] = (now >> 24);
+            SendResponse(ret, command, id, info, 4);
         }
+        break;
 
-        for(i = 0; i < PU_COUNT; i++)
-        {
-            info[counter++] = punits[i].id;
-            info[counter++] = punits[i].state;
+    case COM_CAPS:
+        info[0] = PROTOCOL_VERSION;
+        info[1] = (FEATURES & 0xFF);
+        info[2] = (FEATURES >> 8);
+        info[3] = SERIAL_BAUDS;
+        info[4] = CMDBUF_SIZE;
+        SendResponse(ret, command, id, info, CAPS_SIZE);
+        break;
 
-            if(punits[i].dimmer == NULL)
-                info[counter++] = 0;
-            else
-                info[counter++] = punits[i].dimmer->level;
-        }
+    case COM_BAUD:
+        id = ReadNextBuff();
+        if(id >= BAUD_COUNT || !(SERIAL_BAUDS & (1<<id)))
+            ret = RES_INVALID_ID;
+
+        SendResponse(ret, command, id, NULL, 0);
+
+        /* The response goes out at the old rate */
+        if(ret == RES_SUCCESS)
+            ChangeBaud(id);
+        break;
+
+    case COM_CRC:
+        id = ReadNextBuff();
+        if(id > 1)
+            ret = RES_INVALID_ID;
+
+        /* The response is sent in the old mode */
+        SendResponse(ret, command, id, NULL, 0);
+
+        if(ret == RES_SUCCESS)
+            crcmode = id;
+        break;
+
+    case COM_STATS:
+        id = ReadNextBuff();
+        BuildStats(info);
+        SendResponse(ret, command, id, info, STATS_SIZE);
+
+        if(id & STATS_RESET)
+            ResetStats();
+        break;
+
+    case COM_MAINS:
+        id = ReadNextBuff();
+        BuildMains(info);
+        SendResponse(ret, command, id, info, MAINS_SIZE);
+
+        if(id & MAINS_RESET)
+            ResetMains();
+        break;
+
+    case COM_ZC_HISTORY:
+        BuildHistory(info);
+        SendResponse(ret, command, id, info, ZCHIST_RESPONSE_SIZE);
+        break;
 
-        Serial_sendarr(info, INFO_SIZE+3);
+    case COM_INFO_DELTA:
+        level = ReadNextBuff(); /* low part */
+        counter = InfoDelta(level | ((uint16_t)ReadNextBuff() << 8), info);
+        SendResponse(ret, command, id, info, counter);
         break;
+
     default:
         ret = RES_INVALID_COM;
-        Serial_send3(ret, command, id);
+        SendResponse(ret, command, id, NULL, 0);
         break;
     }
 
@@ -435,21 +2239,218 @@ uint8_t ProcessCommand(uint8_t command)
 }
 
 
+/*! \brief Returns the number of argument bytes of a command
+
+    For COM_BATCH and COM_SCHEDULE, this is up to and including the
+    count of (id, level) pairs. Unknown commands have none.
+*/
+uint8_t CommandArgs(uint8_t command)
+{
+    switch(command)
+    {
+    case COM_ON:
+    case COM_OFF:
+    case COM_BATCH:
+    case COM_SCENE_STORE:
+    case COM_SCENE_BOOT:
+    case COM_BAUD:
+    case COM_CRC:
+    case COM_STATS:
+    case COM_MAINS:
+        return 1;
+    case COM_LEVEL:
+    case COM_INFO_DELTA:
+        return 2;
+    case COM_SUBSCRIBE:
+    case COM_SCENE_RECALL:
+        return 3;
+    case COM_FADE:
+        return 4;
+    case COM_SCHEDULE:
+        return 7;
+    default:
+        return 0;
+    }
+}
+
+
+/*! \brief Returns the number of bytes the command at the start of the input buffer takes up
+
+    Only looks at what has already arrived, and returns zero if that
+    isn't enough to tell. Anything that isn't the start of a command
+    takes up one byte.
+*/
+uint8_t FrameLength(void)
+{
+    uint8_t n = BuffCount();
+    uint8_t c;
+    uint8_t header;
+    uint8_t command;
+    uint8_t count;
+    uint8_t len;
+
+    if(n == 0)
+        return 0;
+
+    c = PeekBuff(0);
+
+    if(c == FRAME_START_CRC)
+    {
+        if(n < 2)
+            return 0;
+
+        /* A bad length is answered once the sequence and command
+           bytes are here. Whether it fits the command is checked
+           once the CRC has been (see ProcessFrame()) */
+        len = PeekBuff(1);
+        if(len < 2 || len > FRAME_LEN_MAX)
+            return 3;
+
+        return len + 3;
+    }
+
+    if(crcmode || (c != FRAME_START && c != FRAME_START_SEQ))
+        return 1;
+
+    header = (c == FRAME_START_SEQ) ? 2 : 1;
+    if(n <= header)
+        return 0;
+
+    command = PeekBuff(header);
+    len = header + 1 + CommandArgs(command);
+
+    /* The (id, level) pairs follow the count. Too many pairs
+       is an invalid command, which is found without reading them */
+    if(command == COM_BATCH || command == COM_SCHEDULE)
+    {
+        if(n < len)
+            return 0;
+
+        count = PeekBuff(len-1);
+        if(count <= (command == COM_BATCH ? BATCH_MAX : SCHEDULE_MAX))
+            len += 2*count;
+    }
+
+    return len;
+}
+
+
+/*! \brief Sleeps (in idle mode) until an interrupt sets wakeup
+
+    The check is made with interrupts off. The instruction after sei()
+    always runs before any interrupt, so nothing can arrive between the
+    check and going to sleep. The timers and the USART keep running
+    in idle mode, so the dimming isn't affected.
+*/
+void Idle(void)
+{
+    cli();
+    if(!wakeup)
+    {
+        sleep_enable();
+        sei();
+        sleep_cpu();
+        sleep_disable();
+    }
+    sei();
+}
+
+
+/*! \brief Checks and processes a CRC-checked command (FRAME_START_CRC)
+
+    The start byte has already been read, and all of the frame has
+    arrived (see FrameLength()). Nothing in it is used until the CRC
+    is checked. If it doesn't match, a RES_BADCRC
+    response is sent and only the start byte is dropped, so the parser picks
+    up again at the next start byte (which may be inside the bad frame if
+    a byte was lost).
+
+    A frame with a good CRC whose length doesn't match the command (and
+    its arguments) gets a RES_INVALID_COM response, and is skipped
+    without being run.
+
+    Returns zero if the frame was bad.
+*/
+uint8_t ProcessFrame(void)
+{
+    uint8_t len;
+    uint8_t i;
+    uint8_t command;
+    uint8_t need;
+    uint8_t count;
+    uint8_t sum = 0;
+    uint16_t end;
+
+    len = PeekBuff(0);
+
+    if(len >= 2 && len <= FRAME_LEN_MAX)
+    {
+        for(i = 0; i <= len; i++)
+            sum = _crc8_ccitt_update(sum, PeekBuff(i));
+    }
+
+    cmdHasSeq = 1;
+    cmdHasCrc = 1;
+    cmdSeq = PeekBuff(1);
+
+    if(len < 2 || len > FRAME_LEN_MAX || sum != PeekBuff(len+1))
+    {
+        SendResponse(RES_BADCRC, PeekBuff(2), 0, NULL, 0);
+        return 0;
+    }
+
+    end = (uint16_t)curRead + len + 2;
+    if(end >= BUFSIZE)
+        end -= BUFSIZE;
+
+    /* The arguments must fill the frame exactly, or ProcessCommand
+       would read past the end of it (or leave some behind) */
+    command = PeekBuff(2);
+    need = 2 + CommandArgs(command);
+
+    if((command == COM_BATCH || command == COM_SCHEDULE) && len >= need)
+    {
+        count = PeekBuff(need);
+        if(count <= (command == COM_BATCH ? BATCH_MAX : SCHEDULE_MAX))
+            need += 2*count;
+    }
+
+    if(len != need)
+    {
+        SendResponse(RES_INVALID_COM, command, 0, NULL, 0);
+        curRead = end;
+        return 1;
+    }
+
+    /* Skip the length & sequence bytes. ProcessCommand
+       reads the arguments as usual */
+    ReadNextBuff();
+    ReadNextBuff();
+    command = ReadNextBuff();
+    ProcessCommand(command);
+
+    /* Skip the CRC (and anything the command didn't read). COM_BAUD
+       has already emptied the buffer, though (see ChangeBaud()) */
+    if(command != COM_BAUD)
+        curRead = end;
+
+    return 1;
+}
+
+
 /*! \brief Creates a new dimmer clock object
 
-    For a description of the parameters, see
-    the details for the DimmerClock struct
+    See the details for the DimmerClock struct
 */
-void NewDimmerClock(volatile struct DimmerClock * dim,
-                 volatile uint8_t * interruptreg,
-                 uint8_t interruptbit,
-                 volatile uint16_t * comparereg)
+void NewDimmerClock(volatile struct DimmerClock * dim)
 {
-    dim->interruptreg = interruptreg;
-    dim->interruptbit = interruptbit;
-    dim->comparereg = comparereg;
     dim->pu = NULL;
     dim->level = 0;
+    dim->fired = 0;
+    dim->pulsing = 0;
+    dim->compare = 0;
+    dim->nextcompare = 0;
+    dim->pulseend = 0;
 }
 
 /*! \brief Creates a new PowerUnit object
@@ -467,6 +2468,11 @@ void NewPowerUnit(volatile struct PowerUnit * pu,
     pu->portreg = portreg;
     pu->portbit = portbit;
     pu->dimmer = NULL;
+    pu->turnon = 0;
+    pu->fadetarget = 0;
+    pu->faderemaining = 0;
+    pu->fadelevel = 0;
+    pu->fadestep = 0;
 }
 
 
@@ -491,16 +2497,40 @@ int main(void)
     NewPowerUnit(&punits[1], PU_LIGHT2, &PORTG, 1);
     NewPowerUnit(&punits[2], PU_RECEPTACLE, &PORTG, 2);
 
-    NewDimmerClock(&dimclocks[0], &TIMSK1, OCIE1A, &OCR1A);
-    NewDimmerClock(&dimclocks[1], &TIMSK1, OCIE1B, &OCR1B);
-    NewDimmerClock(&dimclocks[2], &TIMSK1, OCIE1C, &OCR1C);
-    NewDimmerClock(&dimclocks[3], &TIMSK3, OCIE3A, &OCR3A);
-    NewDimmerClock(&dimclocks[4], &TIMSK3, OCIE3B, &OCR3B);
-    NewDimmerClock(&dimclocks[5], &TIMSK3, OCIE3C, &OCR3C);
+    for(c = 0; c < DIMMER_COUNT; c++)
+        NewDimmerClock(&dimclocks[c]);
 
     /* Initialize */
     curRead = curWrite = 0;
-    /* zerocrosscount = 0; */
+    schedcount = schednext = 0;
+    nextcount = schedpending = 0;
+    pulsehead = pulsetail = 0;
+    infoversion = 1;
+    for(c = 0; c < DIMMER_COUNT+PU_COUNT; c++)
+        fieldversion[c] = 1;
+    zerocrosscount = 0;
+    halfperiod = ONETWENTYHERTZ;
+    halfperiodchanged = 0;
+    levelscale = LEVELSCALE_ONE;
+    subflags = 0;
+    subperiod = 0;
+    pushversion = 0;
+    pushcount = 0;
+    fadecount = 0;
+    for(c = 0; c < SCHEDULE_QUEUE; c++)
+        schedule[c].count = 0;
+    baudpending = 0;
+    topcount = 0;
+    baudcount = 0;
+    cmdHasCrc = 0;
+    crcmode = 0;
+    resync = 0;
+    frameneed = 0;
+    underrun = 0;
+    zctop = 0;
+    zchisthead = 0;
+    ResetStats();
+    ResetMains();
 
     /* Initialize the serial port */
     Serial_init();
@@ -541,31 +2571,40 @@ int main(void)
     /****************************************/
     /* Dimmer Timer setup                   */
     /****************************************/
-    /* Timers 1&3 are the phase shift delay */
+    /* Timer 1 is the phase shift delay */
     /* Run in CTC mode at fcpu/8 */
-    /* Interrupts initially off, levels at 0 */
-    /* The max value is set to the zero crossing time */
+    /* The max value is set to the zero crossing time, */
+    /*  and follows the measured time from then on */
+    /* The input capture interrupt (which happens at TOP in */
+    /*  this mode) starts each half-cycle in the scheduler. */
+    /*  The compare A interrupt is turned on by the scheduler */
+    /*  when there is something to do */
     bit_set(TCCR1B, WGM13);
     bit_set(TCCR1B, WGM12);
     ICR1 = ONETWENTYHERTZ;
+    bit_set(TIMSK1, ICIE1);
     bit_set(TCCR1B, CS11);
 
-    bit_set(TCCR3B, WGM33);
-    bit_set(TCCR3B, WGM32);
-    ICR3 = ONETWENTYHERTZ;
-    bit_set(TCCR3B, CS31);
-
-    /* sleep_enable(); */
+    /* Sleep in idle mode when there's nothing to do (see Idle()) */
+    set_sleep_mode(SLEEP_MODE_IDLE);
 
     /*  Enable global interrupts */
     sei();
 
+    /* Restore the last scene, if asked to */
+    InitScenes();
+    if(eeprom_read_byte(&scenes.bootmode) == SCENE_BOOT_LAST)
+        RecallScene(GetLastScene(), 0);
+
     /* Send the identification string */
     Serial_send6(0,0,0,'B','e','n');
 
     while(1)
     {
-        /* sleep_cpu(); */
+        /* Anything that happens from here on is handled
+           before sleeping again */
+        wakeup = 0;
+        StartLoopTime();
 
         /*while(Serial_needsreading())
             WriteNextBuff(Serial_receive());*/
@@ -579,24 +2618,81 @@ int main(void)
             zerocrosscount =0;
         }*/
 
-        /* Check for new commands & process them */
-        if(curRead != curWrite)
+        /* Follow the mains frequency */
+        CheckMains();
+
+        /* Undo a baud rate change that didn't work */
+        CheckBaud();
+
+        /* Apply scheduled levels and step the fades, and send
+           heartbeat (or fade) status frames */
+        c = CheckSchedule();
+        c |= CheckFades();
+        CheckSubscription(c);
+
+        /* Check for new commands & process them. A command
+           is only started once all of it has arrived, so the loop
+           never waits for the rest of one */
+        if(frameneed == 0)
+            frameneed = FrameLength();
+
+        if(frameneed == 0 || BuffCount() < frameneed)
         {
+            CheckLoopTime();
+            Idle();
+        }
+        else
+        {
+            frameneed = 0;
             c = ReadNextBuff();
-            if( c == '\\')
+            if(c == FRAME_START_CRC)
+            {
+                /* Any errors are handled without losing track
+                   of where commands start */
+                resync = !ProcessFrame();
+                CheckSubscription(1);
+            }
+            else if(!crcmode && (c == FRAME_START || c == FRAME_START_SEQ))
             {
-                if(ProcessCommand((uint8_t) ReadNextBuff()) != RES_SUCCESS)
+                resync = 0;
+                cmdHasCrc = 0;
+                cmdHasSeq = (c == FRAME_START_SEQ);
+                if(cmdHasSeq)
+                    cmdSeq = ReadNextBuff();
+
+                /* Other errors happen after the whole command has been
+                   read, so anything after it in the buffer is still good.
+                   For an invalid command, we don't know where the
+                   next one starts */
+                if(ProcessCommand((uint8_t) ReadNextBuff()) == RES_INVALID_COM)
                 {
                     Serial_flush();
                     curRead = curWrite = 0;
                 }
+
+                /* The command may have changed the state */
+                CheckSubscription(1);
             }
-            else
+            else if(!crcmode && !resync)
             {
                 Serial_send3(RES_INVALID_START,c,0);
                 Serial_flush();
                 curRead = curWrite = 0;
             }
+
+            /* Otherwise, it is noise or the rest of a bad frame, and
+               is skipped until the next start byte */
+
+            /* Shouldn't happen, but a command that was cut
+               short leaves us not knowing where the next one starts */
+            if(underrun)
+            {
+                underrun = 0;
+                Serial_flush();
+                curRead = curWrite = 0;
+            }
+
+            CheckLoopTime();
         }
     }
 
@@ -611,24 +2707,82 @@ int main(void)
     register TCCR4B, bit ICES4). It records the timestamp
     in zerocrossstamp.
 
-    After detecting a rising edge, it adjusts the counters for the dimmer clocks
-    to what would be expected so that they remain in sync.
+    After detecting a rising edge, it measures the length of the
+    half-cycle (the average of the last two edges, so the detector
+    being lopsided doesn't matter) and filters it into halfperiod,
+    which becomes the TOP of the dimmer timer. Measurements outside of
+    HALFPERIOD_MIN and HALFPERIOD_MAX (noise, missed edges) are ignored.
+    Small changes are smoothed by 1/8 per cycle (rounded to nearest, so
+    it settles within 4 ticks either side of the measurement rather than
+    up to 7 below, as the shift alone would), but a large change
+    (ie, 60Hz to 50Hz) is taken right away. It then adjusts the counter
+    of the dimmer timer to what would be expected so that they remain in sync.
+    Only shifts and adds are used here; the compare values are
+    rescaled in the main loop (CheckMains()).
 */
 ISR(TIMER4_CAPT_vect)
 {
-    /* Adjust the dimmer timers' counters continuously
+    uint16_t start = TCNT4;
+    uint16_t oldcount;
+    uint16_t measured;
+    int16_t diff;
+    uint8_t i;
+
+    /* Timer 4 was zeroed at the last edge, so this is the time since
+       then. Well over a half-cycle means an edge was missed (but not
+       for the first one, when the timer has been running since startup) */
+    if(ICR4 > halfperiod + (halfperiod >> 1) && zerocrosscount != 0)
+        StatCount(&stats.missedzc);
+
+    /* Adjust the dimmer timer's counter continuously
        Do this only on the rising edge. We
        can calculate what the other counter should be at this point
-       TCNT3 = ((zerocrossstamp[0] + zerocrossstamp[1])/2 - ICR4)/2 + ICR4
+       TCNT1 = ((zerocrossstamp[0] + zerocrossstamp[1])/2 - ICR4)/2 + ICR4
           ...some algebra...
-       TCNT3 = (zerocrossstamp[0] + zerocrossstamp[1] + (2*ICR4))/4;
+       TCNT1 = (zerocrossstamp[0] + zerocrossstamp[1] + (2*ICR4))/4;
           ...then use bit shifts rather than multiplication
     */
     if(bit_get(TCCR4B, ICES4))
     {
-        TCNT1 = TCNT3 = ((zerocrossstamp[0] + zerocrossstamp[1] + (ICR4<<1))>>2);
+        measured = (zerocrossstamp[0] + ICR4) >> 1;
+        if(measured >= HALFPERIOD_MIN && measured <= HALFPERIOD_MAX)
+        {
+            MainsUpdate(zerocrossstamp[0] + ICR4);
+
+            diff = measured - halfperiod;
+            if(diff > (int16_t)(halfperiod >> 5) || diff < -(int16_t)(halfperiod >> 5))
+                halfperiod = measured;
+            else
+                halfperiod += ((diff + 4) >> 3);
+
+            if(ICR1 != halfperiod)
+            {
+                ICR1 = halfperiod;
+                halfperiodchanged = 1;
+            }
+        }
+
+        oldcount = TCNT1;
+        TCNT1 = ((zerocrossstamp[0] + zerocrossstamp[1] + (ICR4<<1))>>2);
+
+        /* Don't let it miss TOP if the half-cycle got shorter */
+        if(TCNT1 >= ICR1)
+            TCNT1 = ICR1 - 1;
+
+        /* Move the ends of any pulses that are on along with the counter,
+           and catch up on anything that was skipped over */
+        for(i = 0; i < DIMMER_COUNT; i++)
+        {
+            if(dimclocks[i].pulsing)
+                dimclocks[i].pulseend += TCNT1 - oldcount;
+        }
+        SchedulerRun();
     }
 
+    /* Keep a history for COM_ZC_HISTORY */
+    zchist[zchisthead] = ICR4;
+    zchisthead = (zchisthead + 1) & (ZCHIST_SIZE - 1);
+
     /* Store the timestamp */
 
     /* I don't know why the following line doesn't work */
@@ -642,9 +2796,12 @@ ISR(TIMER4_CAPT_vect)
     bit_flip(TCCR4B, ICES4);
 
     /* Increment the counter */
-    /*zerocrosscount++;*/
+    zerocrosscount++;
+    wakeup = 1;
     
-    /* Zero the timer counter */
+    /* Zero the timer counter, after noting how far it got */
+    IsrTime(STATS_ISR_ZEROCROSS, start);
+    zctop = TCNT4;
     TCNT4 = 0;
 
 }
@@ -655,64 +2812,55 @@ ISR(TIMER4_CAPT_vect)
 
 /*! \brief Timer interrupt for phase-shifting 
 
-   Gets run when the pulse must be sent to the triac
-   to turn on the circuit. The value at which this gets
-   called is set with Level()
+   Gets run when a pulse must be sent to a triac
+   to turn on the circuit, or when a pulse should
+   end. See SchedulerRun().
 */
 ISR(TIMER1_COMPA_vect)
 {
-    bit_set(*(dimclocks[0].pu->portreg), dimclocks[0].pu->portbit);
-    _delay_us(PULSE_WIDTH);
-    bit_clear(*(dimclocks[0].pu->portreg), dimclocks[0].pu->portbit);
-}
-
-/*! \copydoc ISR(TIMER1_COMPA_vect) */
-ISR(TIMER1_COMPB_vect)
-{
-    bit_set(*(dimclocks[1].pu->portreg), dimclocks[1].pu->portbit);
-    _delay_us(PULSE_WIDTH);
-    bit_clear(*(dimclocks[1].pu->portreg), dimclocks[1].pu->portbit);
-}
+    uint16_t start = TCNT4;
 
-/*! \copydoc ISR(TIMER1_COMPA_vect) */
-ISR(TIMER1_COMPC_vect)
-{
-    bit_set(*(dimclocks[2].pu->portreg), dimclocks[2].pu->portbit);
-    _delay_us(PULSE_WIDTH);
-    bit_clear(*(dimclocks[2].pu->portreg), dimclocks[2].pu->portbit);
+    SchedulerRun();
+    IsrTime(STATS_ISR_COMPARE, start);
 }
 
-/*! \copydoc ISR(TIMER1_COMPA_vect) */
-ISR(TIMER3_COMPA_vect)
-{
-    bit_set(*(dimclocks[3].pu->portreg), dimclocks[3].pu->portbit);
-    _delay_us(PULSE_WIDTH);
-    bit_clear(*(dimclocks[3].pu->portreg), dimclocks[3].pu->portbit);
-}
+/*! \brief Timer interrupt for the start of a half-cycle
 
-/*! \copydoc ISR(TIMER1_COMPA_vect) */
-ISR(TIMER3_COMPB_vect)
+   In CTC mode with ICR1 as TOP, this gets run when timer 1
+   reaches TOP (rather than on an input capture). Since timer 1 is
+   kept in step with the zero-crossings (see TIMER4_CAPT_vect), this
+   is where new levels are put in place. See SchedulerRestart().
+*/
+ISR(TIMER1_CAPT_vect)
 {
-    bit_set(*(dimclocks[4].pu->portreg), dimclocks[4].pu->portbit);
-    _delay_us(PULSE_WIDTH);
-    bit_clear(*(dimclocks[4].pu->portreg), dimclocks[4].pu->portbit);
-}
+    uint16_t start = TCNT4;
 
-/*! \copydoc ISR(TIMER1_COMPA_vect) */
-ISR(TIMER3_COMPC_vect)
-{
-    bit_set(*(dimclocks[5].pu->portreg), dimclocks[5].pu->portbit);
-    _delay_us(PULSE_WIDTH);
-    bit_clear(*(dimclocks[5].pu->portreg), dimclocks[5].pu->portbit);
+    topcount++;
+    SchedulerRestart();
+    IsrTime(STATS_ISR_TOP, start);
 }
 
 /* \brief Interrupt routine for receiving commands through the serial port 
 
    If data is received from the serial port, this function is called, which
-   just writes it to the command buffer (serbuffer)
+   just writes it to the command buffer (serbuffer). Overruns and
+   framing errors are counted in stats.
 */
 ISR(USART0_RX_vect)
 {
+    uint16_t start = TCNT4;
+    uint8_t status = UCSR0A;
+
+    /* The error flags are for the byte in UDR0,
+       so they must be read before it is */
+    if(bit_get(status, DOR0))
+        StatCount(&stats.overrun);
+    if(bit_get(status, FE0))
+        StatCount(&stats.frameerror);
+
     WriteNextBuff(Serial_receive());
+    wakeup = 1;
+
+    IsrTime(STATS_ISR_RX, start);
 }
 
@@ -1,35 +1,19 @@
 #-------------------------------------------------
 #
-# Project created by QtCreator 2013-05-30T22:15:31
+# Builds everything on the PC side:
+#   core   - library for talking to the microcontroller (no widgets)
+#   gui    - the Qt Widgets GUI (BPLightContraption)
+#   cli    - command-line client (bplc)
+#   daemon - shares the microcontroller between clients (bplcd)
+#   bench  - link benchmark (bplc-bench)
 #
 #-------------------------------------------------
 
-QT       += core gui serialport
+TEMPLATE = subdirs
 
-greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
+SUBDIRS = core gui cli daemon bench
 
-TARGET = BPLightContraption
-TEMPLATE = app
-
-QMAKE_CXXFLAGS += -std=c++11
-
-
-SOURCES += \
-    triaclight.cpp \
-    powerunit_gui.cpp \
-    powerunit.cpp \
-    microcontexception.cpp \
-    microcont.cpp \
-    main.cpp
-
-HEADERS  += \
-    triaclight.h \
-    powerunit_gui.h \
-    powerunit.h \
-    microcontexception.h \
-    microcont.h \
-    commands-text.h \
-    commands.h
-
-FORMS    += \
-    triaclight.ui
+gui.depends = core
+cli.depends = core
+daemon.depends = core
+bench.depends = core
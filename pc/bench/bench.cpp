@@ -0,0 +1,367 @@
+/*! \file
+ *  \brief     Measures the latency and throughput of the link to the microcontroller
+ *  \details   Runs a number of commands of each kind (a "mix") through
+ *             MCInterface and PUInterface at each baud rate, and reports
+ *             the latency (median, 99th percentile and maximum), commands per
+ *             second and bytes per second as JSON, so results can be compared
+ *             between releases. A summary is also printed to stderr.
+ *
+ *             It is meant to be run against the emulator (see
+ *             microcontroller/emulator/emulator.c) rather than real lights:
+ *
+ *             \code
+ *             ./triaclight-emu -l /tmp/triaclight &
+ *             ./bplc-bench -o results.json /tmp/triaclight
+ *             \endcode
+ *
+ *             The mixes are:
+ *              - nothing: COM_NOTHING with MCInterface::SendCommand()
+ *              - info: MCInterface::RetrieveInfo()
+ *              - level: PUInterface::SetLevel()
+ *              - batch: PUInterface::SetLevels() with every power unit
+ *              - queued: PUInterface::QueueLevel() for all the commands at once.
+ *                The latency includes the time spent waiting in the queue.
+ *  \author    Benjamin Pritchard (ben@bennyp.org)
+ *  \copyright 2013 Benjamin Pritchard. Released under the MIT License
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <functional>
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSharedPointer>
+#include <QStringList>
+#include <QVector>
+
+#include "microcont.h"
+#include "microcontexception.h"
+#include "powerunit.h"
+#include "commands.h"
+
+// QString::SkipEmptyParts is deprecated from Qt 5.14
+#if QT_VERSION >= QT_VERSION_CHECK(5,14,0)
+#define SKIP_EMPTY_PARTS Qt::SkipEmptyParts
+#else
+#define SKIP_EMPTY_PARTS QString::SkipEmptyParts
+#endif
+
+//! Version of the JSON output. Increase when fields change meaning
+#define BENCH_FORMAT 1
+
+//! Results of running one mix of commands
+struct MixResult
+{
+    QString mix;                //!< Name of the mix
+    int errors;                 //!< Commands that failed or timed out
+    QVector<qint64> latencies;  //!< Latency of each successful command (in ns)
+    qint64 elapsed;             //!< Time to run the whole mix (in ns)
+    quint64 bytes;              //!< Bytes sent and received while running the mix
+};
+
+//! Runs \p count commands one at a time, waiting for each response
+/*!
+ *  \p op is called with the command number and should throw on failure
+ */
+static MixResult RunSync(const QString & mix, MCInterface & mc, int count, std::function<void(int)> op)
+{
+    MixResult res;
+    res.mix = mix;
+    res.errors = 0;
+
+    const quint64 startbytes = mc.GetBytesSent() + mc.GetBytesReceived();
+    QElapsedTimer total, one;
+    total.start();
+
+    for(int i = 0; i < count; i++)
+    {
+        one.start();
+        try {
+            op(i);
+            res.latencies.push_back(one.nsecsElapsed());
+        }
+        catch(const MCInterfaceException &)
+        {
+            res.errors++;
+        }
+    }
+
+    res.elapsed = total.nsecsElapsed();
+    res.bytes = mc.GetBytesSent() + mc.GetBytesReceived() - startbytes;
+    return res;
+}
+
+//! Queues \p count commands at once and waits for all of them to finish
+/*!
+ *  \p op is called with the command number and the callbacks to pass
+ *  to the queueing function
+ */
+static MixResult RunQueued(const QString & mix, MCInterface & mc, int count,
+                           std::function<void(int, PUInterface::DoneCallback, MCInterface::ErrorCallback)> op)
+{
+    MixResult res;
+    res.mix = mix;
+    res.errors = 0;
+
+    const quint64 startbytes = mc.GetBytesSent() + mc.GetBytesReceived();
+    QElapsedTimer total;
+    total.start();
+
+    for(int i = 0; i < count; i++)
+    {
+        const qint64 queued = total.nsecsElapsed();
+        try {
+            op(i,
+               [&res, &total, queued]() { res.latencies.push_back(total.nsecsElapsed() - queued); },
+               [&res](const MCInterfaceException &) { res.errors++; });
+        }
+        catch(const MCInterfaceException &)
+        {
+            res.errors++;
+        }
+    }
+
+    // Every command either gets a response or times out
+    QEventLoop loop;
+    QObject::connect(&mc, SIGNAL(QueueEmpty()), &loop, SLOT(quit()));
+    if(mc.PendingCommands() > 0)
+        loop.exec();
+
+    res.elapsed = total.nsecsElapsed();
+    res.bytes = mc.GetBytesSent() + mc.GetBytesReceived() - startbytes;
+    return res;
+}
+
+//! Returns the \p p-th percentile (nearest rank) of sorted values, in microseconds
+static double Percentile(const QVector<qint64> & sorted, int p)
+{
+    if(sorted.isEmpty())
+        return 0.0;
+
+    int rank = (sorted.size() * p + 99) / 100;
+    if(rank < 1)
+        rank = 1;
+
+    return sorted[rank-1] / 1000.0;
+}
+
+//! Converts the results of a mix to JSON, and prints a summary
+static QJsonObject Summarize(MixResult & res, qint32 baud, bool crc, int protocol)
+{
+    std::sort(res.latencies.begin(), res.latencies.end());
+
+    const double seconds = res.elapsed / 1e9;
+    const int done = res.latencies.size();
+
+    QJsonObject latency;
+    latency["p50"] = Percentile(res.latencies, 50);
+    latency["p99"] = Percentile(res.latencies, 99);
+    latency["max"] = Percentile(res.latencies, 100);
+
+    QJsonObject obj;
+    obj["baud"] = baud;
+    obj["framing"] = QString(crc ? "crc" : "plain");
+    obj["protocol"] = protocol;
+    obj["mix"] = res.mix;
+    obj["commands"] = done;
+    obj["errors"] = res.errors;
+    obj["latency_us"] = latency;
+    obj["commands_per_sec"] = (seconds > 0) ? done / seconds : 0.0;
+    obj["bytes_per_sec"] = (seconds > 0) ? res.bytes / seconds : 0.0;
+
+    fprintf(stderr, "%8d %-5s %-8s %6d %6d %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+            baud, crc ? "crc" : "plain", qPrintable(res.mix), done, res.errors,
+            latency["p50"].toDouble(), latency["p99"].toDouble(), latency["max"].toDouble(),
+            obj["commands_per_sec"].toDouble(), obj["bytes_per_sec"].toDouble());
+
+    return obj;
+}
+
+//! Runs the selected mixes on an open microcontroller
+static void RunMixes(QSharedPointer<MCInterface> mc, const QStringList & mixes, int count, QJsonArray & results)
+{
+    QList<PUInterface *> units;
+    QList<quint8> alllevels;
+    for(int id = 1; id <= PU_COUNT; id++)
+        units.push_back(new PUInterface((char)id, QString("Unit %1").arg(id), mc));
+
+    const qint32 baud = mc->GetBaudRate();
+    const bool crc = mc->GetCrcFraming();
+    const int protocol = mc->GetProtocolVersion();
+
+    foreach(const QString & mix, mixes)
+    {
+        MixResult res;
+
+        if(mix == "nothing")
+        {
+            res = RunSync(mix, *mc, count, [&](int) {
+                const quint8 nothing[2] = {FRAME_START, COM_NOTHING};
+                mc->SendCommand(nothing, 2, 0);
+            });
+        }
+        else if(mix == "info")
+        {
+            res = RunSync(mix, *mc, count, [&](int) { mc->RetrieveInfo(); });
+        }
+        else if(mix == "level")
+        {
+            res = RunSync(mix, *mc, count, [&](int i) { units[0]->SetLevel(i % 101); });
+        }
+        else if(mix == "batch")
+        {
+            res = RunSync(mix, *mc, count, [&](int i) {
+                alllevels.clear();
+                for(int j = 0; j < units.size(); j++)
+                    alllevels.push_back((i + j) % 101);
+                PUInterface::SetLevels(units, alllevels);
+            });
+        }
+        else if(mix == "queued")
+        {
+            res = RunQueued(mix, *mc, count, [&](int i, PUInterface::DoneCallback ondone, MCInterface::ErrorCallback onerror) {
+                units[i % units.size()]->QueueLevel(i % 101, ondone, onerror);
+            });
+        }
+        else
+        {
+            fprintf(stderr, "Unknown mix: %s\n", qPrintable(mix));
+            continue;
+        }
+
+        results.append(Summarize(res, baud, crc, protocol));
+    }
+
+    // Leave everything off
+    try {
+        for(int i = 0; i < units.size(); i++)
+            units[i]->TurnOff();
+    }
+    catch(const MCInterfaceException &)
+    {
+    }
+
+    qDeleteAll(units);
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Measures the latency and throughput of the link to the microcontroller");
+    parser.addHelpOption();
+    parser.addPositionalArgument("port", "Serial port (or path to the emulator's pseudo-terminal)");
+
+    QCommandLineOption baudopt(QStringList() << "b" << "baud",
+                               "Comma-separated baud rates to test", "rates",
+                               "38400,115200,250000,500000,1000000");
+    QCommandLineOption countopt(QStringList() << "n" << "count",
+                                "Number of commands in each mix", "count", "500");
+    QCommandLineOption mixopt(QStringList() << "m" << "mix",
+                              "Comma-separated mixes to run (nothing, info, level, batch, queued)", "mixes",
+                              "nothing,info,level,batch,queued");
+    QCommandLineOption framingopt(QStringList() << "f" << "framing",
+                                  "Comma-separated framings to test (crc, plain)", "framings", "crc,plain");
+    QCommandLineOption outputopt(QStringList() << "o" << "output",
+                                 "Write the JSON results to this file instead of stdout", "file");
+    parser.addOption(baudopt);
+    parser.addOption(countopt);
+    parser.addOption(mixopt);
+    parser.addOption(framingopt);
+    parser.addOption(outputopt);
+
+    parser.process(app);
+
+    if(parser.positionalArguments().size() != 1)
+        parser.showHelp(1);
+
+    const QString port = parser.positionalArguments()[0];
+    const QStringList bauds = parser.value(baudopt).split(',', SKIP_EMPTY_PARTS);
+    const QStringList mixes = parser.value(mixopt).split(',', SKIP_EMPTY_PARTS);
+    const QStringList framings = parser.value(framingopt).split(',', SKIP_EMPTY_PARTS);
+    const int count = parser.value(countopt).toInt();
+
+    if(count <= 0)
+    {
+        fprintf(stderr, "Invalid count: %s\n", qPrintable(parser.value(countopt)));
+        return 1;
+    }
+
+    QJsonArray results;
+    int failures = 0;
+
+    fprintf(stderr, "%8s %-5s %-8s %6s %6s %10s %10s %10s %10s %10s\n",
+            "baud", "frame", "mix", "done", "errors", "p50 us", "p99 us", "max us", "cmd/s", "bytes/s");
+
+    foreach(const QString & b, bauds)
+    {
+        const qint32 baud = b.toInt();
+
+        foreach(const QString & framing, framings)
+        {
+            QSharedPointer<MCInterface> mc(new MCInterface);
+            mc->SetMaxBaudRate(baud);
+            mc->SetCrcFraming(framing == "crc");
+
+            try {
+                mc->OpenPort(port);
+            }
+            catch(const MCInterfaceException & ex)
+            {
+                fprintf(stderr, "Unable to open %s at %d: %s\n", qPrintable(port), baud, ex.what());
+                failures++;
+                continue;
+            }
+
+            // Don't report results at the wrong rate or framing as if they were right
+            if(mc->GetBaudRate() != baud)
+            {
+                fprintf(stderr, "Skipping %d: the microcontroller is using %d\n", baud, mc->GetBaudRate());
+                mc->ClosePort();
+                continue;
+            }
+
+            if(mc->GetCrcFraming() != (framing == "crc"))
+            {
+                fprintf(stderr, "Skipping %s framing at %d: not supported\n", qPrintable(framing), baud);
+                mc->ClosePort();
+                continue;
+            }
+
+            RunMixes(mc, mixes, count, results);
+            mc->ClosePort();
+        }
+    }
+
+    QJsonObject doc;
+    doc["format"] = BENCH_FORMAT;
+    doc["date"] = QDateTime::currentDateTimeUtc().toString(Qt::ISODate);
+    doc["port"] = port;
+    doc["count"] = count;
+    doc["results"] = results;
+
+    const QByteArray json = QJsonDocument(doc).toJson();
+
+    if(parser.isSet(outputopt))
+    {
+        QFile out(parser.value(outputopt));
+        if(!out.open(QIODevice::WriteOnly | QIODevice::Truncate) || out.write(json) != json.size())
+        {
+            fprintf(stderr, "Unable to write %s\n", qPrintable(out.fileName()));
+            return 1;
+        }
+    }
+    else
+        fwrite(json.constData(), 1, json.size(), stdout);
+
+    return (failures > 0) ? 1 : 0;
+}
@@ -0,0 +1,20 @@
+#-------------------------------------------------
+#
+# Latency and throughput benchmark for the link
+# to the microcontroller (see bench.cpp)
+#
+#-------------------------------------------------
+
+QT       = core
+
+TARGET = bplc-bench
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+
+QMAKE_CXXFLAGS += -std=c++11
+
+include(../core/core.pri)
+
+SOURCES += \
+    bench.cpp
@@ -0,0 +1,123 @@
+/*! \file
+ *  \brief     Command-line client for the microcontroller
+ *  \details   Runs a script of commands (see ScriptRunner) read from stdin,
+ *             or given with -e. Commands are sent as soon as they are read,
+ *             without waiting for each response, so it can be fed from a
+ *             pipe. It only needs QtCore and QtSerialPort, so it can run
+ *             on hosts without a display:
+ *
+ *             \code
+ *             echo "level 1 40; on 3" | ./bplc /dev/ttyACM0
+ *             ./bplc -e "fade 1 0 240; wait 2000; info" /dev/ttyACM0
+ *             \endcode
+ *
+ *             The exit status is 1 if anything failed.
+ *  \author    Benjamin Pritchard (ben@bennyp.org)
+ *  \copyright 2013 Benjamin Pritchard. Released under the MIT License
+ */
+
+#include <cstdio>
+#include <unistd.h>
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QSharedPointer>
+#include <QStringList>
+
+#include "microcont.h"
+#include "microcontexception.h"
+#include "powerunit.h"
+#include "scriptrunner.h"
+#include "commands.h"
+#include "commands-text.h"
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Sends commands to the microcontroller (see scriptrunner.h for the commands)");
+    parser.addHelpOption();
+    parser.addPositionalArgument("port", "Serial port (or path to the emulator's pseudo-terminal)");
+
+    QCommandLineOption execopt(QStringList() << "e" << "execute",
+                               "Run these commands instead of reading them from stdin", "script");
+    QCommandLineOption baudopt(QStringList() << "b" << "baud",
+                               "Highest baud rate to switch to", "rate");
+    QCommandLineOption plainopt(QStringList() << "p" << "plain",
+                                "Don't use CRC-checked command frames");
+    QCommandLineOption verboseopt(QStringList() << "v" << "verbose",
+                                  "Print each command once it has been done");
+    parser.addOption(execopt);
+    parser.addOption(baudopt);
+    parser.addOption(plainopt);
+    parser.addOption(verboseopt);
+
+    parser.process(app);
+
+    if(parser.positionalArguments().size() != 1)
+        parser.showHelp(1);
+
+    const QString port = parser.positionalArguments()[0];
+
+    QSharedPointer<MCInterface> mc(new MCInterface);
+
+    if(parser.isSet(baudopt))
+    {
+        bool ok;
+        const qint32 baud = parser.value(baudopt).toInt(&ok);
+        if(!ok || baud <= 0)
+        {
+            fprintf(stderr, "Invalid baud rate: %s\n", qPrintable(parser.value(baudopt)));
+            return 1;
+        }
+        mc->SetMaxBaudRate(baud);
+    }
+
+    mc->SetCrcFraming(!parser.isSet(plainopt));
+
+    try {
+        mc->OpenPort(port);
+    }
+    catch(const MCInterfaceException & ex)
+    {
+        fprintf(stderr, "Unable to open %s: %s\n", qPrintable(port), ex.what());
+        return 1;
+    }
+
+    QList<PUInterface *> units;
+    for(int id = 1; id <= PU_COUNT; id++)
+        units.push_back(new PUInterface((char)id, ConvertPUID(id), mc));
+
+    const bool verbose = parser.isSet(verboseopt);
+
+    ScriptRunner runner(mc, units);
+    runner.SetOutput([](const QString & line)
+                     {
+                         printf("%s\n", qPrintable(line));
+                         fflush(stdout);
+                     });
+    runner.SetCompleted([verbose](int line, const QString & statement, const QString & error)
+                        {
+                            if(!error.isEmpty())
+                                fprintf(stderr, "line %d: %s: %s\n", line, qPrintable(statement), qPrintable(error));
+                            else if(verbose)
+                            {
+                                printf("ok %d: %s\n", line, qPrintable(statement));
+                                fflush(stdout);
+                            }
+                        });
+    QObject::connect(&runner, SIGNAL(Finished()), &app, SLOT(quit()));
+
+    if(parser.isSet(execopt))
+        runner.RunText(parser.value(execopt));
+    else
+        runner.RunStream(STDIN_FILENO);
+
+    app.exec();
+
+    mc->ClosePort();
+    qDeleteAll(units);
+
+    return (runner.GetFailures() > 0) ? 1 : 0;
+}
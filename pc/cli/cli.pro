@@ -0,0 +1,19 @@
+#-------------------------------------------------
+#
+# Command-line client (see bplc.cpp)
+#
+#-------------------------------------------------
+
+QT       = core
+
+TARGET = bplc
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+
+QMAKE_CXXFLAGS += -std=c++11
+
+include(../core/core.pri)
+
+SOURCES += \
+    bplc.cpp
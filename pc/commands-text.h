@@ -1 +0,0 @@
-../common/commands-text.h
\ No newline at end of file
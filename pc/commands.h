@@ -1 +0,0 @@
-../common/commands.h
\ No newline at end of file
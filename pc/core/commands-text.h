@@ -0,0 +1 @@
+../../common/commands-text.h
\ No newline at end of file
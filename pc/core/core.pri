@@ -0,0 +1,19 @@
+#-------------------------------------------------
+#
+# Included by the projects that use the core library
+# (which must be next to the core directory)
+#
+#-------------------------------------------------
+
+QT += core serialport
+
+# Warn about anything that is deprecated in the Qt being built against
+CONFIG += warn_on
+DEFINES += QT_DEPRECATED_WARNINGS
+QMAKE_CXXFLAGS_WARN_ON += -Wextra
+
+INCLUDEPATH += $$PWD
+DEPENDPATH += $$PWD
+
+LIBS += -L$$OUT_PWD/../core -lbplc-core
+unix: PRE_TARGETDEPS += $$OUT_PWD/../core/libbplc-core.a
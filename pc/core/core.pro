@@ -0,0 +1,34 @@
+#-------------------------------------------------
+#
+# Library for talking to the microcontroller, shared
+# by the GUI, bplc and bplc-bench. Uses only QtCore
+# and QtSerialPort, so it can be used headless.
+#
+#-------------------------------------------------
+
+QT       = core serialport
+
+TARGET = bplc-core
+TEMPLATE = lib
+CONFIG += staticlib
+
+QMAKE_CXXFLAGS += -std=c++11
+
+# Warn about anything that is deprecated in the Qt being built against
+CONFIG += warn_on
+DEFINES += QT_DEPRECATED_WARNINGS
+QMAKE_CXXFLAGS_WARN_ON += -Wextra
+
+SOURCES += \
+    powerunit.cpp \
+    microcontexception.cpp \
+    microcont.cpp \
+    scriptrunner.cpp
+
+HEADERS  += \
+    powerunit.h \
+    microcontexception.h \
+    microcont.h \
+    scriptrunner.h \
+    commands-text.h \
+    commands.h
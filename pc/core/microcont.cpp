@@ -0,0 +1,1305 @@
+/*! \file
+ *  \brief     Class for controlling the microcontroller
+ *  \author    Benjamin Pritchard (ben@bennyp.org)
+ *  \copyright 2013 Benjamin Pritchard. Released under the MIT License
+ */
+
+#include "commands.h"
+#include "microcont.h"
+
+#include <cstring>
+
+#include <QtSerialPort/QSerialPort>
+#include <QtSerialPort/QSerialPortInfo>
+
+MCInterface::MCInterface()
+{
+    _mcerror = _mcerrorcmd = _mcerrorid = -1;
+    _nexttag = 0;
+    _infoversion = 0;
+    _subscribed = false;
+    _resyncing = false;
+    _maxinflight = 8;
+    _sequenced = true;
+    _nextseq = 0;
+    _protocolversion = 0;
+    _features = 0;
+    _baudrates = (1 << BAUD_DEFAULT);
+    _maxbaud = 1000000;
+    _baud = BaudRate(BAUD_DEFAULT);
+    _crcframing = true;
+    _crcactive = false;
+    _clock.start();
+    ResetLinkStats();
+
+    _responsetimer.setSingleShot(true);
+    connect(&_responsetimer, SIGNAL(timeout()), this, SLOT(ResponseTimeout()));
+    connect(&_sp, SIGNAL(readyRead()), this, SLOT(ReadyRead()));
+#if QT_VERSION >= QT_VERSION_CHECK(5,8,0)
+    connect(&_sp, SIGNAL(errorOccurred(QSerialPort::SerialPortError)), this, SLOT(SerialError(QSerialPort::SerialPortError)));
+#else
+    connect(&_sp, SIGNAL(error(QSerialPort::SerialPortError)), this, SLOT(SerialError(QSerialPort::SerialPortError)));
+#endif
+}
+
+QSerialPort::SerialPortError MCInterface::GetSPError(void) const
+{
+    return _sp.error();
+}
+
+int MCInterface::GetMCError(void) const
+{
+    return _mcerror;
+}
+
+int MCInterface::GetMCErrorID(void) const
+{
+    return _mcerrorid;
+}
+
+int MCInterface::GetMCErrorCMD(void) const
+{
+    return _mcerrorcmd;
+}
+
+void MCInterface::OpenPort(const QString & port)
+{
+    if(_sp.isOpen())
+        ClosePort();
+
+    // Always start at the default rate. The faster
+    // rate is negotiated after connecting
+    _baud = BaudRate(BAUD_DEFAULT);
+    _sp.setBaudRate(_baud);
+    _sp.setStopBits(QSerialPort::OneStop);
+    _sp.setParity(QSerialPort::NoParity);
+    _sp.setDataBits(QSerialPort::Data8);
+
+    // A full path (ie, a pseudo-terminal) works as well as a port name
+    _sp.setPortName(port);
+    ResetLinkStats();
+
+    if(!_sp.open(QIODevice::ReadWrite))
+    {
+        _sp.close();
+        ThrowException("Unable to open port");
+    }
+
+    QByteArray idstring = SendCommand(NULL, 0, 3, 2000);
+
+    if(idstring.size() != 3 || idstring[0] != 'B' || idstring[1] != 'e' || idstring[2] != 'n')
+    {
+        _sp.close();
+        ThrowException(QString("Invalid initial connection response: ").append(idstring));
+    }
+
+    try {
+        Negotiate();
+    }
+    catch(...)
+    {
+        ClosePort();
+        throw;
+    }
+}
+
+void MCInterface::SetMaxBaudRate(qint32 baud)
+{
+    _maxbaud = baud;
+}
+
+qint32 MCInterface::GetBaudRate(void) const
+{
+    return _baud;
+}
+
+int MCInterface::GetProtocolVersion(void) const
+{
+    return _protocolversion;
+}
+
+bool MCInterface::HasFeature(quint16 feature) const
+{
+    return (_features & feature) == feature;
+}
+
+qint32 MCInterface::BaudRate(int code)
+{
+    switch(code)
+    {
+        case BAUD_57600:
+            return 57600;
+        case BAUD_115200:
+            return 115200;
+        case BAUD_250000:
+            return 250000;
+        case BAUD_500000:
+            return 500000;
+        case BAUD_1000000:
+            return 1000000;
+        default:
+            return 38400;
+    }
+}
+
+void MCInterface::Negotiate(void)
+{
+    _protocolversion = 0;
+    _features = 0;
+    _baudrates = (1 << BAUD_DEFAULT);
+
+    QByteArray caps;
+
+    // Firmware without COM_CAPS is older than the info format
+    // used here (COM_INFO_DELTA), so it can't be talked to
+    try {
+        quint8 capscmd[2] = {FRAME_START, COM_CAPS};
+        caps = SendCommand(capscmd, 2, CAPS_SIZE);
+    }
+    catch(const MCInterfaceException &)
+    {
+        ThrowException("The firmware is too old (no COM_CAPS)");
+    }
+
+    _protocolversion = (quint8)caps[0];
+    _features = (quint8)caps[1] | ((quint8)caps[2] << 8);
+    _baudrates = (quint8)caps[3];
+
+    if(!HasFeature(FEAT_INFO_DELTA))
+        ThrowException("The firmware doesn't support COM_INFO_DELTA");
+
+    // Try the fastest rates first. If one doesn't work (cable
+    // too long, host driver can't do it, etc), try the next one down
+    if(HasFeature(FEAT_BAUD))
+    {
+        for(int code = BAUD_COUNT-1; code > BAUD_DEFAULT; code--)
+        {
+            if(!(_baudrates & (1 << code)) || BaudRate(code) > _maxbaud)
+                continue;
+
+            if(ChangeBaud(code))
+                break;
+        }
+    }
+
+    if(_crcframing && HasFeature(FEAT_CRC))
+        SetCrcMode(true);
+}
+
+void MCInterface::SetCrcFraming(bool enable)
+{
+    _crcframing = enable;
+
+    if(_sp.isOpen() && HasFeature(FEAT_CRC) && enable != _crcactive)
+        SetCrcMode(enable);
+}
+
+bool MCInterface::GetCrcFraming(void) const
+{
+    return _crcactive;
+}
+
+quint64 MCInterface::GetBytesSent(void) const
+{
+    return _stats.bytessent;
+}
+
+quint64 MCInterface::GetBytesReceived(void) const
+{
+    return _stats.bytesreceived;
+}
+
+MCInterface::LinkStats MCInterface::GetLinkStats(void) const
+{
+    LinkStats stats = _stats;
+    stats.elapsedms = _clock.elapsed() - _statsstart;
+    return stats;
+}
+
+void MCInterface::ResetLinkStats(void)
+{
+    memset(&_stats, 0, sizeof(_stats));
+    _statsstart = _clock.elapsed();
+}
+
+qint64 MCInterface::LatencyBucketLimit(int bucket)
+{
+    if(bucket >= LATENCY_BUCKETS-1)
+        return -1;
+
+    return qint64(LATENCY_BUCKET0_US) << bucket;
+}
+
+qint64 MCInterface::LatencyPercentile(const CommandStats & stats, int p)
+{
+    if(stats.responses == 0)
+        return 0;
+
+    // Rank of the response at the percentile (nearest rank)
+    const quint64 rank = qMax(quint64(1), (quint64(stats.responses) * p + 99) / 100);
+    quint64 seen = 0;
+
+    for(int i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        seen += stats.histogram[i];
+        if(seen >= rank)
+            return LatencyBucketLimit(i);
+    }
+
+    return -1;
+}
+
+MCInterface::CommandStats * MCInterface::StatsFor(const PendingCommand & pc)
+{
+    if(pc.command.size() < 2 || pc.command[0] != FRAME_START)
+        return NULL;
+
+    return &_stats.commands[(quint8)pc.command[1] % STATS_COMMANDS];
+}
+
+void MCInterface::RecordResponse(const PendingCommand & pc, bool mcerror)
+{
+    CommandStats * cs = StatsFor(pc);
+    if(!cs)
+        return;
+
+    const qint64 latency = _clock.nsecsElapsed() / 1000 - pc.sentus;
+
+    // Each bucket ends at twice the limit of the one before
+    int bucket = 0;
+    for(qint64 limit = LATENCY_BUCKET0_US; latency >= limit && bucket < LATENCY_BUCKETS-1; limit <<= 1)
+        bucket++;
+
+    cs->responses++;
+    cs->totalus += latency;
+    cs->maxus = qMax(cs->maxus, latency);
+    cs->histogram[bucket]++;
+    _stats.responses++;
+
+    if(mcerror)
+    {
+        cs->mcerrors++;
+        _stats.mcerrors++;
+    }
+}
+
+void MCInterface::SetCrcMode(bool on)
+{
+    // The response comes back in the old mode
+    quint8 crccmd[3] = {FRAME_START, COM_CRC, (quint8)(on ? 1 : 0)};
+    SendCommand(crccmd, 3, 0);
+    _crcactive = on;
+}
+
+quint8 MCInterface::Crc8(const char * data, int len)
+{
+    quint8 crc = 0;
+
+    for(int i = 0; i < len; i++)
+    {
+        crc ^= (quint8)data[i];
+        for(int j = 0; j < 8; j++)
+            crc = (crc & 0x80) ? (quint8)((crc << 1) ^ 0x07) : (quint8)(crc << 1);
+    }
+
+    return crc;
+}
+
+bool MCInterface::Ping(int timeout)
+{
+    try {
+        quint8 nothing[2] = {FRAME_START, COM_NOTHING};
+        SendCommand(nothing, 2, 0, timeout);
+        return true;
+    }
+    catch(const MCInterfaceException &)
+    {
+        return false;
+    }
+}
+
+bool MCInterface::ChangeBaud(int code)
+{
+    // The response comes back at the old rate
+    try {
+        quint8 baudcmd[3] = {FRAME_START, COM_BAUD, (quint8)code};
+        SendCommand(baudcmd, 3, 0);
+    }
+    catch(const MCInterfaceException &)
+    {
+        return false;
+    }
+
+    QElapsedTimer changed;
+    changed.start();
+
+    // The microcontroller only keeps the new
+    // rate if it gets a COM_NOTHING at that rate
+    if(_sp.setBaudRate(BaudRate(code)))
+    {
+        _sp.clear();
+        _rxbuffer.clear();
+
+        for(int i = 0; i < 3; i++)
+        {
+            if(Ping(200))
+            {
+                _baud = BaudRate(code);
+                return true;
+            }
+        }
+    }
+
+    // Didn't work. Keep trying at the default rate until the
+    // microcontroller goes back to it (BAUD_FALLBACK half-cycles,
+    // 2.4s at 50Hz), rather than sleeping for the worst case
+    _sp.setBaudRate(BaudRate(BAUD_DEFAULT));
+
+    while(changed.elapsed() < BAUD_FALLBACK_MS)
+    {
+        _sp.clear();
+        _rxbuffer.clear();
+
+        if(Ping(200))
+            return false;
+    }
+
+    ThrowException("No response after going back to the default baud rate");
+    return false;
+}
+
+
+void MCInterface::ClosePort(void)
+{
+    // Try to stop the microcontroller from sending status frames
+    // to whoever opens the port next. In CRC mode, anything
+    // else is ignored
+    if(_subscribed && _sp.isOpen())
+    {
+        PendingCommand pc;
+        quint8 unsub[5] = {FRAME_START, COM_SUBSCRIBE, 0, 0, 0};
+        pc.command = QByteArray((const char *)unsub, 5);
+        pc.sequenced = pc.crc = _crcactive;
+        _sp.write(FrameCommand(pc));
+        _sp.waitForBytesWritten(100);
+    }
+    _subscribed = false;
+
+    // Same for CRC mode
+    if(_crcactive && _sp.isOpen())
+    {
+        PendingCommand pc;
+        quint8 crccmd[3] = {FRAME_START, COM_CRC, 0};
+        pc.command = QByteArray((const char *)crccmd, 3);
+        pc.sequenced = pc.crc = true;
+        _sp.write(FrameCommand(pc));
+        _sp.waitForBytesWritten(100);
+    }
+    _crcactive = false;
+
+    // Put the microcontroller back at the default rate
+    // in case it doesn't get reset when the port is opened again
+    if(_baud != BaudRate(BAUD_DEFAULT) && _sp.isOpen())
+    {
+        quint8 baudcmd[3] = {FRAME_START, COM_BAUD, BAUD_DEFAULT};
+        _sp.write((const char *)baudcmd, 3);
+        _sp.waitForBytesWritten(100);
+    }
+    _baud = BaudRate(BAUD_DEFAULT);
+    _protocolversion = 0;
+    _features = 0;
+    _baudrates = (1 << BAUD_DEFAULT);
+
+    _responsetimer.stop();
+    _queued.clear();
+    _inflight.clear();
+    _rxbuffer.clear();
+    _info.clear();
+    _infoversion = 0;
+    _resyncing = false;
+
+    if(_sp.isOpen())
+        _sp.close();
+}
+
+void MCInterface::ResetPort(void)
+{
+    ClosePort();
+    OpenPort(_sp.portName());
+}
+
+
+
+QByteArray MCInterface::SendCommand(const quint8 * command, int len, unsigned int expectedreslen, int timeout)
+{
+    _mcerror = _mcerrorcmd = _mcerrorid = -1;
+
+    if(!(_sp.isOpen()))
+        ThrowException("Port not opened");
+
+    bool done = false;
+    QByteArray res;
+    QSharedPointer<MCInterfaceException> err;
+
+    QueueCommand(command, len, expectedreslen,
+                 [&](const QByteArray & r) { res = r; done = true; },
+                 [&](const MCInterfaceException & e) { err = QSharedPointer<MCInterfaceException>(new MCInterfaceException(e)); done = true; },
+                 timeout);
+
+    // readyRead is emitted from within waitForReadyRead, so the
+    // response is handled by ReadyRead() as usual
+    while(!done)
+    {
+        if(!(_sp.isOpen()))
+            ThrowException("Port closed while waiting for response");
+
+        if(!( _sp.waitForReadyRead(timeout)))
+        {
+            FailExpired();
+            SendQueued();
+        }
+    }
+
+    if(err)
+        throw *err;
+
+    return res;
+}
+
+quint32 MCInterface::QueueCommand(const quint8 * command, int len, unsigned int expectedreslen,
+                                  ResponseCallback onresponse, ErrorCallback onerror, int timeout)
+{
+    if(!(_sp.isOpen()))
+        ThrowException("Port not opened");
+
+    PendingCommand pc;
+    pc.tag = _nexttag++;
+    pc.command = QByteArray((const char *)command, len);
+    pc.expectedreslen = expectedreslen;
+    pc.timeout = timeout;
+    pc.onresponse = onresponse;
+    pc.onerror = onerror;
+
+    // Commands without the usual start byte (ie, waiting for
+    // the identification string) are sent as-is. CRC-checked
+    // frames always have a sequence byte
+    const bool framed = (len > 1 && command[0] == FRAME_START);
+    pc.crc = _crcactive && framed;
+    pc.sequenced = (_sequenced || pc.crc) && framed;
+    pc.seq = 0;
+    pc.retries = 0;
+    pc.sentlen = 0;
+    pc.deadline = 0;
+    pc.sentus = 0;
+
+    _queued.push_back(pc);
+    SendQueued();
+
+    return pc.tag;
+}
+
+int MCInterface::PendingCommands(void) const
+{
+    return _queued.size() + _inflight.size();
+}
+
+void MCInterface::SetMaxInFlight(int maxinflight)
+{
+    _maxinflight = (maxinflight < 1 ? 1 : maxinflight);
+    SendQueued();
+}
+
+void MCInterface::SetSequenced(bool sequenced)
+{
+    _sequenced = sequenced;
+}
+
+void MCInterface::SendQueued(void)
+{
+    if(!(_sp.isOpen()))
+        return;
+
+    int inflightbytes = 0;
+    for(int i = 0; i < _inflight.size(); i++)
+        inflightbytes += _inflight[i].sentlen;
+
+    // The microcontroller's buffer can hold at most CMDBUF_SIZE-1 bytes
+    while(!_queued.isEmpty() && _inflight.size() < _maxinflight &&
+          (_inflight.isEmpty() || inflightbytes + FrameSize(_queued.front()) < CMDBUF_SIZE))
+    {
+        PendingCommand pc = _queued.takeFirst();
+
+        const QByteArray wire = FrameCommand(pc);
+        const int len = wire.size();
+
+        if(len > 0 && _sp.write(wire) != len)
+        {
+            FailCommand(pc, "Unable to write command");
+            continue;
+        }
+
+        _stats.bytessent += len;
+        pc.sentlen = len;
+        pc.sentus = _clock.nsecsElapsed() / 1000;
+        pc.deadline = _clock.elapsed() + pc.timeout;
+        inflightbytes += len;
+        _inflight.push_back(pc);
+
+        if(_inflight.size() == 1)
+            RestartTimer();
+    }
+}
+
+int MCInterface::FrameSize(const PendingCommand & pc)
+{
+    if(pc.crc)
+        return pc.command.size() + 3;
+    else if(pc.sequenced)
+        return pc.command.size() + 1;
+    else
+        return pc.command.size();
+}
+
+QByteArray MCInterface::FrameCommand(PendingCommand & pc)
+{
+    if(!pc.sequenced)
+        return pc.command;
+
+    // Commands sent again get a new sequence byte
+    pc.seq = _nextseq++;
+
+    QByteArray wire(pc.command);
+
+    if(pc.crc)
+    {
+        // FRAME_START, command, arguments... becomes FRAME_START_CRC,
+        // length, sequence, command, arguments..., CRC. The length
+        // (sequence + command + arguments) is the size of the original
+        wire[0] = (char)wire.size();
+        wire.insert(1, (char)pc.seq);
+        wire.append((char)Crc8(wire.constData(), wire.size()));
+        wire.prepend((char)FRAME_START_CRC);
+    }
+    else
+    {
+        // FRAME_START becomes FRAME_START_SEQ followed by the sequence byte
+        wire[0] = FRAME_START_SEQ;
+        wire.insert(1, (char)pc.seq);
+    }
+
+    return wire;
+}
+
+void MCInterface::ReadyRead(void)
+{
+    const QByteArray data = _sp.readAll();
+    _stats.bytesreceived += data.size();
+    _stats.reads++;
+    _rxbuffer.append(data);
+    ProcessResponses();
+
+    if(!_rxbuffer.isEmpty())
+        _stats.partialreads++;
+}
+
+void MCInterface::ProcessResponses(void)
+{
+    // Set if something was thrown away, which may have been a status frame
+    bool lost = false;
+
+    // Responses are a length byte followed by that many bytes,
+    // and then a CRC if RES_CRC_FLAG is set in the length
+    while(!_rxbuffer.isEmpty())
+    {
+        const bool checked = ((quint8)_rxbuffer[0] & RES_CRC_FLAG);
+        const int len = ((quint8)_rxbuffer[0] & ~RES_CRC_FLAG);
+        const int total = 1 + len + (checked ? 1 : 0);
+
+        // In CRC mode, anything without a CRC (or with an impossible
+        // length) is noise, or we lost track of where responses start
+        if(_crcactive && (!checked || len < 3 || len > 4+PAYLOAD_MAX))
+        {
+            _stats.droppedbytes++;
+            _rxbuffer.remove(0, 1);
+            lost = true;
+            continue;
+        }
+
+        if(_rxbuffer.size() < total)
+            break;
+
+        // Damaged. Look for the next response one byte later.
+        // The command this belonged to times out
+        if(checked && Crc8(_rxbuffer.constData(), 1+len) != (quint8)_rxbuffer[1+len])
+        {
+            _stats.crcerrors++;
+            _rxbuffer.remove(0, 1);
+            lost = true;
+            continue;
+        }
+
+        QByteArray frame = _rxbuffer.mid(1, len);
+        _rxbuffer.remove(0, total);
+
+        HandleResponse(frame, checked);
+    }
+
+    if(lost && _subscribed)
+        ResyncStatus();
+
+    SendQueued();
+
+    if(_queued.isEmpty() && _inflight.isEmpty())
+        emit QueueEmpty();
+}
+
+void MCInterface::HandleResponse(const QByteArray & frame, bool checked)
+{
+    if(frame.size() < 3)
+    {
+        // Can't tell who this belongs to, so we don't know
+        // what is still valid
+        _mcerror = _mcerrorcmd = _mcerrorid = -1;
+        FailInFlight(QString("Response too short: %1 bytes").arg(frame.size()));
+        return;
+    }
+
+    // Not a response to anything
+    if((quint8)frame[1] == COM_STATUS && frame[0] == RES_SUCCESS)
+    {
+        HandleStatus(frame.mid(3));
+        return;
+    }
+
+    const bool sequenced = ((quint8)frame[1] & RES_SEQ_FLAG) && frame.size() >= 4;
+    const int headerlen = (sequenced ? 4 : 3);
+
+    // Find the command this is a response to. Unsequenced
+    // responses are answered in order
+    int idx = -1;
+    for(int i = 0; i < _inflight.size() && idx < 0; i++)
+    {
+        if(_inflight[i].sequenced == sequenced &&
+           (!sequenced || _inflight[i].seq == (quint8)frame[3]))
+            idx = i;
+    }
+
+    _mcerror = frame[0];
+    _mcerrorcmd = ((quint8)frame[1] & ~RES_SEQ_FLAG);
+    _mcerrorid = frame[2];
+
+    // The microcontroller flushes its buffer when it loses track of where
+    // commands start, so anything else that was sent has been discarded.
+    // This doesn't happen with CRC-checked frames
+    const bool flushed = !checked && (_mcerror == RES_INVALID_START || _mcerror == RES_INVALID_COM);
+
+    if(idx < 0)
+    {
+        // Nothing waiting on this. Probably a late response to a command
+        // that already timed out
+        if(flushed)
+            FailInFlight("Command discarded after microcontroller error");
+        return;
+    }
+
+    PendingCommand pc = _inflight.takeAt(idx);
+    RestartTimer();
+    RecordResponse(pc, _mcerror != RES_SUCCESS);
+
+    // Damaged on the way there, so it wasn't run. Send it again
+    if(_mcerror == RES_BADCRC && pc.crc && pc.retries < MAX_RETRIES)
+    {
+        CommandStats * cs = StatsFor(pc);
+        if(cs)
+            cs->retries++;
+
+        pc.retries++;
+        _queued.push_front(pc);
+        return;
+    }
+
+    if(_mcerror != RES_SUCCESS)
+    {
+        FailCommand(pc, "MCInterface error");
+
+        if(flushed)
+        {
+            _mcerror = _mcerrorcmd = _mcerrorid = -1;
+            FailInFlight("Command discarded after microcontroller error");
+        }
+        return;
+    }
+
+    if(pc.expectedreslen != VARIABLE_LENGTH && (unsigned int)frame.size() != (headerlen+pc.expectedreslen))
+    {
+        FailCommand(pc, QString("Unexpected response size: %1 instead of %2").arg(frame.size()-headerlen+3).arg(3+pc.expectedreslen));
+        return;
+    }
+
+    QByteArray res = frame.mid(headerlen);
+
+    if(pc.onresponse)
+        pc.onresponse(res);
+
+    emit CommandFinished(pc.tag, res);
+}
+
+void MCInterface::ResponseTimeout(void)
+{
+    FailExpired();
+    SendQueued();
+
+    if(_queued.isEmpty() && _inflight.isEmpty())
+        emit QueueEmpty();
+}
+
+void MCInterface::SerialError(QSerialPort::SerialPortError error)
+{
+    if(error != QSerialPort::ResourceError || !_sp.isOpen())
+        return;
+
+    // Nothing that is waiting will get a response
+    const QString desc = QString("Serial port error: %1").arg(_sp.errorString());
+
+    QList<PendingCommand> failed;
+    failed.swap(_inflight);
+    failed.append(_queued);
+    _queued.clear();
+
+    ClosePort();
+
+    for(int i = 0; i < failed.size(); i++)
+        FailCommand(failed[i], desc);
+
+    emit PortClosed();
+}
+
+void MCInterface::FailCommand(const PendingCommand & pc, const QString & desc)
+{
+    if(pc.onerror)
+        pc.onerror(MCInterfaceException(desc, _mcerror, _mcerrorcmd, _mcerrorid, GetSPError()));
+
+    emit CommandFailed(pc.tag, desc);
+}
+
+void MCInterface::FailInFlight(const QString & desc)
+{
+    QList<PendingCommand> failed;
+    failed.swap(_inflight);
+    _responsetimer.stop();
+
+    for(int i = 0; i < failed.size(); i++)
+        FailCommand(failed[i], desc);
+}
+
+void MCInterface::FailExpired(void)
+{
+    _mcerror = _mcerrorcmd = _mcerrorid = -1;
+
+    const qint64 now = _clock.elapsed();
+    QList<PendingCommand> expired;
+
+    for(int i = 0; i < _inflight.size(); )
+    {
+        if(_inflight[i].deadline <= now)
+        {
+            CommandStats * cs = StatsFor(_inflight[i]);
+            if(cs)
+                cs->timeouts++;
+            _stats.timeouts++;
+
+            expired.push_back(_inflight.takeAt(i));
+        }
+        else
+            i++;
+    }
+
+    if(expired.isEmpty())
+        return;
+
+    // Without sequence bytes, we can't tell if a response arriving
+    // later belongs to the lost command, so everything else is lost, too
+    bool unsequenced = false;
+    for(int i = 0; i < expired.size(); i++)
+        unsequenced = unsequenced || !expired[i].sequenced;
+
+    for(int i = 0; i < _inflight.size(); i++)
+        unsequenced = unsequenced || !_inflight[i].sequenced;
+
+    if(unsequenced)
+    {
+        expired.append(_inflight);
+        _inflight.clear();
+    }
+
+    // partial responses are no good anymore
+    if(_inflight.isEmpty())
+        _rxbuffer.clear();
+
+    RestartTimer();
+
+    for(int i = 0; i < expired.size(); i++)
+        FailCommand(expired[i], "Timeout waiting for response");
+}
+
+void MCInterface::RestartTimer(void)
+{
+    if(_inflight.isEmpty())
+    {
+        _responsetimer.stop();
+        return;
+    }
+
+    qint64 deadline = _inflight.front().deadline;
+    for(int i = 1; i < _inflight.size(); i++)
+        deadline = qMin(deadline, _inflight[i].deadline);
+
+    _responsetimer.start(qMax(qint64(0), deadline - _clock.elapsed()));
+}
+
+void MCInterface::ThrowException(const QString & desc) const
+{
+    throw MCInterfaceException(desc, _mcerror, _mcerrorcmd, _mcerrorid, GetSPError());
+}
+
+QByteArray MCInterface::RetrieveInfo(void)
+{
+    QByteArray command = InfoDeltaCommand();
+    QByteArray delta = SendCommand((const quint8 *)command.constData(), command.size(), VARIABLE_LENGTH);
+
+    QString err;
+    if(!MergeInfoDelta(delta, err))
+        ThrowException(err);
+
+    return _info;
+}
+
+quint32 MCInterface::QueueRetrieveInfo(ResponseCallback onresponse, ErrorCallback onerror)
+{
+    QByteArray command = InfoDeltaCommand();
+    return QueueCommand((const quint8 *)command.constData(), command.size(), VARIABLE_LENGTH,
+                        [this, onresponse, onerror](const QByteArray & delta)
+                        {
+                            QString err;
+                            if(!MergeInfoDelta(delta, err))
+                            {
+                                if(onerror)
+                                    onerror(MCInterfaceException(err, _mcerror, _mcerrorcmd, _mcerrorid, GetSPError()));
+                                return;
+                            }
+
+                            if(onresponse)
+                                onresponse(_info);
+                        },
+                        onerror);
+}
+
+void MCInterface::HandleStatus(const QByteArray & status)
+{
+    _stats.statusframes++;
+
+    // Nothing to tell anyone about if it's bad, and
+    // the frames after it won't be right either
+    QString err;
+    if(!MergeInfoDelta(status, err))
+    {
+        ResyncStatus();
+        return;
+    }
+
+    emit StatusPushed(_info);
+}
+
+void MCInterface::ResyncStatus(void)
+{
+    if(_resyncing)
+        return;
+
+    // Everything, rather than what changed since the version we have
+    _infoversion = 0;
+
+    try {
+        _resyncing = true;
+        QueueRetrieveInfo([this](const QByteArray & info)
+                          {
+                              _resyncing = false;
+                              emit StatusPushed(info);
+                          },
+                          [this](const MCInterfaceException &) { _resyncing = false; });
+    }
+    catch(const MCInterfaceException &)
+    {
+        _resyncing = false;
+    }
+}
+
+void MCInterface::Subscribe(bool onchange, quint16 period)
+{
+    quint8 command[5];
+    command[0] = FRAME_START;
+    command[1] = COM_SUBSCRIBE;
+    command[2] = (onchange ? SUB_ONCHANGE : 0);
+    command[3] = (period & 0xFF);
+    command[4] = (period >> 8);
+
+    SendCommand(command, 5, 0);
+
+    _subscribed = (onchange || period != 0);
+}
+
+void MCInterface::StoreScene(quint8 slot)
+{
+    quint8 command[3];
+    command[0] = FRAME_START;
+    command[1] = COM_SCENE_STORE;
+    command[2] = slot;
+
+    SendCommand(command, 3, 0);
+}
+
+quint32 MCInterface::QueueStoreScene(quint8 slot, ResponseCallback onresponse, ErrorCallback onerror)
+{
+    quint8 command[3];
+    command[0] = FRAME_START;
+    command[1] = COM_SCENE_STORE;
+    command[2] = slot;
+
+    return QueueCommand(command, 3, 0, onresponse, onerror);
+}
+
+void MCInterface::RecallScene(quint8 slot, quint16 halfcycles)
+{
+    quint8 command[5];
+    command[0] = FRAME_START;
+    command[1] = COM_SCENE_RECALL;
+    command[2] = slot;
+    command[3] = (halfcycles & 0xFF);
+    command[4] = (halfcycles >> 8);
+
+    SendCommand(command, 5, 0);
+}
+
+quint32 MCInterface::QueueRecallScene(quint8 slot, quint16 halfcycles, ResponseCallback onresponse, ErrorCallback onerror)
+{
+    quint8 command[5];
+    command[0] = FRAME_START;
+    command[1] = COM_SCENE_RECALL;
+    command[2] = slot;
+    command[3] = (halfcycles & 0xFF);
+    command[4] = (halfcycles >> 8);
+
+    return QueueCommand(command, 5, 0, onresponse, onerror);
+}
+
+void MCInterface::SetBootScene(bool restorelast)
+{
+    quint8 command[3];
+    command[0] = FRAME_START;
+    command[1] = COM_SCENE_BOOT;
+    command[2] = (restorelast ? SCENE_BOOT_LAST : SCENE_BOOT_OFF);
+
+    SendCommand(command, 3, 0);
+}
+
+quint32 MCInterface::QueueSetBootScene(bool restorelast, ResponseCallback onresponse, ErrorCallback onerror)
+{
+    quint8 command[3];
+    command[0] = FRAME_START;
+    command[1] = COM_SCENE_BOOT;
+    command[2] = (restorelast ? SCENE_BOOT_LAST : SCENE_BOOT_OFF);
+
+    return QueueCommand(command, 3, 0, onresponse, onerror);
+}
+
+QByteArray MCInterface::InfoDeltaCommand(void) const
+{
+    QByteArray command;
+    command.push_back(FRAME_START);
+    command.push_back(COM_INFO_DELTA);
+    command.push_back((char)(_infoversion & 0xFF));
+    command.push_back((char)(_infoversion >> 8));
+    return command;
+}
+
+bool MCInterface::MergeInfoDelta(const QByteArray & delta, QString & err)
+{
+    const int bitmapoff = 2+INFO_ZC_SIZE;
+    int pos = bitmapoff+INFO_BITMAP_SIZE;
+
+    if(delta.size() < pos)
+    {
+        err = QString("Info response too short: %1 bytes").arg(delta.size());
+        return false;
+    }
+
+    quint16 version = (quint8)delta[0] | ((quint8)delta[1] << 8);
+
+    // Responses may arrive out of order. An older one doesn't
+    // have anything we don't already have
+    if(_infoversion != 0 && (qint16)(version - _infoversion) < 0)
+        return true;
+
+    QByteArray info = _info;
+    if(info.size() != INFO_SIZE)
+        info = QByteArray(INFO_SIZE, 0);
+
+    info.replace(0, INFO_ZC_SIZE, delta.mid(2, INFO_ZC_SIZE));
+
+    // Dimmers, followed by the power units
+    for(int field = 0; field < DIMMER_COUNT+PU_COUNT; field++)
+    {
+        if(!((quint8)delta[bitmapoff+(field>>3)] & (1 << (field & 7))))
+            continue;
+
+        int off, size;
+        if(field < DIMMER_COUNT)
+        {
+            off = INFO_ZC_SIZE + field*INFO_DIMMER_SIZE;
+            size = INFO_DIMMER_SIZE;
+        }
+        else
+        {
+            off = INFO_ZC_SIZE + DIMMER_COUNT*INFO_DIMMER_SIZE + (field-DIMMER_COUNT)*INFO_PU_SIZE;
+            size = INFO_PU_SIZE;
+        }
+
+        if(pos+size > delta.size())
+        {
+            err = QString("Info response too short: %1 bytes").arg(delta.size());
+            return false;
+        }
+
+        info.replace(off, size, delta.mid(pos, size));
+        pos += size;
+    }
+
+    if(pos != delta.size())
+    {
+        err = QString("Unexpected info response size: %1 instead of %2").arg(delta.size()).arg(pos);
+        return false;
+    }
+
+    _info = info;
+    _infoversion = version;
+    return true;
+}
+
+QByteArray MCInterface::BatchCommand(const LevelList & levels) const
+{
+    if(levels.size() > BATCH_MAX)
+        ThrowException(QString("Too many levels in batch: %1 (maximum %2)").arg(levels.size()).arg(BATCH_MAX));
+
+    QByteArray command;
+    command.push_back(FRAME_START);
+    command.push_back(COM_BATCH);
+    command.push_back((char)levels.size());
+
+    for(int i = 0; i < levels.size(); i++)
+    {
+        command.push_back((char)levels[i].first);
+        command.push_back((char)levels[i].second);
+    }
+
+    return command;
+}
+
+void MCInterface::SetLevels(const LevelList & levels)
+{
+    QByteArray command = BatchCommand(levels);
+    SendCommand((const quint8 *)command.constData(), command.size(), 0);
+}
+
+quint32 MCInterface::QueueSetLevels(const LevelList & levels, ResponseCallback onresponse, ErrorCallback onerror)
+{
+    QByteArray command = BatchCommand(levels);
+    return QueueCommand((const quint8 *)command.constData(), command.size(), 0, onresponse, onerror);
+}
+
+QByteArray MCInterface::ScheduleCommand(quint32 when, const LevelList & levels, quint16 halfcycles) const
+{
+    if(levels.size() > SCHEDULE_MAX)
+        ThrowException(QString("Too many levels to schedule: %1 (maximum %2)").arg(levels.size()).arg(SCHEDULE_MAX));
+
+    QByteArray command;
+    command.push_back(FRAME_START);
+    command.push_back(COM_SCHEDULE);
+    for(int i = 0; i < 4; i++)
+        command.push_back((char)((when >> (8*i)) & 0xFF));
+    command.push_back((char)(halfcycles & 0xFF));
+    command.push_back((char)(halfcycles >> 8));
+    command.push_back((char)levels.size());
+
+    for(int i = 0; i < levels.size(); i++)
+    {
+        command.push_back((char)levels[i].first);
+        command.push_back((char)levels[i].second);
+    }
+
+    return command;
+}
+
+quint32 MCInterface::ScheduleLevels(quint32 when, const LevelList & levels, quint16 halfcycles)
+{
+    QByteArray command = ScheduleCommand(when, levels, halfcycles);
+    QByteArray res = SendCommand((const quint8 *)command.constData(), command.size(), 4);
+
+    quint32 now = 0;
+    for(int i = 0; i < 4; i++)
+        now |= ((quint32)(quint8)res[i] << (8*i));
+    return now;
+}
+
+quint32 MCInterface::QueueScheduleLevels(quint32 when, const LevelList & levels, quint16 halfcycles,
+                                         ResponseCallback onresponse, ErrorCallback onerror)
+{
+    QByteArray command = ScheduleCommand(when, levels, halfcycles);
+    return QueueCommand((const quint8 *)command.constData(), command.size(), 4, onresponse, onerror);
+}
+
+quint32 MCInterface::InfoZeroCrossCount(const QByteArray & info)
+{
+    if(info.size() < INFO_ZC_SIZE)
+        return 0;
+
+    quint32 count = 0;
+    for(int i = 0; i < 4; i++)
+        count |= ((quint32)(quint8)info[4+i] << (8*i));
+    return count;
+}
+
+MCInterface::MCStats MCInterface::RetrieveStats(bool reset)
+{
+    quint8 command[3];
+    command[0] = FRAME_START;
+    command[1] = COM_STATS;
+    command[2] = (reset ? STATS_RESET : 0);
+
+    return ParseStats(SendCommand(command, 3, STATS_SIZE));
+}
+
+quint32 MCInterface::QueueRetrieveStats(bool reset, ResponseCallback onresponse, ErrorCallback onerror)
+{
+    quint8 command[3];
+    command[0] = FRAME_START;
+    command[1] = COM_STATS;
+    command[2] = (reset ? STATS_RESET : 0);
+
+    return QueueCommand(command, 3, STATS_SIZE, onresponse, onerror);
+}
+
+MCInterface::MCStats MCInterface::ParseStats(const QByteArray & res)
+{
+    MCStats stats;
+    memset(&stats, 0, sizeof(stats));
+
+    if(res.size() < STATS_SIZE)
+        return stats;
+
+    const quint8 * p = (const quint8 *)res.constData();
+
+    stats.rxoverflows = p[STATS_RXOVERFLOW] | (p[STATS_RXOVERFLOW+1] << 8);
+    stats.overruns = p[STATS_OVERRUN] | (p[STATS_OVERRUN+1] << 8);
+    stats.frameerrors = p[STATS_FRAMEERROR] | (p[STATS_FRAMEERROR+1] << 8);
+    stats.bufferhigh = p[STATS_BUFFHIGH];
+    stats.missedzerocrossings = p[STATS_MISSEDZC] | (p[STATS_MISSEDZC+1] << 8);
+
+    for(int i = 0; i < 4; i++)
+        stats.loopmax |= ((quint32)p[STATS_LOOPMAX+i] << (8*i));
+
+    for(int i = 0; i < STATS_ISR_COUNT; i++)
+        stats.isrmax[i] = p[STATS_ISRMAX+2*i] | (p[STATS_ISRMAX+2*i+1] << 8);
+
+    return stats;
+}
+
+MCInterface::MainsStats MCInterface::RetrieveMains(bool reset)
+{
+    quint8 command[3];
+    command[0] = FRAME_START;
+    command[1] = COM_MAINS;
+    command[2] = (reset ? MAINS_RESET : 0);
+
+    return ParseMains(SendCommand(command, 3, MAINS_SIZE));
+}
+
+quint32 MCInterface::QueueRetrieveMains(bool reset, ResponseCallback onresponse, ErrorCallback onerror)
+{
+    quint8 command[3];
+    command[0] = FRAME_START;
+    command[1] = COM_MAINS;
+    command[2] = (reset ? MAINS_RESET : 0);
+
+    return QueueCommand(command, 3, MAINS_SIZE, onresponse, onerror);
+}
+
+MCInterface::MainsStats MCInterface::ParseMains(const QByteArray & res)
+{
+    MainsStats mains;
+    memset(&mains, 0, sizeof(mains));
+
+    if(res.size() < MAINS_SIZE)
+        return mains;
+
+    const quint8 * p = (const quint8 *)res.constData();
+
+    quint32 mean = 0;
+    quint32 variance = 0;
+    for(int i = 0; i < 4; i++)
+    {
+        mains.count |= ((quint32)p[MAINS_COUNT+i] << (8*i));
+        mean |= ((quint32)p[MAINS_MEAN+i] << (8*i));
+        variance |= ((quint32)p[MAINS_VARIANCE+i] << (8*i));
+    }
+
+    // Both have 8 fractional bits
+    mains.mean = mean / 256.0;
+    mains.variance = variance / 256.0;
+    mains.min = p[MAINS_MIN] | (p[MAINS_MIN+1] << 8);
+    mains.max = p[MAINS_MAX] | (p[MAINS_MAX+1] << 8);
+
+    return mains;
+}
+
+MCInterface::ZCHistory MCInterface::RetrieveZCHistory(void)
+{
+    quint8 command[2];
+    command[0] = FRAME_START;
+    command[1] = COM_ZC_HISTORY;
+
+    return ParseZCHistory(SendCommand(command, 2, ZCHIST_RESPONSE_SIZE));
+}
+
+quint32 MCInterface::QueueRetrieveZCHistory(ResponseCallback onresponse, ErrorCallback onerror)
+{
+    quint8 command[2];
+    command[0] = FRAME_START;
+    command[1] = COM_ZC_HISTORY;
+
+    return QueueCommand(command, 2, ZCHIST_RESPONSE_SIZE, onresponse, onerror);
+}
+
+MCInterface::ZCHistory MCInterface::ParseZCHistory(const QByteArray & res)
+{
+    ZCHistory history;
+    memset(&history, 0, sizeof(history));
+
+    if(res.size() < ZCHIST_RESPONSE_SIZE)
+        return history;
+
+    const quint8 * p = (const quint8 *)res.constData();
+
+    for(int i = 0; i < 4; i++)
+        history.count |= ((quint32)p[i] << (8*i));
+
+    history.newestrising = (p[4] != 0);
+
+    for(int i = 0; i < ZCHIST_SIZE; i++)
+        history.intervals[i] = p[5+2*i] | (p[6+2*i] << 8);
+
+    return history;
+}
+
+bool MCInterface::IsOpen(void)
+{
+    return _sp.isOpen();
+}
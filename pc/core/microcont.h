@@ -0,0 +1,768 @@
+/*! \file
+ *  \brief     Class for controlling the microcontroller
+ *  \author    Benjamin Pritchard (ben@bennyp.org)
+ *  \copyright 2013 Benjamin Pritchard. Released under the MIT License
+ */
+
+#ifndef MICROCONT_H
+#define MICROCONT_H
+
+#include <functional>
+
+#include <QList>
+#include <QPair>
+#include <QVector>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QByteArray>
+#include <QSharedPointer>
+#include <QtSerialPort/QSerialPort>
+#include <QtSerialPort/QSerialPortInfo>
+
+#include "microcontexception.h"
+#include "commands.h"
+
+#define MICROCONTROLLER_FCPU 16000000ul
+
+//! Rate of the microcontroller's zero-crossing timer (F_CPU/8)
+#define MICROCONTROLLER_ZCTIMER_HZ (MICROCONTROLLER_FCPU/8)
+
+//! This class represents a microcontroller
+/*!
+ *  This command is mostly used to connect and send commands.
+ *
+ *  Commands can either be sent synchronously with SendCommand(), which
+ *  blocks until the response arrives, or placed in a queue with QueueCommand().
+ *  Queued commands are written back-to-back (up to a window of
+ *  commands that fits in the microcontroller's command buffer) and the responses
+ *  are parsed as they arrive through QSerialPort::readyRead.
+ *
+ *  By default, each command is sent with a sequence byte (FRAME_START_SEQ)
+ *  which the microcontroller echoes in its response, so responses
+ *  are matched to their commands even if they arrive out of order and
+ *  a failed command doesn't affect the others. Without sequence bytes,
+ *  responses are matched to the oldest outstanding command.
+ *
+ *  If the microcontroller supports it, commands are sent in CRC-checked
+ *  frames (FRAME_START_CRC) and the microcontroller is put in CRC mode,
+ *  so noise on the line is never run as a command. A command that arrives
+ *  damaged is answered with RES_BADCRC and is sent again automatically.
+ *  Damaged responses are dropped, and their commands time out.
+ */
+class MCInterface : public QObject
+{
+    Q_OBJECT
+
+public:
+
+    //! Called with the response (without the 3 header bytes) of a queued command
+    typedef std::function<void(const QByteArray &)> ResponseCallback;
+
+    //! Called when a queued command fails
+    typedef std::function<void(const MCInterfaceException &)> ErrorCallback;
+
+    //! A list of (power unit id, level) pairs. See SetLevels()
+    typedef QVector<QPair<quint8, quint8> > LevelList;
+
+    //! Pass as the expected result length to accept a response of any length
+    static const unsigned int VARIABLE_LENGTH = 0xFFFFFFFFu;
+
+    //! Number of times a command is sent again after failing its CRC check
+    static const int MAX_RETRIES = 3;
+
+    //! How long (in ms) to wait for the microcontroller to go back to the default rate after a failed baud change
+    /*!
+     *  BAUD_FALLBACK half-cycles is 2.4s at 50Hz, and 2s without mains
+     */
+    static const int BAUD_FALLBACK_MS = 4000;
+
+    //! Number of buckets in each latency histogram (see CommandStats)
+    static const int LATENCY_BUCKETS = 16;
+
+    //! Upper limit of the first latency histogram bucket (in us)
+    static const int LATENCY_BUCKET0_US = 100;
+
+    //! Number of command codes statistics are kept for (see LinkStats)
+    static const int STATS_COMMANDS = 128;
+
+    //! Statistics for one kind of command
+    /*!
+     *  The latency is the time from writing the command to the port to
+     *  receiving its response (success or error). Bucket 0 of the histogram
+     *  counts latencies under LATENCY_BUCKET0_US, each bucket after that
+     *  ends at twice the previous limit, and the last bucket counts
+     *  everything longer (see LatencyBucketLimit()).
+     */
+    struct CommandStats
+    {
+        quint32 responses;                   //!< Responses received
+        quint32 mcerrors;                    //!< Responses with an error from the microcontroller
+        quint32 timeouts;                    //!< Commands that timed out
+        quint32 retries;                     //!< Times sent again after RES_BADCRC
+        qint64 totalus;                      //!< Sum of the latencies (in us)
+        qint64 maxus;                        //!< Longest latency (in us)
+        quint32 histogram[LATENCY_BUCKETS];  //!< Number of responses in each latency range
+    };
+
+    //! Performance counters kept by the microcontroller (see RetrieveStats())
+    /*!
+     *  Times are in CPU cycles, measured to within 8 cycles.
+     *  Counters stop at their maximum.
+     */
+    struct MCStats
+    {
+        quint16 rxoverflows;                    //!< Bytes dropped because the command buffer was full
+        quint16 overruns;                       //!< Bytes lost before being read from the USART
+        quint16 frameerrors;                    //!< Bytes received with a framing error
+        quint8 bufferhigh;                      //!< Most bytes ever waiting in the command buffer
+        quint16 missedzerocrossings;            //!< Zero crossings that didn't arrive when expected
+        quint32 loopmax;                        //!< Longest main loop iteration
+        quint16 isrmax[STATS_ISR_COUNT];        //!< Longest run of each interrupt (by STATS_ISR_xxx)
+    };
+
+    //! Statistics of the mains cycle kept by the microcontroller (see RetrieveMains())
+    /*!
+     *  Lengths are of a full cycle, in ticks of the zero-crossing
+     *  timer (MICROCONTROLLER_ZCTIMER_HZ). The mean and variance
+     *  are running averages over about 2^MAINS_SHIFT cycles.
+     */
+    struct MainsStats
+    {
+        quint32 count;      //!< Number of cycles measured
+        double mean;        //!< Mean length of a cycle
+        double variance;    //!< Variance of the length of a cycle (in ticks squared)
+        quint16 min;        //!< Shortest cycle
+        quint16 max;        //!< Longest cycle
+    };
+
+    //! The last ZCHIST_SIZE zero crossings seen by the microcontroller (see RetrieveZCHistory())
+    struct ZCHistory
+    {
+        quint32 count;                     //!< Half-cycle count at the newest edge
+        bool newestrising;                 //!< The newest edge was rising (they alternate)
+        quint16 intervals[ZCHIST_SIZE];    //!< Ticks of the zero-crossing timer between each edge and the one before it, oldest first
+    };
+
+    //! Statistics about the link to the microcontroller (see GetLinkStats())
+    struct LinkStats
+    {
+        qint64 elapsedms;          //!< Time these statistics cover (in ms)
+        quint64 bytessent;         //!< Bytes written to the port
+        quint64 bytesreceived;     //!< Bytes read from the port
+        quint32 reads;             //!< Times data arrived from the port
+        quint32 partialreads;      //!< Reads that ended partway through a response
+        quint32 droppedbytes;      //!< Bytes skipped while looking for the start of a response
+        quint32 crcerrors;         //!< Responses dropped because their CRC didn't match
+        quint32 statusframes;      //!< Status frames pushed by the microcontroller
+        quint32 responses;         //!< Responses received (all commands)
+        quint32 mcerrors;          //!< Responses with an error (all commands)
+        quint32 timeouts;          //!< Commands that timed out (all commands)
+        CommandStats commands[STATS_COMMANDS];  //!< Statistics for each command (COM_), by code
+    };
+
+    //! Initializes the interface
+    MCInterface();
+
+    //! Opens the specified port
+    /*!
+     *  After opening the port, it waits for the identification string.
+     *  It then asks the microcontroller what it supports (COM_CAPS) and
+     *  switches to the fastest baud rate both sides can use (up to
+     *  the rate given to SetMaxBaudRate()). If something goes wrong, it throws
+     *  a MCInterfaceException (through ThrowException()). Firmware
+     *  without COM_CAPS or COM_INFO_DELTA is refused
+     */
+    void OpenPort(const QString &port);
+
+    //! Closes the serial connection with the microcontroller
+    /*!
+     *  Any commands still waiting in the queue are discarded
+     *  without calling their callbacks. (If the port is closed because
+     *  the device has gone away, they fail instead. See PortClosed().)
+     */
+    void ClosePort(void);
+
+    //! Resets the port (closes and then reopens the port)
+    void ResetPort(void);
+
+    //! Returns true if the port is opened
+    bool IsOpen(void);
+
+    //! Sets the fastest baud rate OpenPort() will switch to
+    /*!
+     *  The default is 1000000. Use 38400 to never change the rate.
+     *  Only takes effect the next time the port is opened.
+     */
+    void SetMaxBaudRate(qint32 baud);
+
+    //! Returns the baud rate currently in use
+    qint32 GetBaudRate(void) const;
+
+    //! Returns the protocol version reported by the microcontroller
+    /*!
+     *  Zero if the microcontroller doesn't understand COM_CAPS
+     */
+    int GetProtocolVersion(void) const;
+
+    //! Returns true if the microcontroller reported the given FEAT_ bit(s)
+    bool HasFeature(quint16 feature) const;
+
+    //! Sets whether commands are sent in CRC-checked frames
+    /*!
+     *  Enabled by default, but only used if the microcontroller supports
+     *  it (FEAT_CRC). If the port is open, the microcontroller is switched
+     *  in or out of CRC mode right away, so nothing else should be
+     *  outstanding.
+     *
+     *  \throw MCInterfaceException An error occurred during sending
+     *         the command or receiving the response
+     */
+    void SetCrcFraming(bool enable);
+
+    //! Returns true if commands are currently sent in CRC-checked frames
+    bool GetCrcFraming(void) const;
+
+    //! Returns the number of bytes written to the port since it was opened
+    /*!
+     *  Or since ResetLinkStats()
+     */
+    quint64 GetBytesSent(void) const;
+
+    //! Returns the number of bytes read from the port since it was opened
+    /*!
+     *  Or since ResetLinkStats()
+     */
+    quint64 GetBytesReceived(void) const;
+
+    //! Returns a copy of the statistics about the link
+    /*!
+     *  The statistics are always kept, and cover the time since
+     *  the port was opened or ResetLinkStats() was called.
+     */
+    LinkStats GetLinkStats(void) const;
+
+    //! Clears the statistics about the link
+    void ResetLinkStats(void);
+
+    //! Returns the upper limit (in us) of a latency histogram bucket
+    /*!
+     *  The last bucket has no limit, and -1 is returned
+     */
+    static qint64 LatencyBucketLimit(int bucket);
+
+    //! Estimates a percentile of the latency from a histogram
+    /*!
+     *  Returns the upper limit (in us) of the bucket the \p p-th percentile
+     *  falls in, -1 if it is in the last bucket, or zero if there
+     *  are no responses.
+     */
+    static qint64 LatencyPercentile(const CommandStats & stats, int p);
+
+
+    //! Sends a command to the microcontroller
+    /*!
+     *  Commands are stored in an array of bytes. The reason for this
+     *  is that it is a bit cleaner to write the commands, ie
+     *
+     *  \code
+     *  uint8_t infocmd[2] = {'\\',COM_INFO};
+     *  \endcode
+     *
+     *  The command goes through the same queue as QueueCommand(), so
+     *  any commands queued before it are completed first.
+     *
+     *  \param command Array of bytes to send
+     *  \param len The length of the command to send
+     *  \param expectedreslen The length of the result expected (not including the 3 header bytes)
+     *  \param timeout The amount of time to wait for a response from the microcontroller (in ms)
+     *  \throw MCInterfaceException An error occurred during sending
+     *         the command or receiving the response
+     */
+    QByteArray SendCommand(const quint8 * command, int len, unsigned int expectedreslen, int timeout = 500);
+
+
+    //! Places a command in the queue without waiting for the response
+    /*!
+     *  The command is written as soon as there is room in the window of outstanding
+     *  commands. When the response arrives, \p onresponse is called and
+     *  CommandFinished() is emitted. On an error, \p onerror is called
+     *  and CommandFailed() is emitted.
+     *
+     *  \param command Array of bytes to send
+     *  \param len The length of the command to send
+     *  \param expectedreslen The length of the result expected (not including the 3 header bytes)
+     *  \param onresponse Called with the response (may be empty)
+     *  \param onerror Called if the command fails (may be empty)
+     *  \param timeout The amount of time to wait for a response from the microcontroller (in ms)
+     *  \return A tag identifying this command in CommandFinished() and CommandFailed()
+     *  \throw MCInterfaceException The port is not open
+     */
+    quint32 QueueCommand(const quint8 * command, int len, unsigned int expectedreslen,
+                         ResponseCallback onresponse = ResponseCallback(),
+                         ErrorCallback onerror = ErrorCallback(),
+                         int timeout = 500);
+
+    //! Returns the number of commands queued or waiting for a response
+    int PendingCommands(void) const;
+
+    //! Sets the maximum number of commands that may be waiting for a response
+    /*!
+     *  Regardless of this setting, the total number of bytes outstanding
+     *  is kept below CMDBUF_SIZE so the microcontroller's buffer does not overflow.
+     */
+    void SetMaxInFlight(int maxinflight);
+
+    //! Sets whether commands are sent with a sequence byte
+    /*!
+     *  Only affects commands that are queued afterwards. Enabled by default.
+     */
+    void SetSequenced(bool sequenced);
+
+
+    //! Returns the current error state of the microcontroller
+    /*!
+     * See ConvertMCError()
+     */
+    int GetMCError(void) const;
+
+
+    //! Returns the id returned from the microcontroller during an error
+    /*!
+     *  The ID should represent which PowerUnit had a problem
+     */
+    int GetMCErrorID(void) const;
+
+    //! Returns the command returned from the microcontroller during an error
+    /*!
+     *  The ID should represent which command had a problem
+     */
+    int GetMCErrorCMD(void) const;
+
+    //! Returns the error code from the serial port
+    /*!
+     *  See documentation for QSterialPort
+     */
+    QSerialPort::SerialPortError GetSPError(void) const;
+
+
+    //! Gets state info from the microcontroller
+    /*!
+     *  Information, including dimmer levels, timestamps, etc, are
+     *  stored in a specific way in a QByteArray (the COM_INFO response)
+     *
+     *  Only the fields that have changed since the last time are
+     *  actually sent by the microcontroller (COM_INFO_DELTA). They are
+     *  merged into a copy of the info kept by this object.
+     *
+     *  \throw MCInterfaceException An error occurred during sending
+     *         the command or receiving the response
+     */
+    QByteArray RetrieveInfo(void);
+
+    //! Queues a request for state info from the microcontroller
+    /*!
+     *  The info is passed to \p onresponse in the same format
+     *  as returned by RetrieveInfo()
+     */
+    quint32 QueueRetrieveInfo(ResponseCallback onresponse, ErrorCallback onerror = ErrorCallback());
+
+    //! Sets the levels of many power units with a single command (COM_BATCH)
+    /*!
+     *  The microcontroller applies all the levels at once. An id of PU_ALL
+     *  sets the level of all power units. If any of the ids are invalid,
+     *  nothing is changed. At most BATCH_MAX pairs may be given.
+     *
+     *  \throw MCInterfaceException An error occurred during sending
+     *         the command or receiving the response. GetMCErrorID() is the
+     *         id of the first unit that failed.
+     */
+    void SetLevels(const LevelList & levels);
+
+    //! Queues setting the levels of many power units with a single command
+    /*!
+     *  See SetLevels()
+     */
+    quint32 QueueSetLevels(const LevelList & levels, ResponseCallback onresponse, ErrorCallback onerror = ErrorCallback());
+
+    //! Sets the levels of many power units on a given half-cycle (COM_SCHEDULE)
+    /*!
+     *  The microcontroller keeps the levels until its half-cycle count
+     *  reaches \p when, and then fades to them over \p halfcycles half-cycles
+     *  (zero to change right away). Everything scheduled for the same count
+     *  takes effect on the same half-cycle, no matter how long the commands
+     *  took to get there. The current count is in the info (see InfoZeroCrossCount()).
+     *
+     *  At most SCHEDULE_MAX pairs may be given, and at most SCHEDULE_QUEUE
+     *  commands may be waiting on the microcontroller.
+     *
+     *  \return The microcontroller's half-cycle count when it received the command
+     *  \throw MCInterfaceException An error occurred during sending
+     *         the command or receiving the response. The error is RES_TOOLATE
+     *         if \p when has already passed.
+     */
+    quint32 ScheduleLevels(quint32 when, const LevelList & levels, quint16 halfcycles = 0);
+
+    //! Queues setting the levels of many power units on a given half-cycle
+    /*!
+     *  See ScheduleLevels(). The response passed to \p onresponse is the
+     *  microcontroller's half-cycle count (4 bytes, low first).
+     */
+    quint32 QueueScheduleLevels(quint32 when, const LevelList & levels, quint16 halfcycles,
+                                ResponseCallback onresponse, ErrorCallback onerror = ErrorCallback());
+
+    //! Returns the half-cycle count from info returned by RetrieveInfo()
+    static quint32 InfoZeroCrossCount(const QByteArray & info);
+
+    //! Gets the performance counters of the microcontroller (COM_STATS)
+    /*!
+     *  Only available if the microcontroller supports FEAT_STATS.
+     *  If \p reset is true, the counters are cleared after being read.
+     *
+     *  \throw MCInterfaceException An error occurred during sending
+     *         the command or receiving the response
+     */
+    MCStats RetrieveStats(bool reset = false);
+
+    //! Queues a request for the performance counters of the microcontroller
+    /*!
+     *  The response passed to \p onresponse can be
+     *  converted with ParseStats(). See RetrieveStats().
+     */
+    quint32 QueueRetrieveStats(bool reset, ResponseCallback onresponse, ErrorCallback onerror = ErrorCallback());
+
+    //! Converts a COM_STATS response (STATS_SIZE bytes) to an MCStats
+    static MCStats ParseStats(const QByteArray & res);
+
+    //! Gets the statistics of the mains cycle from the microcontroller (COM_MAINS)
+    /*!
+     *  Only available if the microcontroller supports FEAT_MAINS.
+     *  If \p reset is true, the statistics are cleared after being read.
+     *
+     *  \throw MCInterfaceException An error occurred during sending
+     *         the command or receiving the response
+     */
+    MainsStats RetrieveMains(bool reset = false);
+
+    //! Queues a request for the statistics of the mains cycle
+    /*!
+     *  The response passed to \p onresponse can be
+     *  converted with ParseMains(). See RetrieveMains().
+     */
+    quint32 QueueRetrieveMains(bool reset, ResponseCallback onresponse, ErrorCallback onerror = ErrorCallback());
+
+    //! Converts a COM_MAINS response (MAINS_SIZE bytes) to a MainsStats
+    static MainsStats ParseMains(const QByteArray & res);
+
+    //! Gets the times of the last zero crossings from the microcontroller (COM_ZC_HISTORY)
+    /*!
+     *  Only available if the microcontroller supports FEAT_MAINS.
+     *
+     *  \throw MCInterfaceException An error occurred during sending
+     *         the command or receiving the response
+     */
+    ZCHistory RetrieveZCHistory(void);
+
+    //! Queues a request for the times of the last zero crossings
+    /*!
+     *  The response passed to \p onresponse can be
+     *  converted with ParseZCHistory(). See RetrieveZCHistory().
+     */
+    quint32 QueueRetrieveZCHistory(ResponseCallback onresponse, ErrorCallback onerror = ErrorCallback());
+
+    //! Converts a COM_ZC_HISTORY response (ZCHIST_RESPONSE_SIZE bytes) to a ZCHistory
+    static ZCHistory ParseZCHistory(const QByteArray & res);
+
+    //! Subscribes to status frames pushed by the microcontroller (COM_SUBSCRIBE)
+    /*!
+     *  While subscribed, the microcontroller sends status frames on its own,
+     *  and StatusPushed() is emitted for each one. If \p onchange is true,
+     *  a frame is sent whenever the state changes. If \p period is nonzero, a frame
+     *  is also sent every \p period half-cycles (120 is about one second
+     *  at 60Hz). Pass false and zero to unsubscribe. If a status frame may
+     *  have been lost, all of the info is retrieved again (and passed to
+     *  StatusPushed()), since each frame only has what changed.
+     *
+     *  \throw MCInterfaceException An error occurred during sending
+     *         the command or receiving the response
+     */
+    void Subscribe(bool onchange, quint16 period);
+
+    //! Stores the current levels of all the power units in a scene slot
+    /*!
+     *  Scenes are kept in the microcontroller's EEPROM, so they survive a
+     *  power cycle. There are SCENE_COUNT slots.
+     *
+     *  \throw MCInterfaceException An error occurred during sending
+     *         the command or receiving the response
+     */
+    void StoreScene(quint8 slot);
+
+    //! Queues storing the current levels in a scene slot (see StoreScene())
+    quint32 QueueStoreScene(quint8 slot, ResponseCallback onresponse, ErrorCallback onerror = ErrorCallback());
+
+    //! Sets all the power units to the levels stored in a scene slot
+    /*!
+     *  The levels are faded to over \p halfcycles half-cycles (zero
+     *  to change them right away).
+     *
+     *  \throw MCInterfaceException An error occurred during sending
+     *         the command or receiving the response. The error is RES_NOSCENE
+     *         if nothing has been stored in the slot.
+     */
+    void RecallScene(quint8 slot, quint16 halfcycles = 0);
+
+    //! Queues recalling a scene slot (see RecallScene())
+    quint32 QueueRecallScene(quint8 slot, quint16 halfcycles, ResponseCallback onresponse, ErrorCallback onerror = ErrorCallback());
+
+    //! Sets whether the last scene stored or recalled is restored at power-up
+    /*!
+     *  \throw MCInterfaceException An error occurred during sending
+     *         the command or receiving the response
+     */
+    void SetBootScene(bool restorelast);
+
+    //! Queues setting what is restored at power-up (see SetBootScene())
+    quint32 QueueSetBootScene(bool restorelast, ResponseCallback onresponse, ErrorCallback onerror = ErrorCallback());
+
+signals:
+    //! Emitted when a queued command receives a successful response
+    void CommandFinished(quint32 tag, const QByteArray & response);
+
+    //! Emitted when a queued command fails
+    void CommandFailed(quint32 tag, const QString & desc);
+
+    //! Emitted when the last outstanding command has completed
+    void QueueEmpty(void);
+
+    //! Emitted when the microcontroller pushes a status frame
+    /*!
+     *  \p info is in the same format as returned by RetrieveInfo(). See Subscribe().
+     */
+    void StatusPushed(const QByteArray & info);
+
+    //! Emitted when the port has been closed because of an error (ie, the device was unplugged)
+    /*!
+     *  Every command that was waiting has failed by then
+     */
+    void PortClosed(void);
+
+private slots:
+    //! Called when data is available on the serial port
+    void ReadyRead(void);
+
+    //! Called when the serial port reports an error
+    /*!
+     *  If the device has gone away, the port is closed, the
+     *  waiting commands fail, and PortClosed() is emitted
+     */
+    void SerialError(QSerialPort::SerialPortError error);
+
+    //! Called when an outstanding command has timed out
+    void ResponseTimeout(void);
+
+private:
+
+    //! Disables copying of this class
+    Q_DISABLE_COPY(MCInterface);
+
+    //! A command waiting to be sent or waiting for its response
+    struct PendingCommand
+    {
+        quint32 tag;                  //!< Tag returned from QueueCommand()
+        QByteArray command;           //!< Raw bytes of the command
+        unsigned int expectedreslen;  //!< Expected length of the result (without header)
+        int timeout;                  //!< Time to wait for the response (in ms)
+        bool sequenced;               //!< Sent with a sequence byte
+        quint8 seq;                   //!< The sequence byte (if sequenced)
+        bool crc;                     //!< Sent in a CRC-checked frame
+        int retries;                  //!< Times it has been sent again after RES_BADCRC
+        int sentlen;                  //!< Number of bytes actually written
+        qint64 deadline;              //!< Time (from _clock) when this command times out
+        qint64 sentus;                //!< Time (from _clock, in us) when this command was written
+        ResponseCallback onresponse;  //!< Called on success
+        ErrorCallback onerror;        //!< Called on failure
+    };
+
+    //! Serial port object
+    QSerialPort _sp;
+
+    //! Microcontroller error flag
+    int _mcerror;
+
+    //! Command returned by the microcontroller during an error
+    int _mcerrorcmd;
+
+    //! ID of the power unit, etc, causing the error
+    int _mcerrorid;
+
+    //! Commands that have not been written yet
+    QList<PendingCommand> _queued;
+
+    //! Commands that have been written and are waiting for a response (oldest first)
+    QList<PendingCommand> _inflight;
+
+    //! Bytes received but not yet parsed into a response
+    QByteArray _rxbuffer;
+
+    //! The last info retrieved from the microcontroller (COM_INFO format)
+    QByteArray _info;
+
+    //! Version of _info on the microcontroller (zero if we don't have any)
+    quint16 _infoversion;
+
+    //! Subscribed to status frames
+    bool _subscribed;
+
+    //! Waiting for the full info after losing a status frame (see ResyncStatus())
+    bool _resyncing;
+
+    //! Times out the oldest outstanding command
+    QTimer _responsetimer;
+
+    //! Tag given to the next queued command
+    quint32 _nexttag;
+
+    //! Maximum number of outstanding commands
+    int _maxinflight;
+
+    //! Send new commands with a sequence byte
+    bool _sequenced;
+
+    //! Sequence byte given to the next command
+    quint8 _nextseq;
+
+    //! Used for the command timeouts
+    QElapsedTimer _clock;
+
+    //! Protocol version reported by COM_CAPS (zero if not supported)
+    int _protocolversion;
+
+    //! Features (FEAT_ bits) reported by COM_CAPS
+    quint16 _features;
+
+    //! Baud rates (bitmap of BAUD_ codes) reported by COM_CAPS
+    quint8 _baudrates;
+
+    //! Fastest baud rate to switch to
+    qint32 _maxbaud;
+
+    //! Baud rate currently in use
+    qint32 _baud;
+
+    //! Use CRC-checked frames if the microcontroller supports them
+    bool _crcframing;
+
+    //! The microcontroller is in CRC mode
+    bool _crcactive;
+
+    //! Statistics about the link (see GetLinkStats())
+    LinkStats _stats;
+
+    //! Time _stats was last reset (from _clock, in ms)
+    qint64 _statsstart;
+
+
+    //! Throws an exception using the current error numbers
+    /*!
+     *  This also taks a description
+     */
+    void ThrowException(const QString & desc) const;
+
+    //! Writes queued commands while there is room in the window
+    void SendQueued(void);
+
+    //! Gets the capabilities of the microcontroller and picks a baud rate
+    /*!
+     *  Called by OpenPort() after the identification string
+     *
+     *  \throw MCInterfaceException The firmware is too old
+     */
+    void Negotiate(void);
+
+    //! Switches both sides to the baud rate with the given BAUD_ code
+    /*!
+     *  \return False if the new rate didn't work and both sides
+     *          went back to the default rate
+     *  \throw MCInterfaceException The microcontroller stopped responding
+     */
+    bool ChangeBaud(int code);
+
+    //! Sends a COM_NOTHING and returns true if it gets a response
+    bool Ping(int timeout);
+
+    //! Returns the baud rate for a BAUD_ code
+    static qint32 BaudRate(int code);
+
+    //! Switches the microcontroller in or out of CRC mode (COM_CRC)
+    void SetCrcMode(bool on);
+
+    //! Returns the bytes to write for a command, assigning its sequence byte
+    QByteArray FrameCommand(PendingCommand & pc);
+
+    //! Returns the number of bytes FrameCommand() will return for a command
+    static int FrameSize(const PendingCommand & pc);
+
+    //! CRC-8 (polynomial 0x07) as used by FRAME_START_CRC and RES_CRC_FLAG
+    static quint8 Crc8(const char * data, int len);
+
+    //! Builds a COM_BATCH command for SetLevels()
+    QByteArray BatchCommand(const LevelList & levels) const;
+
+    //! Builds a COM_SCHEDULE command for ScheduleLevels()
+    QByteArray ScheduleCommand(quint32 when, const LevelList & levels, quint16 halfcycles) const;
+
+    //! Builds a COM_INFO_DELTA command for the version of the info we have
+    QByteArray InfoDeltaCommand(void) const;
+
+    //! Merges a COM_INFO_DELTA response into _info
+    /*!
+     *  \return False (with a description in \p err) if the response is malformed
+     */
+    bool MergeInfoDelta(const QByteArray & delta, QString & err);
+
+    //! Parses complete responses out of the receive buffer
+    void ProcessResponses(void);
+
+    //! Completes the outstanding command the given response frame belongs to
+    /*!
+     *  Status frames pushed by the microcontroller are passed to HandleStatus().
+     *  \p checked is true if the frame had a (good) CRC.
+     */
+    void HandleResponse(const QByteArray & frame, bool checked);
+
+    //! Merges a pushed status frame and emits StatusPushed()
+    void HandleStatus(const QByteArray & status);
+
+    //! Gets all of the info again after a status frame may have been lost
+    /*!
+     *  Each status frame only has what changed since the one before, so
+     *  after losing one, _info would stay wrong. Once the info arrives,
+     *  StatusPushed() is emitted as for a status frame.
+     */
+    void ResyncStatus(void);
+
+    //! Fails a command, calling its error callback and emitting CommandFailed()
+    void FailCommand(const PendingCommand & pc, const QString & desc);
+
+    //! Fails all outstanding commands with the given description
+    void FailInFlight(const QString & desc);
+
+    //! Fails any outstanding commands that have timed out
+    void FailExpired(void);
+
+    //! Restarts the response timer for the next outstanding command to time out
+    void RestartTimer(void);
+
+    //! Returns the statistics for the command a PendingCommand holds
+    /*!
+     *  NULL for the identification string, which isn't a command
+     */
+    CommandStats * StatsFor(const PendingCommand & pc);
+
+    //! Records the latency of a response to \p pc in the statistics
+    void RecordResponse(const PendingCommand & pc, bool mcerror);
+};
+
+
+
+#endif // MICROCONT_H
@@ -10,8 +10,6 @@
 #include <stdexcept>
 #include <exception>
 
-#include <QApplication>
-#include <QMessageBox>
 #include <QString>
 #include <QtSerialPort/QSerialPort>
 #include <QtSerialPort/QSerialPortInfo>
@@ -0,0 +1,349 @@
+/*! \file
+ *  \brief     A class describing individual, controllable power units
+ *  \author    Benjamin Pritchard (ben@bennyp.org)
+ *  \copyright 2013 Benjamin Pritchard. Released under the MIT License
+ */
+
+#include <iostream>
+#include <string>
+#include <stdexcept>
+#include <exception>
+
+#include <QString>
+#include <QtSerialPort/QSerialPort>
+#include <QtSerialPort/QSerialPortInfo>
+
+#include "powerunit.h"
+#include "microcont.h"
+#include "microcontexception.h"
+#include "commands.h"
+
+using namespace std;
+
+PUInterface::PUInterface(char id, const QString &desc, QSharedPointer<MCInterface> mc)
+        : _id(id),_desc(desc),_mc(mc)
+{
+    _levelinflight = false;
+    _haspending = false;
+    _pendinglevel = 0;
+    _mininterval = 0;
+
+    _ratetimer.setSingleShot(true);
+    connect(&_ratetimer, SIGNAL(timeout()), this, SLOT(SendPendingLevel()));
+
+    Reset();
+}
+
+PUInterface::~PUInterface()
+{
+}
+
+quint8 PUInterface::GetLevel(void)
+{
+    return _level;
+}
+
+quint8 PUInterface::GetRequestedLevel(void)
+{
+    return (_haspending ? _pendinglevel : _level);
+}
+
+QString PUInterface::GetDescription(void)
+{
+    return _desc;
+}
+
+char PUInterface::GetID(void)
+{
+    return _id;
+}
+
+
+bool PUInterface::Toggle(void)
+{
+    if(_state == PUSTATE_ON)
+        TurnOff();
+    else if(_state == PUSTATE_OFF)
+        TurnOn();
+
+    return _state;
+}
+
+quint8 PUInterface::SetLevel(quint8 level)
+{
+    CancelPendingLevel();
+
+    quint8 command[4];
+    command[0] = '\\';
+    command[1] = COM_LEVEL;
+    command[2] = _id;
+    command[3] = level;
+
+    _mc->SendCommand(command, 4, 0);
+
+    ApplyLevel(level);
+
+    return _level; // for now. Maybe some more complex stuff in the
+    //  future with what comes back from the microcontroller
+}
+
+
+void PUInterface::TurnOff(void)
+{
+    CancelPendingLevel();
+
+    quint8 command[3];
+    command[0] = '\\';
+    command[1] = COM_OFF;
+    command[2] = _id;
+
+    _mc->SendCommand(command, 3, 0);
+
+    ApplyLevel(0);
+}
+
+void PUInterface::TurnOn(void)
+{
+    CancelPendingLevel();
+
+    quint8 command[3];
+    command[0] = '\\';
+    command[1] = COM_ON;
+    command[2] = _id;
+
+    _mc->SendCommand(command, 3, 0);
+
+    ApplyLevel(100);
+}
+
+void PUInterface::FadeCommand(quint8 * command, quint8 level, quint16 halfcycles) const
+{
+    command[0] = '\\';
+    command[1] = COM_FADE;
+    command[2] = _id;
+    command[3] = level;
+    command[4] = halfcycles & 0xFF;
+    command[5] = (halfcycles >> 8);
+}
+
+void PUInterface::Fade(quint8 level, quint16 halfcycles)
+{
+    CancelPendingLevel();
+
+    quint8 command[6];
+    FadeCommand(command, level, halfcycles);
+
+    _mc->SendCommand(command, 6, 0);
+
+    ApplyLevel(level);
+}
+
+void PUInterface::QueueFade(quint8 level, quint16 halfcycles, DoneCallback ondone, MCInterface::ErrorCallback onerror)
+{
+    CancelPendingLevel();
+
+    quint8 command[6];
+    FadeCommand(command, level, halfcycles);
+
+    _mc->QueueCommand(command, 6, 0,
+                      [this, level, ondone](const QByteArray &)
+                      {
+                          ApplyLevel(level);
+                          if(ondone)
+                              ondone();
+                      },
+                      onerror);
+}
+
+void PUInterface::QueueLevel(quint8 level, DoneCallback ondone, MCInterface::ErrorCallback onerror)
+{
+    QueueUnitCommand(COM_LEVEL, level, ondone, onerror);
+}
+
+void PUInterface::QueueTurnOff(DoneCallback ondone, MCInterface::ErrorCallback onerror)
+{
+    CancelPendingLevel();
+    QueueUnitCommand(COM_OFF, 0, ondone, onerror);
+}
+
+void PUInterface::QueueTurnOn(DoneCallback ondone, MCInterface::ErrorCallback onerror)
+{
+    CancelPendingLevel();
+    QueueUnitCommand(COM_ON, 100, ondone, onerror);
+}
+
+MCInterface::LevelList PUInterface::BuildLevelList(const QList<PUInterface *> & units, const QList<quint8> & levels)
+{
+    Q_ASSERT(units.size() == levels.size());
+
+    MCInterface::LevelList list;
+    for(int i = 0; i < units.size(); i++)
+    {
+        Q_ASSERT(units[i]->_mc == units[0]->_mc);
+        units[i]->CancelPendingLevel();
+        list.push_back(qMakePair((quint8)units[i]->_id, levels[i]));
+    }
+
+    return list;
+}
+
+void PUInterface::SetLevels(const QList<PUInterface *> & units, const QList<quint8> & levels)
+{
+    if(units.isEmpty())
+        return;
+
+    units[0]->_mc->SetLevels(BuildLevelList(units, levels));
+
+    for(int i = 0; i < units.size(); i++)
+        units[i]->ApplyLevel(levels[i]);
+}
+
+void PUInterface::QueueLevels(const QList<PUInterface *> & units, const QList<quint8> & levels,
+                              DoneCallback ondone, MCInterface::ErrorCallback onerror)
+{
+    if(units.isEmpty())
+        return;
+
+    units[0]->_mc->QueueSetLevels(BuildLevelList(units, levels),
+                                  [units, levels, ondone](const QByteArray &)
+                                  {
+                                      for(int i = 0; i < units.size(); i++)
+                                          units[i]->ApplyLevel(levels[i]);
+                                      if(ondone)
+                                          ondone();
+                                  },
+                                  onerror);
+}
+
+void PUInterface::RequestLevel(quint8 level, DoneCallback ondone, MCInterface::ErrorCallback onerror)
+{
+    _haspending = true;
+    _pendinglevel = level;
+    _pendingdone = ondone;
+    _pendingerror = onerror;
+
+    SendPendingLevel();
+}
+
+void PUInterface::SetMaxUpdateRate(int rate)
+{
+    _mininterval = (rate > 0 ? 1000/rate : 0);
+}
+
+void PUInterface::SendPendingLevel(void)
+{
+    if(!_haspending || _levelinflight)
+        return;
+
+    if(_mininterval > 0 && _lastlevelsend.isValid())
+    {
+        qint64 wait = _mininterval - _lastlevelsend.elapsed();
+        if(wait > 0)
+        {
+            if(!_ratetimer.isActive())
+                _ratetimer.start(wait);
+            return;
+        }
+    }
+
+    quint8 level = _pendinglevel;
+    DoneCallback ondone = _pendingdone;
+    MCInterface::ErrorCallback onerror = _pendingerror;
+    CancelPendingLevel();
+
+    _levelinflight = true;
+    _lastlevelsend.start();
+
+    try {
+        QueueLevel(level,
+                   [this, ondone]()
+                   {
+                       _levelinflight = false;
+                       if(ondone)
+                           ondone();
+                       SendPendingLevel();
+                   },
+                   [this, onerror](const MCInterfaceException & ex)
+                   {
+                       _levelinflight = false;
+                       if(onerror)
+                           onerror(ex);
+                       SendPendingLevel();
+                   });
+    }
+    catch(const MCInterfaceException & ex)
+    {
+        // This may be called from the timer, so
+        // report through the callback rather than throwing
+        _levelinflight = false;
+        if(onerror)
+            onerror(ex);
+    }
+}
+
+void PUInterface::CancelPendingLevel(void)
+{
+    _haspending = false;
+    _pendingdone = DoneCallback();
+    _pendingerror = MCInterface::ErrorCallback();
+    _ratetimer.stop();
+}
+
+void PUInterface::QueueUnitCommand(quint8 com, quint8 level, DoneCallback ondone, MCInterface::ErrorCallback onerror)
+{
+    quint8 command[4];
+    command[0] = '\\';
+    command[1] = com;
+    command[2] = _id;
+    command[3] = level;
+
+    // COM_ON and COM_OFF don't take a level
+    int len = (com == COM_LEVEL ? 4 : 3);
+
+    _mc->QueueCommand(command, len, 0,
+                      [this, level, ondone](const QByteArray &)
+                      {
+                          ApplyLevel(level);
+                          if(ondone)
+                              ondone();
+                      },
+                      onerror);
+}
+
+void PUInterface::ApplyLevel(quint8 level)
+{
+    _level = level;
+
+    if(level >= 100)
+        _state = PUSTATE_ON;
+    else if(level == 0)
+        _state = PUSTATE_OFF;
+    else
+        _state = PUSTATE_DIM;
+}
+
+void PUInterface::Reset()
+{
+    CancelPendingLevel();
+    _levelinflight = false;
+
+    _level = 0;
+    _state = PUSTATE_OFF;
+}
+
+bool PUInterface::MCIsOpen(void)
+{
+    return _mc->IsOpen();
+}
+
+quint8 PUInterface::GetState(void)
+{
+    return _state;
+}
+
+void PUInterface::SyncState(char state, quint8 level)
+{
+    _state = state;
+    _level = level;
+}
+
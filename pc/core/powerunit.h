@@ -0,0 +1,239 @@
+/*! \file
+ *  \brief     A class describing individual, controllable power units
+ *  \author    Benjamin Pritchard (ben@bennyp.org)
+ *  \copyright 2013 Benjamin Pritchard. Released under the MIT License
+ */
+
+#ifndef POWERUNIT_H
+#define POWERUNIT_H
+
+#include <functional>
+
+#include <QString>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QSharedPointer>
+#include <QtSerialPort/QSerialPort>
+#include <QtSerialPort/QSerialPortInfo>
+#include <microcont.h>
+
+using namespace std;
+
+//! A general interface to a power unit
+/*!
+ *  In general, if any operation goes wrong, this
+ *  class will throw a MCInterfaceException
+ */
+class PUInterface : public QObject
+{
+    Q_OBJECT;
+
+public:
+   //! Called when a queued operation has been completed by the microcontroller
+   typedef std::function<void(void)> DoneCallback;
+
+   //! Constructor
+   /*!
+   *   Creates an interface to a power unit given an id, description, and
+   *   an pointer to the micrcontroller it's connected to
+   */
+   PUInterface(char id, const QString &desc, QSharedPointer<MCInterface> mc);
+
+   ~PUInterface();
+
+   //! Returns the current dimmer level
+   quint8 GetLevel(void);
+
+   //! Returns the level most recently passed to RequestLevel()
+   /*!
+    *  If there is no level change waiting to be sent, this is the
+    *  same as GetLevel()
+    */
+   quint8 GetRequestedLevel(void);
+
+   //! Returns the description of the power unit
+   QString GetDescription(void);
+
+   //! Returns the ID of the power unit
+   char GetID(void);
+
+   //! Returns the state of the power unit (see commands.h)
+   quint8 GetState(void);
+
+   //! Syncs the state of the class with the given state and dimmer level
+   void SyncState(char state, quint8 level);
+
+   //! Toggles the power unit between on and off
+   /*!
+    *
+    *  This has no effect if the state is not PUSTATE_ON or PUSTATE_OFF
+    *
+    *  \throw MCInterfaceException There is a problem communicating this command
+    *         to the microcontroller
+    */
+   bool Toggle(void);
+
+   //! Dims the powerunit to the given level
+   /*!
+    *  \return The level to which it was actually set
+    *  \throw MCInterfaceException There is a problem communicating this command
+    *         to the microcontroller
+    */
+   quint8 SetLevel(quint8 level);
+
+   //! Turns off the power unit
+   /*!
+    *  \throw MCInterfaceException There is a problem communicating this command
+    *         to the microcontroller
+    */
+   void TurnOff(void);
+
+   //! Turns on the power unit
+   /*!
+    *  \throw MCInterfaceException There is a problem communicating this command
+    *         to the microcontroller
+    */
+   void TurnOn(void);
+
+
+   //! Fades the power unit to the given level
+   /*!
+    *  The microcontroller changes the level a little every half-cycle
+    *  by itself, reaching \p level after \p halfcycles half-cycles (120 is
+    *  about one second at 60Hz). The progress of the fade is reported
+    *  in the info (see MCInterface::RetrieveInfo()).
+    *
+    *  The state of this object is set to the target level right away.
+    *
+    *  \throw MCInterfaceException There is a problem communicating this command
+    *         to the microcontroller
+    */
+   void Fade(quint8 level, quint16 halfcycles);
+
+
+   //! Queues a change of the dimmer level without waiting for the response
+   /*!
+    *  The state of this object is updated when the microcontroller
+    *  responds, after which \p ondone is called. If the command fails,
+    *  \p onerror is called instead.
+    *
+    *  \throw MCInterfaceException The microcontroller is not open
+    */
+   void QueueLevel(quint8 level, DoneCallback ondone, MCInterface::ErrorCallback onerror);
+
+   //! Queues turning off the power unit without waiting for the response
+   /*!
+    *  \copydetails QueueLevel()
+    */
+   void QueueTurnOff(DoneCallback ondone, MCInterface::ErrorCallback onerror);
+
+   //! Queues turning on the power unit without waiting for the response
+   /*!
+    *  \copydetails QueueLevel()
+    */
+   void QueueTurnOn(DoneCallback ondone, MCInterface::ErrorCallback onerror);
+
+   //! Queues a fade without waiting for the response
+   /*!
+    *  See Fade() and QueueLevel()
+    */
+   void QueueFade(quint8 level, quint16 halfcycles, DoneCallback ondone, MCInterface::ErrorCallback onerror);
+
+   //! Sets the levels of several power units with a single command
+   /*!
+    *  The levels are applied by the microcontroller all at once (see
+    *  MCInterface::SetLevels()). All units must be controlled by the
+    *  same microcontroller, and \p levels must be the same size as \p units.
+    *
+    *  \throw MCInterfaceException There is a problem communicating this command
+    *         to the microcontroller
+    */
+   static void SetLevels(const QList<PUInterface *> & units, const QList<quint8> & levels);
+
+   //! Queues setting the levels of several power units with a single command
+   /*!
+    *  The states of the units are updated when the microcontroller
+    *  responds, after which \p ondone is called. See SetLevels().
+    *
+    *  \throw MCInterfaceException The microcontroller is not open
+    */
+   static void QueueLevels(const QList<PUInterface *> & units, const QList<quint8> & levels,
+                           DoneCallback ondone, MCInterface::ErrorCallback onerror);
+
+   //! Requests a change of the dimmer level, coalescing with other requests
+   /*!
+    *  Only one level change for this unit is sent at a time. While one is
+    *  waiting for the microcontroller (or if the last one was sent
+    *  too recently, see SetMaxUpdateRate()), \p level replaces any
+    *  requested level that hasn't been sent yet. When the link is free,
+    *  only the most recent level is sent.
+    *
+    *  \p ondone and \p onerror are called as in QueueLevel() for each
+    *  level that is actually sent. Levels that are replaced before being
+    *  sent don't get any callbacks.
+    *
+    *  Turning the unit on or off, or resetting it, cancels any level that
+    *  hasn't been sent yet.
+    */
+   void RequestLevel(quint8 level, DoneCallback ondone, MCInterface::ErrorCallback onerror);
+
+   //! Sets the maximum number of level changes per second sent by RequestLevel()
+   /*!
+    *  A rate of zero (the default) means level changes are limited only by
+    *  waiting for the previous one to complete.
+    */
+   void SetMaxUpdateRate(int rate);
+
+
+   //! Resets the power unit state
+   /*!
+    *  This does not actually communicate with the microcontroller
+    */
+   void Reset(void);
+
+
+   //! Returns true if the microcontroller controlling this power unit is open
+   bool MCIsOpen(void);
+
+
+    private:
+        char _id; //!< The ID given to this power unit
+        QString _desc; //!< A text description of the power unit
+        quint8 _state; //!< The current state of the power unit (PUSTATE_XXX)
+        quint8 _level; //!< The current dimmer level
+
+        QSharedPointer<MCInterface> _mc; //!< The microcontroller interface controlling this power unit
+
+        bool _levelinflight;                        //!< A level from RequestLevel() is waiting for the microcontroller
+        bool _haspending;                           //!< There is a requested level that hasn't been sent
+        quint8 _pendinglevel;                       //!< The requested level that hasn't been sent
+        DoneCallback _pendingdone;                  //!< Success callback for _pendinglevel
+        MCInterface::ErrorCallback _pendingerror;   //!< Error callback for _pendinglevel
+        int _mininterval;                           //!< Minimum time between level changes (in ms)
+        QElapsedTimer _lastlevelsend;               //!< Time since the last level change was sent
+        QTimer _ratetimer;                          //!< Sends the pending level once _mininterval has passed
+
+        //! Updates the state and level after the microcontroller has set the given level
+        void ApplyLevel(quint8 level);
+
+        //! Drops any level from RequestLevel() that hasn't been sent yet
+        void CancelPendingLevel(void);
+
+        //! Builds the list of (id, level) pairs for SetLevels() and QueueLevels()
+        static MCInterface::LevelList BuildLevelList(const QList<PUInterface *> & units, const QList<quint8> & levels);
+
+        //! Queues a COM_ON, COM_OFF, or COM_LEVEL command for this unit
+        void QueueUnitCommand(quint8 com, quint8 level, DoneCallback ondone, MCInterface::ErrorCallback onerror);
+
+        //! Builds a COM_FADE command for Fade() and QueueFade()
+        void FadeCommand(quint8 * command, quint8 level, quint16 halfcycles) const;
+
+        Q_DISABLE_COPY(PUInterface)
+
+    private slots:
+        //! Sends the requested level if the link is free and enough time has passed
+        void SendPendingLevel(void);
+};
+
+#endif
+
@@ -0,0 +1,530 @@
+/*! \file
+ *  \brief     Runs scripts of commands on the microcontroller (for bplc and bplcd)
+ *  \author    Benjamin Pritchard (ben@bennyp.org)
+ *  \copyright 2013 Benjamin Pritchard. Released under the MIT License
+ */
+
+#include <cerrno>
+#include <cmath>
+#include <unistd.h>
+
+#include <QMetaObject>
+
+#include "scriptrunner.h"
+#include "microcontexception.h"
+#include "commands.h"
+#include "commands-text.h"
+
+ScriptRunner::ScriptRunner(QSharedPointer<MCInterface> mc, const QList<PUInterface *> & units)
+    : _mc(mc), _units(units)
+{
+    _autorun = true;
+    _merge = false;
+    _line = 0;
+    _count = 0;
+    _failures = 0;
+    _ended = false;
+    _finished = false;
+    _fd = -1;
+    _notifier = NULL;
+
+    _waittimer.setSingleShot(true);
+    connect(&_waittimer, SIGNAL(timeout()), this, SLOT(WaitDone()));
+}
+
+ScriptRunner::~ScriptRunner()
+{
+    delete _notifier;
+}
+
+void ScriptRunner::SetOutput(OutputCallback onoutput)
+{
+    _onoutput = onoutput;
+}
+
+void ScriptRunner::SetCompleted(CompletedCallback oncompleted)
+{
+    _oncompleted = oncompleted;
+}
+
+void ScriptRunner::SetHandler(HandlerCallback handler)
+{
+    _handler = handler;
+}
+
+void ScriptRunner::SetAutoRun(bool autorun, ReadyCallback onready)
+{
+    _autorun = autorun;
+    _onready = onready;
+}
+
+void ScriptRunner::SetMergeLevels(bool merge)
+{
+    _merge = merge;
+}
+
+void ScriptRunner::AddLine(const QString & text)
+{
+    _line++;
+
+    QString code = text;
+    int comment = code.indexOf('#');
+    if(comment >= 0)
+        code.truncate(comment);
+
+    foreach(const QString & part, code.split(';'))
+    {
+        QString st = part.simplified();
+        if(!st.isEmpty())
+        {
+            const Statement statement = { _line, st, _count++, QString() };
+            _statements.push_back(statement);
+        }
+    }
+
+    if(_autorun)
+        QMetaObject::invokeMethod(this, "RunPending", Qt::QueuedConnection);
+}
+
+void ScriptRunner::AddError(const QString & error)
+{
+    _line++;
+
+    const Statement statement = { _line, QString(), _count++, error };
+    _statements.push_back(statement);
+
+    if(_autorun)
+        QMetaObject::invokeMethod(this, "RunPending", Qt::QueuedConnection);
+}
+
+void ScriptRunner::RunText(const QString & text)
+{
+    foreach(const QString & line, text.split('\n'))
+        AddLine(line);
+
+    EndInput();
+}
+
+void ScriptRunner::RunStream(int fd)
+{
+    _fd = fd;
+    _notifier = new QSocketNotifier(fd, QSocketNotifier::Read);
+    connect(_notifier, SIGNAL(activated(int)), this, SLOT(ReadInput()));
+}
+
+void ScriptRunner::EndInput(void)
+{
+    _ended = true;
+
+    if(_notifier)
+        _notifier->setEnabled(false);
+
+    QMetaObject::invokeMethod(this, "CheckFinished", Qt::QueuedConnection);
+}
+
+void ScriptRunner::Clear(void)
+{
+    _statements.clear();
+}
+
+void ScriptRunner::FailWaiting(const QString & error)
+{
+    // The completed callback may clear the rest
+    while(!_statements.isEmpty())
+    {
+        const Statement st = _statements.takeFirst();
+        Start(st);
+        Complete(st, error);
+    }
+}
+
+bool ScriptRunner::CanRun(void) const
+{
+    return !_waittimer.isActive() && !_statements.isEmpty();
+}
+
+void ScriptRunner::RunNext(void)
+{
+    if(!CanRun())
+        return;
+
+    const Statement st = _statements.takeFirst();
+    const QStringList words = st.text.split(' ');
+
+    Start(st);
+
+    if(!st.error.isEmpty())
+    {
+        Complete(st, st.error);
+        return;
+    }
+
+    if(_merge && Superseded(words))
+    {
+        Complete(st);
+        return;
+    }
+
+    try {
+        RunStatement(words, st);
+    }
+    catch(const ScriptError & ex)
+    {
+        Complete(st, ex.what);
+    }
+    catch(const MCInterfaceException & ex)
+    {
+        Complete(st, ex);
+    }
+}
+
+int ScriptRunner::GetOutstanding(void) const
+{
+    return _running.size();
+}
+
+int ScriptRunner::GetWaiting(void) const
+{
+    return _statements.size();
+}
+
+int ScriptRunner::GetFailures(void) const
+{
+    return _failures;
+}
+
+void ScriptRunner::ReadInput(void)
+{
+    char buf[4096];
+    ssize_t n = read(_fd, buf, sizeof(buf));
+
+    if(n < 0 && (errno == EINTR || errno == EAGAIN))
+        return;
+
+    if(n <= 0)
+    {
+        if(!_partial.isEmpty())
+            AddLine(QString::fromLocal8Bit(_partial));
+        _partial.clear();
+        EndInput();
+        return;
+    }
+
+    _partial.append(buf, n);
+
+    int end;
+    while((end = _partial.indexOf('\n')) >= 0)
+    {
+        AddLine(QString::fromLocal8Bit(_partial.left(end)));
+        _partial.remove(0, end+1);
+    }
+}
+
+void ScriptRunner::RunPending(void)
+{
+    if(!_autorun)
+        return;
+
+    while(CanRun())
+        RunNext();
+}
+
+void ScriptRunner::WaitDone(void)
+{
+    Complete(_waiting);
+
+    if(_autorun)
+        RunPending();
+    else if(_onready)
+        _onready();
+}
+
+void ScriptRunner::CheckFinished(void)
+{
+    if(!_finished && _ended && _statements.isEmpty() && _running.isEmpty())
+    {
+        _finished = true;
+        emit Finished();
+    }
+}
+
+void ScriptRunner::RunStatement(const QStringList & words, const Statement & st)
+{
+    const QString & com = words[0];
+    const int args = words.size() - 1;
+
+    if(com == "on" && args == 1)
+        Unit(words[1])->QueueTurnOn(OnDone(st), OnError(st));
+    else if(com == "off" && args == 1)
+        Unit(words[1])->QueueTurnOff(OnDone(st), OnError(st));
+    else if(com == "level" && args == 2)
+        Unit(words[1])->QueueLevel(Number(words[2], 0, 100), OnDone(st), OnError(st));
+    else if(com == "fade" && args == 3)
+        Unit(words[1])->QueueFade(Number(words[2], 0, 100), Number(words[3], 0, 0xFFFF), OnDone(st), OnError(st));
+    else if(com == "batch" && args >= 2 && (args % 2) == 0)
+    {
+        if(args/2 > BATCH_MAX)
+            throw ScriptError(QString("At most %1 units can be set at once").arg(BATCH_MAX));
+
+        QList<PUInterface *> units;
+        QList<quint8> levels;
+        for(int i = 1; i < words.size(); i += 2)
+        {
+            units.push_back(Unit(words[i]));
+            levels.push_back(Number(words[i+1], 0, 100));
+        }
+
+        PUInterface::QueueLevels(units, levels, OnDone(st), OnError(st));
+    }
+    else if(com == "info" && args == 0)
+    {
+        _mc->QueueRetrieveInfo([this, st](const QByteArray & info)
+                               {
+                                   foreach(const QString & line, FormatInfo(info))
+                                       Output(st, line);
+                                   Complete(st);
+                               },
+                               OnError(st));
+    }
+    else if(com == "stats" && (args == 0 || (args == 1 && words[1] == "reset")))
+    {
+        _mc->QueueRetrieveStats(args == 1,
+                                [this, st](const QByteArray & res)
+                                {
+                                    const MCInterface::MCStats stats = MCInterface::ParseStats(res);
+                                    Output(st, QString("rxoverflows %1").arg(stats.rxoverflows));
+                                    Output(st, QString("overruns %1").arg(stats.overruns));
+                                    Output(st, QString("frameerrors %1").arg(stats.frameerrors));
+                                    Output(st, QString("bufferhigh %1").arg(stats.bufferhigh));
+                                    Output(st, QString("missedzc %1").arg(stats.missedzerocrossings));
+                                    Output(st, QString("loopmax %1").arg(stats.loopmax));
+                                    Output(st, QString("isrmax %1 %2 %3 %4")
+                                           .arg(stats.isrmax[STATS_ISR_ZEROCROSS]).arg(stats.isrmax[STATS_ISR_COMPARE])
+                                           .arg(stats.isrmax[STATS_ISR_TOP]).arg(stats.isrmax[STATS_ISR_RX]));
+                                    Complete(st);
+                                },
+                                OnError(st));
+    }
+    else if(com == "mains" && (args == 0 || (args == 1 && words[1] == "reset")))
+    {
+        _mc->QueueRetrieveMains(args == 1,
+                                [this, st](const QByteArray & res)
+                                {
+                                    const MCInterface::MainsStats mains = MCInterface::ParseMains(res);
+                                    if(mains.count == 0 || mains.min == 0)
+                                        Output(st, "mains none");
+                                    else
+                                        Output(st, QString("mains %1 Hz min %2 max %3 jitter %4 us cycles %5")
+                                               .arg(MICROCONTROLLER_ZCTIMER_HZ / mains.mean, 0, 'f', 3)
+                                               .arg(double(MICROCONTROLLER_ZCTIMER_HZ) / mains.max, 0, 'f', 3)
+                                               .arg(double(MICROCONTROLLER_ZCTIMER_HZ) / mains.min, 0, 'f', 3)
+                                               .arg(std::sqrt(mains.variance) * 1e6 / MICROCONTROLLER_ZCTIMER_HZ, 0, 'f', 1)
+                                               .arg(mains.count));
+                                    Complete(st);
+                                },
+                                OnError(st));
+    }
+    else if(com == "history" && args == 0)
+    {
+        _mc->QueueRetrieveZCHistory([this, st](const QByteArray & res)
+                                    {
+                                        const MCInterface::ZCHistory history = MCInterface::ParseZCHistory(res);
+
+                                        // Oldest first, and the edges alternate
+                                        for(int i = 0; i < ZCHIST_SIZE; i++)
+                                        {
+                                            const int age = ZCHIST_SIZE - 1 - i;
+                                            if(history.intervals[i] == 0)
+                                                continue;
+
+                                            Output(st, QString("%1 %2 %3 %4").arg(history.count - age)
+                                                   .arg((history.newestrising != ((age % 2) == 1)) ? "rising" : "falling")
+                                                   .arg(history.intervals[i])
+                                                   .arg(history.intervals[i] * 1e6 / MICROCONTROLLER_ZCTIMER_HZ, 0, 'f', 1));
+                                        }
+                                        Complete(st);
+                                    },
+                                    OnError(st));
+    }
+    else if(com == "scene" && args == 2 && words[1] == "store")
+        _mc->QueueStoreScene(Number(words[2], 0, SCENE_COUNT-1), OnResponse(st), OnError(st));
+    else if(com == "scene" && (args == 2 || args == 3) && words[1] == "recall")
+        _mc->QueueRecallScene(Number(words[2], 0, SCENE_COUNT-1), (args == 3) ? Number(words[3], 0, 0xFFFF) : 0,
+                              OnResponse(st), OnError(st));
+    else if(com == "scene" && args == 2 && words[1] == "boot" && (words[2] == "off" || words[2] == "last"))
+        _mc->QueueSetBootScene(words[2] == "last", OnResponse(st), OnError(st));
+    else if(com == "wait" && args == 1)
+    {
+        _waittimer.start(Number(words[1], 0, 3600000));
+        _waiting = st;
+    }
+    else if(_handler && _handler(words))
+        Complete(st);
+    else
+        throw ScriptError("Unknown command or wrong number of arguments");
+}
+
+bool ScriptRunner::Superseded(const QStringList & words) const
+{
+    if(words.size() != 3 || words[0] != "level" || _statements.isEmpty())
+        return false;
+
+    const QStringList next = _statements.front().text.split(' ');
+    return (next.size() == 3 && next[0] == "level" && next[1] == words[1]);
+}
+
+PUInterface * ScriptRunner::Unit(const QString & word)
+{
+    const int id = Number(word, 1, PU_COUNT);
+
+    if(id > _units.size())
+        throw ScriptError(QString("No unit %1").arg(id));
+
+    return _units[id-1];
+}
+
+int ScriptRunner::Number(const QString & word, int min, int max)
+{
+    bool ok;
+    int n = word.toInt(&ok);
+
+    if(!ok || n < min || n > max)
+        throw ScriptError(QString("'%1' is not a number from %2 to %3").arg(word).arg(min).arg(max));
+
+    return n;
+}
+
+void ScriptRunner::Start(const Statement & st)
+{
+    const Result r = { st, false, QString(), QStringList() };
+    _running.push_back(r);
+}
+
+ScriptRunner::Result * ScriptRunner::Find(const Statement & st)
+{
+    for(int i = 0; i < _running.size(); i++)
+    {
+        if(_running[i].st.number == st.number)
+            return &_running[i];
+    }
+
+    return NULL;
+}
+
+void ScriptRunner::Output(const Statement & st, const QString & line)
+{
+    Result * r = Find(st);
+    if(!r)
+        return;
+
+    r->output.push_back(line);
+    Report();
+}
+
+void ScriptRunner::Complete(const Statement & st, const QString & error)
+{
+    Result * r = Find(st);
+    if(!r || r->done)
+        return;
+
+    r->done = true;
+    r->error = error;
+    Report();
+}
+
+void ScriptRunner::Report(void)
+{
+    // Only the oldest statement that has been run is reported, so
+    // replies stay in order however the commands finish. The
+    // callbacks may complete more, so look at _running each time.
+    while(!_running.isEmpty())
+    {
+        QStringList output;
+        output.swap(_running.front().output);
+
+        foreach(const QString & line, output)
+        {
+            if(_onoutput)
+                _onoutput(line);
+        }
+
+        if(_running.isEmpty() || !_running.front().done)
+            break;
+
+        const Result r = _running.takeFirst();
+
+        if(!r.error.isEmpty())
+            _failures++;
+
+        if(_oncompleted)
+            _oncompleted(r.st.line, r.st.text, r.error);
+    }
+
+    CheckFinished();
+}
+
+void ScriptRunner::Complete(const Statement & st, const MCInterfaceException & ex)
+{
+    if(ex.GetMCError() > 0)
+        Complete(st, QString("%1 (%2)").arg(ex.what()).arg(ConvertMCError(ex.GetMCError())));
+    else
+        Complete(st, QString(ex.what()));
+}
+
+PUInterface::DoneCallback ScriptRunner::OnDone(const Statement & st)
+{
+    return [this, st]() { Complete(st); };
+}
+
+MCInterface::ResponseCallback ScriptRunner::OnResponse(const Statement & st)
+{
+    return [this, st](const QByteArray &) { Complete(st); };
+}
+
+MCInterface::ErrorCallback ScriptRunner::OnError(const Statement & st)
+{
+    return [this, st](const MCInterfaceException & ex) { Complete(st, ex); };
+}
+
+QStringList ScriptRunner::FormatInfo(const QByteArray & info)
+{
+    QStringList lines;
+    const quint8 * p = (const quint8 *)info.constData();
+
+    if(info.size() < INFO_SIZE)
+        return lines;
+
+    // Same as the GUI, from the latest pair of stamps
+    const double halfcycle = ((p[0] | (p[1] << 8)) + (p[2] | (p[3] << 8))) / 2.0;
+    lines.push_back(QString("count %1 freq %2").arg(MCInterface::InfoZeroCrossCount(info))
+                    .arg((halfcycle > 0) ? MICROCONTROLLER_FCPU / (halfcycle * 16.0) : 0.0, 0, 'f', 2));
+
+    for(int i = 0; i < PU_COUNT; i++)
+    {
+        const quint8 * pu = p + INFO_ZC_SIZE + INFO_DIMMER_SIZE*DIMMER_COUNT + INFO_PU_SIZE*i;
+        const char * state = "unknown";
+
+        switch(pu[1])
+        {
+        case PUSTATE_OFF:
+            state = "off";
+            break;
+        case PUSTATE_ON:
+            state = "on";
+            break;
+        case PUSTATE_DIM:
+            state = "dim";
+            break;
+        }
+
+        QString line = QString("unit %1 %2 %3").arg(pu[0]).arg(state).arg(pu[2]);
+
+        const quint16 remaining = pu[4] | (pu[5] << 8);
+        if(remaining > 0)
+            line += QString(" fade %1 %2").arg(pu[3]).arg(remaining);
+
+        lines.push_back(line);
+    }
+
+    return lines;
+}
@@ -0,0 +1,269 @@
+/*! \file
+ *  \brief     Runs scripts of commands on the microcontroller (for bplc and bplcd)
+ *  \author    Benjamin Pritchard (ben@bennyp.org)
+ *  \copyright 2013 Benjamin Pritchard. Released under the MIT License
+ */
+
+#ifndef SCRIPTRUNNER_H
+#define SCRIPTRUNNER_H
+
+#include <functional>
+
+#include <QObject>
+#include <QList>
+#include <QString>
+#include <QStringList>
+#include <QByteArray>
+#include <QSharedPointer>
+#include <QSocketNotifier>
+#include <QTimer>
+
+#include "microcont.h"
+#include "powerunit.h"
+
+//! Runs scripts of commands on a microcontroller
+/*!
+ *  A script is a list of statements, separated by newlines or
+ *  semicolons. Anything after a # is a comment. The statements are:
+ *
+ *  \code
+ *  on <unit>                  level <unit> <0-100>
+ *  off <unit>                 fade <unit> <level> <half-cycles>
+ *  batch <unit> <level> [<unit> <level> ...]
+ *  scene store <slot>         scene recall <slot> [<half-cycles>]
+ *  scene boot off|last        wait <ms>
+ *  info                       stats [reset]
+ *  mains [reset]              history
+ *  \endcode
+ *
+ *  Units are numbered from 1 (see commands.h). Commands are queued
+ *  with MCInterface::QueueCommand() as soon as they are run, so
+ *  several can be on their way to the microcontroller at once.
+ *  wait delays the statements after it.
+ *
+ *  Every statement that is run completes exactly once, in order,
+ *  and anything it returns is passed to the output callback (one
+ *  line at a time) before it completes. A statement whose command
+ *  finishes early (or that doesn't send one) is held back until
+ *  the statements before it have completed. A statement that fails
+ *  doesn't stop the rest of the script.
+ */
+class ScriptRunner : public QObject
+{
+    Q_OBJECT
+
+public:
+    //! Called with each line of output (without a newline)
+    typedef std::function<void(const QString &)> OutputCallback;
+
+    //! Called when a statement completes
+    /*!
+     *  \p line is the line it came from, and \p error is
+     *  empty if it succeeded
+     */
+    typedef std::function<void(int line, const QString & statement, const QString & error)> CompletedCallback;
+
+    //! Given the words of a statement that isn't known, returns true if it has been handled
+    typedef std::function<bool(const QStringList &)> HandlerCallback;
+
+    //! Called when there may be statements that can be run (see SetAutoRun())
+    typedef std::function<void(void)> ReadyCallback;
+
+    //! Creates a runner for power units of an open microcontroller
+    /*!
+     *  The units are not owned by the runner, and must be in order of id
+     */
+    ScriptRunner(QSharedPointer<MCInterface> mc, const QList<PUInterface *> & units);
+
+    ~ScriptRunner();
+
+    //! Sets the function called with the output of statements
+    void SetOutput(OutputCallback onoutput);
+
+    //! Sets the function called when each statement completes
+    void SetCompleted(CompletedCallback oncompleted);
+
+    //! Sets a function for running statements this class doesn't know
+    /*!
+     *  A statement it handles completes successfully
+     *  right away, otherwise it is an error.
+     */
+    void SetHandler(HandlerCallback handler);
+
+    //! Sets whether statements are run as soon as they are added (the default)
+    /*!
+     *  If not, they are only run by RunNext(), and \p onready is
+     *  called when a wait statement ends.
+     */
+    void SetAutoRun(bool autorun, ReadyCallback onready = ReadyCallback());
+
+    //! Sets whether a level statement is skipped if the next one sets the same unit
+    /*!
+     *  The skipped statement completes successfully without being sent.
+     *  Off by default.
+     */
+    void SetMergeLevels(bool merge);
+
+    //! Splits a line into statements and adds them to the end of the script
+    void AddLine(const QString & text);
+
+    //! Adds a statement that fails with \p error when it is run
+    /*!
+     *  For a line that couldn't be added, so that its
+     *  error is reported in order with the rest
+     */
+    void AddError(const QString & error);
+
+    //! Adds the statements in \p text, and then ends the input
+    void RunText(const QString & text);
+
+    //! Adds statements from the file descriptor \p fd as they arrive, until it is closed
+    void RunStream(int fd);
+
+    //! Marks the end of the script (see Finished())
+    void EndInput(void);
+
+    //! Drops any statements that haven't been run yet
+    void Clear(void);
+
+    //! Completes every statement that hasn't been run yet with the error \p error
+    void FailWaiting(const QString & error);
+
+    //! Returns true if RunNext() would run a statement
+    bool CanRun(void) const;
+
+    //! Runs the next statement, if there is one and it isn't waiting
+    void RunNext(void);
+
+    //! Returns the number of statements that have been run but haven't completed
+    int GetOutstanding(void) const;
+
+    //! Returns the number of statements that haven't been run yet
+    int GetWaiting(void) const;
+
+    //! Returns the number of statements that failed
+    int GetFailures(void) const;
+
+    //! Converts the interesting parts of a COM_INFO response to lines of text
+    static QStringList FormatInfo(const QByteArray & info);
+
+signals:
+    //! Emitted once the input has ended and every statement has completed
+    void Finished(void);
+
+private slots:
+    //! Reads whatever is available from the stream given to RunStream()
+    void ReadInput(void);
+
+    //! Runs statements if running automatically
+    void RunPending(void);
+
+    //! Completes a wait statement
+    void WaitDone(void);
+
+    //! Emits Finished() if the input has ended and nothing is left to do
+    void CheckFinished(void);
+
+private:
+    //! A statement, and where it came from
+    struct Statement
+    {
+        int line;            //!< Line it came from
+        QString text;        //!< The statement itself
+        int number;          //!< Number of statements added before it
+        QString error;       //!< If not empty, the statement fails with this when run
+    };
+
+    //! A statement that has been run, and what it has returned so far
+    struct Result
+    {
+        Statement st;        //!< The statement
+        bool done;           //!< It has completed
+        QString error;       //!< Empty if it succeeded
+        QStringList output;  //!< Lines not yet passed to the output callback
+    };
+
+    //! Thrown for a statement that doesn't make sense
+    class ScriptError
+    {
+    public:
+        //! Creates an error with a description
+        ScriptError(const QString & desc) : what(desc) { }
+
+        QString what; //!< Description of the problem
+    };
+
+    QSharedPointer<MCInterface> _mc;   //!< The microcontroller the script is run on
+    QList<PUInterface *> _units;       //!< The power units, by id-1
+
+    OutputCallback _onoutput;          //!< See SetOutput()
+    CompletedCallback _oncompleted;    //!< See SetCompleted()
+    HandlerCallback _handler;          //!< See SetHandler()
+    ReadyCallback _onready;            //!< See SetAutoRun()
+    bool _autorun;                     //!< See SetAutoRun()
+    bool _merge;                       //!< See SetMergeLevels()
+
+    QList<Statement> _statements;      //!< Statements waiting to be run
+    QList<Result> _running;            //!< Statements run but not yet reported, in order
+    QByteArray _partial;               //!< A line from the stream that hasn't been finished
+    int _line;                         //!< Number of lines added so far
+    int _count;                        //!< Number of statements added so far
+    int _failures;                     //!< Number of statements that failed
+    bool _ended;                       //!< There won't be any more input
+    bool _finished;                    //!< Finished() has been emitted
+
+    int _fd;                           //!< The stream given to RunStream()
+    QSocketNotifier * _notifier;       //!< Tells us when there is input on _fd
+    QTimer _waittimer;                 //!< Running while a wait statement is in progress
+    Statement _waiting;                //!< The wait statement in progress
+
+    Q_DISABLE_COPY(ScriptRunner)
+
+    //! Runs a single statement
+    /*!
+     *  Statements that are queued complete from their callbacks,
+     *  otherwise they are completed here.
+     *
+     *  \throw ScriptError The statement doesn't make sense
+     *  \throw MCInterfaceException The command couldn't be sent
+     */
+    void RunStatement(const QStringList & words, const Statement & st);
+
+    //! Returns true if a level statement would be replaced by the next statement
+    bool Superseded(const QStringList & words) const;
+
+    //! Returns the power unit with the id given in \p word
+    PUInterface * Unit(const QString & word);
+
+    //! Converts \p word to a number between \p min and \p max
+    static int Number(const QString & word, int min, int max);
+
+    //! Adds a statement that is about to be run to _running
+    void Start(const Statement & st);
+
+    //! Returns the result of a statement that has been run, or NULL
+    Result * Find(const Statement & st);
+
+    //! Adds a line to the output of a statement
+    void Output(const Statement & st, const QString & line);
+
+    //! Marks a statement as completed (\p error is empty on success)
+    void Complete(const Statement & st, const QString & error = QString());
+
+    //! Passes on the output and completions that are no longer held back
+    void Report(void);
+
+    //! Completes a statement whose command failed
+    void Complete(const Statement & st, const MCInterfaceException & ex);
+
+    //! Completes a queued statement
+    PUInterface::DoneCallback OnDone(const Statement & st);
+
+    //! Completes a queued statement whose response has nothing to output
+    MCInterface::ResponseCallback OnResponse(const Statement & st);
+
+    //! Completes a failed queued statement
+    MCInterface::ErrorCallback OnError(const Statement & st);
+};
+
+#endif
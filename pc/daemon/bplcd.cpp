@@ -0,0 +1,107 @@
+/*! \file
+ *  \brief     Daemon that shares the microcontroller between local clients
+ *  \details   Only one program at a time can have the serial port open.
+ *             bplcd keeps it open, and runs commands for any number of
+ *             clients connected to a local socket (or a TCP port on
+ *             localhost), taking turns between them (see LightServer).
+ *             The commands are the same as for bplc:
+ *
+ *             \code
+ *             ./bplcd -s /tmp/bplcd /dev/ttyACM0 &
+ *             echo "level 1 40; on 3" | socat - UNIX-CONNECT:/tmp/bplcd
+ *             \endcode
+ *
+ *             Each statement is answered with "ok" or "error ..." once it
+ *             is done, after any output it has.
+ *  \author    Benjamin Pritchard (ben@bennyp.org)
+ *  \copyright 2013 Benjamin Pritchard. Released under the MIT License
+ */
+
+#include <cstdio>
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QSharedPointer>
+#include <QStringList>
+
+#include "microcont.h"
+#include "microcontexception.h"
+#include "lightserver.h"
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Shares the microcontroller between clients connected to a socket");
+    parser.addHelpOption();
+    parser.addPositionalArgument("port", "Serial port (or path to the emulator's pseudo-terminal)");
+
+    QCommandLineOption socketopt(QStringList() << "s" << "socket",
+                                 "Name or path of the local socket to listen on", "name", "/tmp/bplcd");
+    QCommandLineOption tcpopt(QStringList() << "t" << "tcp",
+                              "Also listen on this TCP port (on localhost only)", "port");
+    QCommandLineOption baudopt(QStringList() << "b" << "baud",
+                               "Highest baud rate to switch to", "rate");
+    QCommandLineOption plainopt(QStringList() << "p" << "plain",
+                                "Don't use CRC-checked command frames");
+    parser.addOption(socketopt);
+    parser.addOption(tcpopt);
+    parser.addOption(baudopt);
+    parser.addOption(plainopt);
+
+    parser.process(app);
+
+    if(parser.positionalArguments().size() != 1)
+        parser.showHelp(1);
+
+    const QString port = parser.positionalArguments()[0];
+
+    QSharedPointer<MCInterface> mc(new MCInterface);
+
+    if(parser.isSet(baudopt))
+    {
+        bool ok;
+        const qint32 baud = parser.value(baudopt).toInt(&ok);
+        if(!ok || baud <= 0)
+        {
+            fprintf(stderr, "Invalid baud rate: %s\n", qPrintable(parser.value(baudopt)));
+            return 1;
+        }
+        mc->SetMaxBaudRate(baud);
+    }
+
+    mc->SetCrcFraming(!parser.isSet(plainopt));
+
+    try {
+        mc->OpenPort(port);
+    }
+    catch(const MCInterfaceException & ex)
+    {
+        fprintf(stderr, "Unable to open %s: %s\n", qPrintable(port), ex.what());
+        return 1;
+    }
+
+    LightServer server(mc);
+
+    if(!server.ListenLocal(parser.value(socketopt)))
+        return 1;
+
+    if(parser.isSet(tcpopt))
+    {
+        bool ok;
+        const int tcpport = parser.value(tcpopt).toInt(&ok);
+        if(!ok || tcpport <= 0 || tcpport > 65535)
+        {
+            fprintf(stderr, "Invalid TCP port: %s\n", qPrintable(parser.value(tcpopt)));
+            return 1;
+        }
+
+        if(!server.ListenTcp(tcpport))
+            return 1;
+    }
+
+    server.StartStatus();
+
+    return app.exec();
+}
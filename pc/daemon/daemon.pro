@@ -0,0 +1,24 @@
+#-------------------------------------------------
+#
+# Daemon that shares the microcontroller between
+# local clients (see bplcd.cpp)
+#
+#-------------------------------------------------
+
+QT       = core network
+
+TARGET = bplcd
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+
+QMAKE_CXXFLAGS += -std=c++11
+
+include(../core/core.pri)
+
+SOURCES += \
+    bplcd.cpp \
+    lightserver.cpp
+
+HEADERS += \
+    lightserver.h
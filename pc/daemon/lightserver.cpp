@@ -0,0 +1,368 @@
+/*! \file
+ *  \brief     Shares one microcontroller between many clients (for bplcd)
+ *  \author    Benjamin Pritchard (ben@bennyp.org)
+ *  \copyright 2013 Benjamin Pritchard. Released under the MIT License
+ */
+
+#include <cstdio>
+
+#include <QMetaObject>
+#include <QHostAddress>
+#include <QLocalSocket>
+#include <QTcpSocket>
+
+#include "lightserver.h"
+#include "microcontexception.h"
+#include "commands.h"
+#include "commands-text.h"
+
+//! Longest line accepted from a client
+#define MAX_LINE 4096
+
+//! Most statements a client may have waiting before no more are read from it
+#define MAX_BACKLOG 256
+
+//! Most bytes waiting to be sent to a client before it is disconnected
+#define MAX_OUTPUT (1024*1024)
+
+LightServer::LightServer(QSharedPointer<MCInterface> mc)
+    : _mc(mc)
+{
+    _next = 0;
+    _scheduling = false;
+    _pushed = false;
+    _polling = false;
+
+    for(int id = 1; id <= PU_COUNT; id++)
+        _units.push_back(new PUInterface((char)id, ConvertPUID(id), _mc));
+
+    connect(&_local, SIGNAL(newConnection()), this, SLOT(NewLocalConnection()));
+    connect(&_tcp, SIGNAL(newConnection()), this, SLOT(NewTcpConnection()));
+
+    // Not from within MCInterface, since running a statement may send a command
+    connect(_mc.data(), SIGNAL(CommandFinished(quint32,QByteArray)), this, SLOT(Schedule()), Qt::QueuedConnection);
+    connect(_mc.data(), SIGNAL(CommandFailed(quint32,QString)), this, SLOT(Schedule()), Qt::QueuedConnection);
+    connect(_mc.data(), SIGNAL(PortClosed()), this, SLOT(PortClosed()), Qt::QueuedConnection);
+
+    _polltimer.setInterval(1000);
+    connect(&_polltimer, SIGNAL(timeout()), this, SLOT(PollStatus()));
+}
+
+LightServer::~LightServer()
+{
+    foreach(Client * c, _clients)
+    {
+        delete c->runner;
+        delete c;
+    }
+
+    qDeleteAll(_units);
+}
+
+bool LightServer::ListenLocal(const QString & name)
+{
+    QLocalServer::removeServer(name);
+
+    if(!_local.listen(name))
+    {
+        fprintf(stderr, "Unable to listen on %s: %s\n", qPrintable(name), qPrintable(_local.errorString()));
+        return false;
+    }
+
+    return true;
+}
+
+bool LightServer::ListenTcp(quint16 port)
+{
+    if(!_tcp.listen(QHostAddress::LocalHost, port))
+    {
+        fprintf(stderr, "Unable to listen on port %u: %s\n", port, qPrintable(_tcp.errorString()));
+        return false;
+    }
+
+    return true;
+}
+
+void LightServer::StartStatus(void)
+{
+    try {
+        _mc->Subscribe(true, 120);
+        _pushed = true;
+        connect(_mc.data(), SIGNAL(StatusPushed(QByteArray)), this, SLOT(SendStatus(QByteArray)));
+    }
+    catch(const MCInterfaceException &)
+    {
+        _pushed = false;
+        _polltimer.start();
+    }
+}
+
+void LightServer::NewLocalConnection(void)
+{
+    while(_local.hasPendingConnections())
+    {
+        // Unread input stays with the kernel (see ReadLines())
+        QLocalSocket * socket = _local.nextPendingConnection();
+        socket->setReadBufferSize(2*MAX_LINE);
+        AddClient(socket);
+    }
+}
+
+void LightServer::NewTcpConnection(void)
+{
+    while(_tcp.hasPendingConnections())
+    {
+        QTcpSocket * socket = _tcp.nextPendingConnection();
+        socket->setReadBufferSize(2*MAX_LINE);
+        AddClient(socket);
+    }
+}
+
+void LightServer::AddClient(QIODevice * socket)
+{
+    Client * c = new Client;
+    c->socket = socket;
+    c->subscribed = false;
+    c->runner = new ScriptRunner(_mc, _units);
+
+    c->runner->SetMergeLevels(true);
+    c->runner->SetAutoRun(false, [this]() { QMetaObject::invokeMethod(this, "Schedule", Qt::QueuedConnection); });
+    c->runner->SetOutput([this, c](const QString & line) { Write(c, line); });
+    c->runner->SetCompleted([this, c](int, const QString &, const QString & error)
+                            {
+                                Write(c, error.isEmpty() ? QString("ok") : QString("error %1").arg(error));
+
+                                if(!c->socket && c->runner->GetOutstanding() == 0)
+                                    QMetaObject::invokeMethod(this, "Reap", Qt::QueuedConnection);
+                            });
+    c->runner->SetHandler([c](const QStringList & words)
+                          {
+                              if(words.size() != 1)
+                                  return false;
+
+                              if(words[0] == "subscribe")
+                                  c->subscribed = true;
+                              else if(words[0] == "unsubscribe")
+                                  c->subscribed = false;
+                              else
+                                  return false;
+
+                              return true;
+                          });
+
+    connect(socket, SIGNAL(readyRead()), this, SLOT(ReadClient()));
+    connect(socket, SIGNAL(disconnected()), this, SLOT(ClientGone()));
+
+    _clients.push_back(c);
+}
+
+LightServer::Client * LightServer::FindClient(QObject * socket)
+{
+    foreach(Client * c, _clients)
+    {
+        if(c->socket == socket)
+            return c;
+    }
+
+    return NULL;
+}
+
+void LightServer::ReadClient(void)
+{
+    Client * c = FindClient(sender());
+    if(!c)
+        return;
+
+    ReadLines(c);
+    Schedule();
+}
+
+void LightServer::ReadLines(Client * c)
+{
+    // Once a client has MAX_BACKLOG statements waiting, the rest of
+    // its input is left unread until Schedule() has run some of them
+    while(c->socket && c->socket->bytesAvailable() > 0 && c->runner->GetWaiting() < MAX_BACKLOG)
+    {
+        c->partial.append(c->socket->read(MAX_LINE));
+
+        int end;
+        while((end = c->partial.indexOf('\n')) >= 0)
+        {
+            c->runner->AddLine(QString::fromUtf8(c->partial.left(end)));
+            c->partial.remove(0, end+1);
+        }
+
+        if(c->partial.size() > MAX_LINE)
+        {
+            c->runner->AddError("Line too long");
+            c->partial.clear();
+        }
+    }
+}
+
+void LightServer::ClientGone(void)
+{
+    Client * c = FindClient(sender());
+    if(!c)
+        return;
+
+    Forget(c);
+}
+
+void LightServer::Forget(Client * c)
+{
+    // Whatever has already been sent still completes (see Reap())
+    c->runner->Clear();
+    c->socket->deleteLater();
+    c->socket = NULL;
+    c->subscribed = false;
+
+    QMetaObject::invokeMethod(this, "Reap", Qt::QueuedConnection);
+}
+
+void LightServer::Drop(Client * c)
+{
+    QIODevice * socket = c->socket;
+
+    fprintf(stderr, "Disconnecting a client that isn't reading its output\n");
+
+    socket->disconnect(this);
+    Forget(c);
+
+    if(QAbstractSocket * s = qobject_cast<QAbstractSocket *>(socket))
+        s->abort();
+    else if(QLocalSocket * s = qobject_cast<QLocalSocket *>(socket))
+        s->abort();
+}
+
+void LightServer::PortClosed(void)
+{
+    fprintf(stderr, "The serial port has been closed\n");
+    Schedule();
+}
+
+void LightServer::Schedule(void)
+{
+    // Running a statement may wait for a response, which
+    // finishes other commands
+    if(_scheduling)
+        return;
+
+    _scheduling = true;
+
+    // Nothing can be run any more, so don't leave the clients waiting
+    if(!_mc->IsOpen())
+    {
+        foreach(Client * c, _clients)
+        {
+            do {
+                ReadLines(c);
+                c->runner->FailWaiting("Port not open");
+            } while(c->socket && c->socket->bytesAvailable() > 0);
+        }
+
+        _scheduling = false;
+        return;
+    }
+
+    // Go around the clients until nobody has anything to run
+    int idle = 0;
+    while(_mc->PendingCommands() < MAX_PENDING && idle < _clients.size())
+    {
+        if(_next >= _clients.size())
+            _next = 0;
+
+        Client * c = _clients[_next++];
+        ScriptRunner * runner = c->runner;
+
+        // Input left unread because of the backlog
+        if(runner->GetWaiting() < MAX_BACKLOG)
+            ReadLines(c);
+
+        if(runner->CanRun())
+        {
+            runner->RunNext();
+            idle = 0;
+        }
+        else
+            idle++;
+    }
+
+    _scheduling = false;
+}
+
+void LightServer::Reap(void)
+{
+    for(int i = 0; i < _clients.size(); )
+    {
+        Client * c = _clients[i];
+
+        if(!c->socket && c->runner->GetOutstanding() == 0)
+        {
+            _clients.removeAt(i);
+            delete c->runner;
+            delete c;
+
+            if(_next > i)
+                _next--;
+        }
+        else
+            i++;
+    }
+}
+
+void LightServer::SendStatus(const QByteArray & info)
+{
+    const QStringList lines = ScriptRunner::FormatInfo(info);
+
+    foreach(Client * c, _clients)
+    {
+        if(!c->subscribed)
+            continue;
+
+        foreach(const QString & line, lines)
+            Write(c, "status " + line);
+    }
+}
+
+void LightServer::PollStatus(void)
+{
+    if(_polling || !_mc->IsOpen())
+        return;
+
+    bool anyone = false;
+    foreach(Client * c, _clients)
+        anyone = anyone || c->subscribed;
+
+    if(!anyone)
+        return;
+
+    try {
+        _polling = true;
+        _mc->QueueRetrieveInfo([this](const QByteArray & info)
+                               {
+                                   _polling = false;
+                                   SendStatus(info);
+                               },
+                               [this](const MCInterfaceException &) { _polling = false; });
+    }
+    catch(const MCInterfaceException &)
+    {
+        _polling = false;
+    }
+}
+
+void LightServer::Write(Client * c, const QString & line)
+{
+    if(!c->socket)
+        return;
+
+    // Rather than keeping everything for a client that never reads it
+    if(c->socket->bytesToWrite() > MAX_OUTPUT)
+    {
+        Drop(c);
+        return;
+    }
+
+    c->socket->write((line + "\n").toUtf8());
+}
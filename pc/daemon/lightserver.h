@@ -0,0 +1,155 @@
+/*! \file
+ *  \brief     Shares one microcontroller between many clients (for bplcd)
+ *  \author    Benjamin Pritchard (ben@bennyp.org)
+ *  \copyright 2013 Benjamin Pritchard. Released under the MIT License
+ */
+
+#ifndef LIGHTSERVER_H
+#define LIGHTSERVER_H
+
+#include <QObject>
+#include <QList>
+#include <QByteArray>
+#include <QIODevice>
+#include <QSharedPointer>
+#include <QTimer>
+#include <QLocalServer>
+#include <QTcpServer>
+
+#include "microcont.h"
+#include "powerunit.h"
+#include "scriptrunner.h"
+
+//! Owns the link to a microcontroller and runs commands for clients connected to a socket
+/*!
+ *  Clients connect to a local (Unix-domain) socket, or to a TCP
+ *  port on localhost, and send statements as for bplc, one or
+ *  more per line (see ScriptRunner). Each statement gets a reply
+ *  once it is done, in the order they were sent: any output, then
+ *  "ok" or "error <description>".
+ *
+ *  Each client's statements wait in its own ScriptRunner. Whenever there is
+ *  room in the queue of the MCInterface (see MAX_PENDING), the clients
+ *  take turns running one statement each, so a client sending a lot of
+ *  commands can't hold up the others. A level statement that would be
+ *  replaced right away by the same client's next one is skipped (see
+ *  ScriptRunner::SetMergeLevels()).
+ *
+ *  A client with too many statements waiting isn't read from until
+ *  some have run, and one that doesn't read its replies is disconnected.
+ *  If the serial port is closed (ie, the device is unplugged), every
+ *  statement fails with "error".
+ *
+ *  Two more statements are handled here: "subscribe" and "unsubscribe".
+ *  A subscribed client is sent the state (as for the info statement,
+ *  with each line starting with "status ") whenever it changes, and about
+ *  once a second otherwise. The microcontroller is only asked once
+ *  for all of the clients.
+ */
+class LightServer : public QObject
+{
+    Q_OBJECT
+
+public:
+    //! Most commands the clients may have waiting in the MCInterface at once
+    static const int MAX_PENDING = 4;
+
+    //! Creates a server for an open microcontroller
+    LightServer(QSharedPointer<MCInterface> mc);
+
+    ~LightServer();
+
+    //! Starts listening on a local socket
+    /*!
+     *  Any stale socket with the same name is removed first.
+     *  Returns false (after printing why) if it couldn't.
+     */
+    bool ListenLocal(const QString & name);
+
+    //! Starts listening on a TCP port on localhost
+    /*!
+     *  Returns false (after printing why) if it couldn't
+     */
+    bool ListenTcp(quint16 port);
+
+    //! Starts getting status frames from the microcontroller for subscribed clients
+    /*!
+     *  If it can't push them, the info is polled once a
+     *  second instead, while any client is subscribed.
+     */
+    void StartStatus(void);
+
+private slots:
+    //! Accepts a client on the local socket
+    void NewLocalConnection(void);
+
+    //! Accepts a client on the TCP port
+    void NewTcpConnection(void);
+
+    //! Reads lines from a client
+    void ReadClient(void);
+
+    //! Called when a client has disconnected
+    void ClientGone(void);
+
+    //! Runs statements from the clients in turn, while there is room in the queue
+    void Schedule(void);
+
+    //! Deletes clients that have disconnected, once their statements are done
+    void Reap(void);
+
+    //! Sends the state to the subscribed clients
+    void SendStatus(const QByteArray & info);
+
+    //! Called when the serial port has been closed because of an error
+    void PortClosed(void);
+
+    //! Asks for the state, if it isn't pushed by the microcontroller
+    void PollStatus(void);
+
+private:
+    //! A connected client
+    struct Client
+    {
+        QIODevice * socket;         //!< The connection (NULL once it is gone)
+        ScriptRunner * runner;      //!< Statements from this client
+        QByteArray partial;         //!< A line that hasn't been finished
+        bool subscribed;            //!< Send this client status lines
+    };
+
+    QSharedPointer<MCInterface> _mc;   //!< The microcontroller shared by the clients
+    QList<PUInterface *> _units;       //!< The power units, shared by the clients
+
+    QLocalServer _local;               //!< See ListenLocal()
+    QTcpServer _tcp;                   //!< See ListenTcp()
+
+    QList<Client *> _clients;          //!< Everyone connected (and disconnected ones still running)
+    int _next;                         //!< Index of the client whose turn it is in Schedule()
+    bool _scheduling;                  //!< Schedule() is running
+
+    bool _pushed;                      //!< The microcontroller pushes status frames
+    bool _polling;                     //!< PollStatus() is waiting for the info
+    QTimer _polltimer;                 //!< Calls PollStatus() if status frames aren't pushed
+
+    Q_DISABLE_COPY(LightServer)
+
+    //! Sets up a newly connected client
+    void AddClient(QIODevice * socket);
+
+    //! Finds the client with a given connection
+    Client * FindClient(QObject * socket);
+
+    //! Adds the statements a client has sent, up to the backlog limit
+    void ReadLines(Client * c);
+
+    //! Lets go of a client's connection, once it has disconnected
+    void Forget(Client * c);
+
+    //! Disconnects a client that isn't reading what it is sent
+    void Drop(Client * c);
+
+    //! Sends a line to a client (if it is still connected)
+    void Write(Client * c, const QString & line);
+};
+
+#endif
@@ -0,0 +1,28 @@
+#-------------------------------------------------
+#
+# Project created by QtCreator 2013-05-30T22:15:31
+#
+#-------------------------------------------------
+
+QT       += core gui serialport
+
+greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
+
+TARGET = BPLightContraption
+TEMPLATE = app
+
+QMAKE_CXXFLAGS += -std=c++11
+
+include(../core/core.pri)
+
+SOURCES += \
+    triaclight.cpp \
+    powerunit_gui.cpp \
+    main.cpp
+
+HEADERS  += \
+    triaclight.h \
+    powerunit_gui.h
+
+FORMS    += \
+    triaclight.ui
@@ -8,6 +8,7 @@
 #include "commands-text.h"
 
 #include <QObject>
+#include <QMessageBox>
 #include <QTextStream>
 #include <QSharedPointer>
 
@@ -18,6 +19,9 @@ PUInterfaceGUI::PUInterfaceGUI(quint8 id, const QString & desc, QSharedPointer<M
     _onbutton = _offbutton = NULL;
     _levelslider = NULL;
     _parent = parent;
+
+    // Dragging the slider shouldn't flood the microcontroller
+    SetMaxUpdateRate(25);
 }
 
 PUInterfaceGUI::~PUInterfaceGUI()
@@ -44,43 +48,45 @@ void PUInterfaceGUI::AttachToGui(QLabel * label, QPushButton * onbutton, QPushBu
 void PUInterfaceGUI::TurnOn(void)
 {
     try {
-        PUInterface::TurnOn();
+        QueueTurnOn([this]() { SyncGUI(); },
+                    [this](const MCInterfaceException & ex) { CommandError(ex); });
     }
     catch (const MCInterfaceException & ex)
     {
-        ExceptionBox(ex);
+        CommandError(ex);
     }
-
-    SyncGUI();
 }
 
 void PUInterfaceGUI::TurnOff(void)
 {
     try {
-        PUInterface::TurnOff();
+        QueueTurnOff([this]() { SyncGUI(); },
+                     [this](const MCInterfaceException & ex) { CommandError(ex); });
     }
     catch (const MCInterfaceException & ex)
     {
-        ExceptionBox(ex);
+        CommandError(ex);
     }
-
-    SyncGUI();
 }
 
 void PUInterfaceGUI::LevelSliderChange(int val)
 {
     try {
-        SetLevel(val);
+        RequestLevel(val, [this]() { SyncGUI(); },
+                          [this](const MCInterfaceException & ex) { CommandError(ex); });
     }
     catch (const MCInterfaceException & ex)
     {
-        // revert the slider to the old value
-        // which should still be in _level
-        // This would cause it to emit a changed signal
-        //_levelslider->setValue(GetLevel());
-        ExceptionBox(ex);
+        CommandError(ex);
     }
+}
 
+void PUInterfaceGUI::CommandError(const MCInterfaceException & ex)
+{
+    ExceptionBox(ex);
+
+    // puts the slider back to the last level that was
+    // actually set
     SyncGUI();
 }
 
@@ -94,7 +100,15 @@ void PUInterfaceGUI::SyncGUI(void)
 
     _label->setText(label);
 
-    _levelslider->setValue(GetLevel());
+    // Don't fight the user while the slider is being dragged, and
+    // don't send the level back to the microcontroller
+    if(!_levelslider->isSliderDown())
+    {
+        bool blocked = _levelslider->blockSignals(true);
+        _levelslider->setValue(GetRequestedLevel());
+        _levelslider->blockSignals(blocked);
+    }
+
     _levelslider->setEnabled(MCIsOpen());
     _onbutton->setEnabled(MCIsOpen());
     _offbutton->setEnabled(MCIsOpen());
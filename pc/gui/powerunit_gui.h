@@ -10,7 +10,6 @@
 #include <QLabel>
 #include <QSlider>
 #include <QPushButton>
-#include <QMessageBox>
 #include <QSharedPointer>
 
 #include "powerunit.h"
@@ -33,26 +32,32 @@ private:
     //! Displays a message box with exception information
     void ExceptionBox(const MCInterfaceException & e);
 
+    //! Called when a queued command for this power unit fails
+    /*!
+     *  Displays the exception and resynchronizes the GUI elements
+     */
+    void CommandError(const MCInterfaceException & e);
+
 private slots:
     //! Called when the dimmer level slider is changed
     /*!
+     *  The level is sent through PUInterface::RequestLevel(), so while the slider
+     *  is being dragged only the latest level is sent. The GUI is updated once the
+     *  microcontroller responds. Errors are displayed in a message box.
+     *
      *  \param[in] val The new level
-     *  \throw MCInterfaceException There is a problem communicating this command
-     *         to the microcontroller
      */
     void LevelSliderChange(int val);
 
     //! Called when an event should turn the power unit on
     /*!
-     *  \throw MCInterfaceException There is a problem communicating this command
-     *         to the microcontroller
+     *  The command is queued, see LevelSliderChange()
      */
     void TurnOn(void);
 
-    //! Called when an event should turn the power unit on
+    //! Called when an event should turn the power unit off
     /*!
-     *  \throw MCInterfaceException There is a problem communicating this command
-     *         to the microcontroller
+     *  The command is queued, see LevelSliderChange()
      */
     void TurnOff(void);
 
@@ -0,0 +1,477 @@
+/*! \file
+ *  \brief     Main Qt GUI class
+ *  \author    Benjamin Pritchard (ben@bennyp.org)
+ *  \copyright 2013 Benjamin Pritchard. Released under the MIT License
+ */
+
+#include "triaclight.h"
+#include "commands-text.h"
+#include "microcont.h"
+#include "ui_triaclight.h"
+
+#include <cmath>
+
+#include <QMessageBox>
+#include <QString>
+#include <QTextStream>
+#include <QDebug>
+#include <QTimer>
+#include <QStandardItemModel>
+
+#include <QtSerialPort/QSerialPort>
+#include <QtSerialPort/QSerialPortInfo>
+//QT_USE_NAMESPACE_SERIALPORT
+
+
+BPLightContraption::BPLightContraption(QWidget *parent) :
+    QMainWindow(parent),ui(new Ui::BPLightContraption),mc(new MCInterface)
+{
+    ui->setupUi(this);
+
+    int count = 0;
+    foreach (const QSerialPortInfo &info, QSerialPortInfo::availablePorts())
+    {
+        ui->serialPortCombo->addItem(info.portName());
+        QString tooltip("Manufacturer: ");
+        if(info.manufacturer() != "")
+            tooltip.append(info.manufacturer());
+        else
+            tooltip.append("None");
+
+        tooltip.append("\nDescription: ");
+
+        if(info.description() != "")
+            tooltip.append(info.description());
+        else
+            tooltip.append("None");
+        ui->serialPortCombo->setItemData(count++, tooltip, Qt::ToolTipRole);
+    }
+
+    // Ports that aren't listed (ie, the emulator's
+    // pseudo-terminal) can be typed in as a path
+    ui->serialPortCombo->setEditable(true);
+
+
+    pus.push_back(QSharedPointer<PUInterfaceGUI>(new PUInterfaceGUI(PU_LIGHT1, ConvertPUID(PU_LIGHT1), mc, this)));
+    pus.push_back(QSharedPointer<PUInterfaceGUI>(new PUInterfaceGUI(PU_LIGHT2, ConvertPUID(PU_LIGHT2), mc, this)));
+    pus.push_back(QSharedPointer<PUInterfaceGUI>(new PUInterfaceGUI(PU_RECEPTACLE, ConvertPUID(PU_RECEPTACLE), mc, this)));
+
+    pus[0]->AttachToGui(ui->l1label, ui->buttonl1_on, ui->buttonl1_off, ui->l1levelslider);
+    pus[1]->AttachToGui(ui->l2label, ui->buttonl2_on, ui->buttonl2_off, ui->l2levelslider);
+    pus[2]->AttachToGui(ui->relabel, ui->buttonre_on, ui->buttonre_off, ui->relevelslider);
+
+    connect(ui->serialPortOpenButton, SIGNAL(clicked()), this, SLOT(OpenPort()));
+    connect(ui->serialPortCloseButton, SIGNAL(clicked()), this, SLOT(ClosePort()));
+    connect(ui->serialPortReset, SIGNAL(clicked()), this, SLOT(ResetPort()));
+
+    connect(ui->updateButton, SIGNAL(clicked()), this, SLOT(UpdateInfo()));
+    ui->updateButton->setEnabled(false);
+
+    connect(ui->actionExit, SIGNAL(triggered()), this, SLOT(close()));
+
+    subscribed = false;
+    connect(mc.data(), SIGNAL(StatusPushed(QByteArray)), this, SLOT(DisplayInfo(QByteArray)));
+
+
+    dimmerData = new QStandardItemModel(DIMMER_COUNT,4,this);
+    dimmerData->setHorizontalHeaderItem(0, new QStandardItem(QString("Power Unit")));
+    dimmerData->setHorizontalHeaderItem(1, new QStandardItem(QString("Level")));
+    dimmerData->setHorizontalHeaderItem(2, new QStandardItem(QString("Compare Val")));
+    dimmerData->setHorizontalHeaderItem(3, new QStandardItem(QString("Fade")));
+
+    ui->dimmerTable->setModel(dimmerData);
+
+    for(int i = 0; i < DIMMER_COUNT; i++)
+    {
+        ui->dimmerTable->setRowHeight(i,20);
+        for(int j = 0; j < 4; j++)
+            dimmerData->setItem(i,j, new QStandardItem());
+    }
+
+
+    // The diagnostics panel, refreshed once a second while it is shown
+    ui->menuView->addAction(ui->diagDock->toggleViewAction());
+    connect(ui->diagResetButton, SIGNAL(clicked()), this, SLOT(ResetDiagnostics()));
+
+    diagData = new QStandardItemModel(0,9,this);
+    diagData->setHorizontalHeaderItem(0, new QStandardItem(QString("Command")));
+    diagData->setHorizontalHeaderItem(1, new QStandardItem(QString("Responses")));
+    diagData->setHorizontalHeaderItem(2, new QStandardItem(QString("Errors")));
+    diagData->setHorizontalHeaderItem(3, new QStandardItem(QString("Timeouts")));
+    diagData->setHorizontalHeaderItem(4, new QStandardItem(QString("Retries")));
+    diagData->setHorizontalHeaderItem(5, new QStandardItem(QString("Mean")));
+    diagData->setHorizontalHeaderItem(6, new QStandardItem(QString("Median")));
+    diagData->setHorizontalHeaderItem(7, new QStandardItem(QString("99%")));
+    diagData->setHorizontalHeaderItem(8, new QStandardItem(QString("Max")));
+
+    ui->diagTable->setModel(diagData);
+
+    statspending = false;
+    mainspending = false;
+    lastmains = MCInterface::MainsStats();
+
+    diagtimer = new QTimer();
+    connect(diagtimer, SIGNAL(timeout()), this, SLOT(UpdateDiagnostics()));
+    diagtimer->start(1000);
+
+
+    ZeroDisplays();
+
+    ui->statusBar->showMessage("Disconnected");
+
+    // Start a timer
+    updatetimer = new QTimer();
+    connect(updatetimer, SIGNAL(timeout()), this, SLOT(UpdateInfo()));
+}
+
+BPLightContraption::~BPLightContraption()
+{
+    try {
+    ClosePort();
+    delete dimmerData;
+    delete diagData;
+    delete ui;
+    delete updatetimer;
+    delete diagtimer;
+    }
+    catch(...)
+    {
+        //eat exceptions
+    }
+}
+
+void BPLightContraption::OpenPort(void)
+{
+    try {
+        QString port = ui->serialPortCombo->currentText();
+        ui->statusBar->showMessage(QString("Connecting to %1").arg(port));
+
+        mc->OpenPort(port);
+
+        ui->statusBar->showMessage(QString("Connected to %1").arg(port));
+        ui->updateButton->setEnabled(true);
+
+        for_each(pus.begin(), pus.end(), [](QSharedPointer<PUInterfaceGUI> & spu) { spu->SyncGUI(); });
+
+        // Have the microcontroller tell us when something changes, with
+        // a heartbeat about once a second for the frequency displays.
+        // If it doesn't know how, poll instead
+        try {
+            mc->Subscribe(true, 120);
+            subscribed = true;
+        }
+        catch(const MCInterfaceException &)
+        {
+            subscribed = false;
+            UpdateInfo();
+            updatetimer->start(1000);
+        }
+    }
+    catch(const MCInterfaceException & ex)
+    {
+        ExceptionBox(ex);
+        ui->statusBar->showMessage("Disconnected");
+    }
+}
+
+void BPLightContraption::ZeroDisplays(void)
+{
+    ui->freqrawRisingDisplay->display(0);
+    ui->freqrawFallingDisplay->display(0);
+    ui->freqrawAvgDisplay->display(0);
+
+    ui->freqRisingDisplay->display(0);
+    ui->freqFallingDisplay->display(0);
+    ui->freqAvgDisplay->display(0);
+
+    for(int i = 0; i < DIMMER_COUNT; i++)
+    {
+        for(int j = 0; j < 4; j++)
+            dimmerData->item(i,j)->setText("");
+    }
+}
+
+void BPLightContraption::ClosePort(void)
+{
+    mc->ClosePort();
+
+    ui->updateButton->setEnabled(false);
+    ui->statusBar->showMessage("Disconnected");
+
+    ZeroDisplays();
+    lastmains = MCInterface::MainsStats();
+
+    for_each(pus.begin(), pus.end(), [](QSharedPointer<PUInterfaceGUI> & spu) { spu->Reset(); });
+
+    updatetimer->stop();
+    subscribed = false;
+
+    // Closing discards the requests without calling back
+    statspending = false;
+    mainspending = false;
+}
+
+void BPLightContraption::ResetPort(void)
+{
+    if(mc->IsOpen())
+    {
+        ClosePort();
+        OpenPort();
+    }
+}
+
+double BPLightContraption::Convert16BitValue(quint8 low, quint8 high)
+{
+    return low + (high << 8);
+}
+
+double BPLightContraption::Display16BitValue(QLCDNumber * display, quint8 low, quint8 high)
+{
+    double v = Convert16BitValue(low, high);
+    display->display(v);
+    return v;
+}
+
+void BPLightContraption::UpdateInfo(void)
+{
+    try {
+
+    // stop the timer to prevent backups
+    updatetimer->stop();
+
+    if(!mc->IsOpen())
+        return;
+
+    mc->QueueRetrieveInfo([this](const QByteArray & info)
+                          {
+                              DisplayInfo(info);
+
+                              //restart the timer
+                              if(!subscribed)
+                                  updatetimer->start(1000);
+                          },
+                          [this](const MCInterfaceException & ex) { ExceptionBox(ex); });
+
+    }
+    catch (const MCInterfaceException & ex)
+    {
+        ExceptionBox(ex);
+    }
+}
+
+void BPLightContraption::DisplayInfo(const QByteArray & info)
+{
+    //qDebug() << "Byte Array:\n";
+    //for_each(info.begin(), info.end(), [](quint8 v) { qDebug() << v << "\n";});
+    //qDebug() << "\n";
+
+    double fallingfreq = Display16BitValue(ui->freqrawFallingDisplay, info[0], info[1]);
+    double risingfreq = Display16BitValue(ui->freqrawRisingDisplay, info[2], info[3]);
+    double averagefreq = (fallingfreq + risingfreq)/2.0;
+    ui->freqrawAvgDisplay->display(averagefreq);
+
+    fallingfreq =  MICROCONTROLLER_FCPU/(fallingfreq*16.0);
+    risingfreq  =  MICROCONTROLLER_FCPU/(risingfreq*16.0);
+    averagefreq = MICROCONTROLLER_FCPU/(averagefreq*16.0);
+    ui->freqFallingDisplay->display(fallingfreq);
+    ui->freqRisingDisplay->display(risingfreq);
+    ui->freqAvgDisplay->display(averagefreq);
+
+    int off = INFO_ZC_SIZE;
+    int puoff = INFO_ZC_SIZE+INFO_DIMMER_SIZE*DIMMER_COUNT;
+
+    for(int i = 0; i < DIMMER_COUNT; i++)
+    {
+        if((qint8)info[off+INFO_DIMMER_SIZE*i] == 0u)
+        {
+            dimmerData->item(i,0)->setText("None");
+            dimmerData->item(i,1)->setText("-");
+            dimmerData->item(i,2)->setText("-");
+            dimmerData->item(i,3)->setText("-");
+        }
+        else
+        {
+            dimmerData->item(i,0)->setText(ConvertPUID(info[off+INFO_DIMMER_SIZE*i]));
+            dimmerData->item(i,1)->setText(QString("%1%").arg(quint16(info[off+1+INFO_DIMMER_SIZE*i])));
+            dimmerData->item(i,2)->setText(QString("%1").arg(Convert16BitValue(info[off+2+INFO_DIMMER_SIZE*i],info[off+3+INFO_DIMMER_SIZE*i])));
+
+            // Fade progress is in the power unit's field
+            dimmerData->item(i,3)->setText("-");
+            for(int j = 0; j < PU_COUNT; j++)
+            {
+                int pu = puoff+INFO_PU_SIZE*j;
+                quint16 remaining = (quint16)Convert16BitValue(info[pu+4], info[pu+5]);
+                if(info[pu] == info[off+INFO_DIMMER_SIZE*i] && remaining > 0)
+                    dimmerData->item(i,3)->setText(QString("To %1% (%2)").arg(quint16(quint8(info[pu+3]))).arg(remaining));
+            }
+        }
+    }
+
+
+    off = puoff;
+    //  Now the power units
+    /*for(int i = 0; i < PU_COUNT; i++)
+    {
+        // ignore the id at off+INFO_PU_SIZE*i
+        pus[i]->SyncState(info[off+1+INFO_PU_SIZE*i], info[off+2+INFO_PU_SIZE*i]);
+    }*/
+
+    // The average from a single pair of stamps is noisy, so
+    // use the microcontroller's running mean if it has one
+    UpdateMains(false);
+}
+
+void BPLightContraption::UpdateMains(bool reset)
+{
+    if(!mc->IsOpen() || !mc->HasFeature(FEAT_MAINS))
+        return;
+
+    if(mainspending && !reset)
+        return;
+
+    try {
+        mainspending = true;
+        mc->QueueRetrieveMains(reset,
+                               [this](const QByteArray & res)
+                               {
+                                   mainspending = false;
+                                   lastmains = MCInterface::ParseMains(res);
+
+                                   if(lastmains.count > 0 && lastmains.mean > 0)
+                                   {
+                                       ui->freqrawAvgDisplay->display(lastmains.mean / 2.0);
+                                       ui->freqAvgDisplay->display(MICROCONTROLLER_ZCTIMER_HZ / lastmains.mean);
+                                   }
+                               },
+                               [this](const MCInterfaceException &) { mainspending = false; });
+    }
+    catch(const MCInterfaceException &)
+    {
+        mainspending = false;
+    }
+}
+
+void BPLightContraption::UpdateDiagnostics(void)
+{
+    if(!ui->diagDock->isVisible())
+        return;
+
+    const MCInterface::LinkStats stats = mc->GetLinkStats();
+    const double seconds = qMax(stats.elapsedms, qint64(1)) / 1000.0;
+
+    ui->diagCounters->setText(QString("Sent: %1 bytes (%2/s)   Received: %3 bytes (%4/s)   Status frames: %5\n"
+                                      "Timeouts: %6   uC errors: %7   Bad CRCs: %8   Dropped bytes: %9   Partial reads: %10 of %11")
+                              .arg(stats.bytessent).arg(stats.bytessent / seconds, 0, 'f', 0)
+                              .arg(stats.bytesreceived).arg(stats.bytesreceived / seconds, 0, 'f', 0)
+                              .arg(stats.statusframes)
+                              .arg(stats.timeouts).arg(stats.mcerrors).arg(stats.crcerrors)
+                              .arg(stats.droppedbytes).arg(stats.partialreads).arg(stats.reads));
+
+    diagData->setRowCount(0);
+
+    for(int i = 0; i < MCInterface::STATS_COMMANDS; i++)
+    {
+        const MCInterface::CommandStats & cs = stats.commands[i];
+        if(cs.responses == 0 && cs.timeouts == 0)
+            continue;
+
+        QList<QStandardItem *> row;
+        row << new QStandardItem(QString(ConvertCommandID(i)))
+            << new QStandardItem(QString::number(cs.responses))
+            << new QStandardItem(QString::number(cs.mcerrors))
+            << new QStandardItem(QString::number(cs.timeouts))
+            << new QStandardItem(QString::number(cs.retries))
+            << new QStandardItem(cs.responses ? FormatLatency(cs.totalus / cs.responses) : QString("-"))
+            << new QStandardItem(cs.responses ? FormatLatency(MCInterface::LatencyPercentile(cs, 50), true) : QString("-"))
+            << new QStandardItem(cs.responses ? FormatLatency(MCInterface::LatencyPercentile(cs, 99), true) : QString("-"))
+            << new QStandardItem(cs.responses ? FormatLatency(cs.maxus) : QString("-"));
+
+        diagData->appendRow(row);
+    }
+
+    UpdateMCStats(false);
+
+    if(lastmains.count > 0 && lastmains.min > 0)
+        ui->diagMains->setText(QString("Mains: %1 Hz (%2 to %3 Hz)   Jitter: %4 us   Cycles: %5")
+                               .arg(MICROCONTROLLER_ZCTIMER_HZ / lastmains.mean, 0, 'f', 3)
+                               .arg(double(MICROCONTROLLER_ZCTIMER_HZ) / lastmains.max, 0, 'f', 3)
+                               .arg(double(MICROCONTROLLER_ZCTIMER_HZ) / lastmains.min, 0, 'f', 3)
+                               .arg(std::sqrt(lastmains.variance) * 1e6 / MICROCONTROLLER_ZCTIMER_HZ, 0, 'f', 1)
+                               .arg(lastmains.count));
+    else
+        ui->diagMains->setText("");
+}
+
+void BPLightContraption::ResetDiagnostics(void)
+{
+    mc->ResetLinkStats();
+    UpdateMCStats(true);
+    UpdateMains(true);
+    UpdateDiagnostics();
+}
+
+void BPLightContraption::UpdateMCStats(bool reset)
+{
+    if(!mc->IsOpen() || !mc->HasFeature(FEAT_STATS))
+    {
+        ui->diagMCCounters->setText("");
+        return;
+    }
+
+    // Don't pile up requests if the link is slow (a reset is
+    // sent anyway, so the counters really are cleared)
+    if(statspending && !reset)
+        return;
+
+    try {
+        statspending = true;
+        mc->QueueRetrieveStats(reset,
+                               [this](const QByteArray & res)
+                               {
+                                   statspending = false;
+
+                                   const MCInterface::MCStats stats = MCInterface::ParseStats(res);
+                                   ui->diagMCCounters->setText(
+                                       QString("uC: RX overflows: %1   Overruns: %2   Framing errors: %3   "
+                                               "Buffer high: %4/%5   Missed zero crossings: %6\n"
+                                               "Longest loop: %7 us   Longest interrupts (us): "
+                                               "zero cross %8, compare %9, top %10, RX %11")
+                                       .arg(stats.rxoverflows).arg(stats.overruns).arg(stats.frameerrors)
+                                       .arg(stats.bufferhigh).arg(CMDBUF_SIZE)
+                                       .arg(stats.missedzerocrossings)
+                                       .arg(stats.loopmax / (MICROCONTROLLER_FCPU / 1000000.0), 0, 'f', 1)
+                                       .arg(stats.isrmax[STATS_ISR_ZEROCROSS] / (MICROCONTROLLER_FCPU / 1000000.0), 0, 'f', 1)
+                                       .arg(stats.isrmax[STATS_ISR_COMPARE] / (MICROCONTROLLER_FCPU / 1000000.0), 0, 'f', 1)
+                                       .arg(stats.isrmax[STATS_ISR_TOP] / (MICROCONTROLLER_FCPU / 1000000.0), 0, 'f', 1)
+                                       .arg(stats.isrmax[STATS_ISR_RX] / (MICROCONTROLLER_FCPU / 1000000.0), 0, 'f', 1));
+                               },
+                               [this](const MCInterfaceException &) { statspending = false; });
+    }
+    catch(const MCInterfaceException &)
+    {
+        statspending = false;
+    }
+}
+
+QString BPLightContraption::FormatLatency(qint64 us, bool limit)
+{
+    // Longer than the last histogram bucket with a limit
+    if(us < 0)
+        return QString("> %1 ms").arg(MCInterface::LatencyBucketLimit(MCInterface::LATENCY_BUCKETS-2) / 1000.0);
+
+    return QString(limit ? "< %1 ms" : "%1 ms").arg(us / 1000.0, 0, 'f', 2);
+}
+
+void BPLightContraption::ExceptionBox(const MCInterfaceException & e)
+{
+    QString errstr;
+    QTextStream err(&errstr);
+    err << e.what() << "\n";
+    err << "\nuC Error: " << e.GetMCError() << " (" << ConvertMCError(e.GetMCError()) << ")";
+    err << "\nuC Error Cmd: " << e.GetMCErrorCMD();
+    err << "\nuC Error ID: " << e.GetMCErrorID();
+    err << "\nSP Error: " << e.GetSPError() << " (" << e.GetSPErrorText() << ")";
+
+    QMessageBox::information(this, "BPLightContraption Error", errstr);
+}
+
@@ -0,0 +1,133 @@
+/*! \file
+ *  \brief     Main Qt GUI class
+ *  \author    Benjamin Pritchard (ben@bennyp.org)
+ *  \copyright 2013 Benjamin Pritchard. Released under the MIT License
+ */
+
+#ifndef TRIACLIGHT_H
+#define TRIACLIGHT_H
+
+#include <QMainWindow>
+#include <QVector>
+#include <QLCDNumber>
+#include <QTimer>
+#include <QStandardItemModel>
+
+#include "microcont.h"
+#include "microcontexception.h"
+#include "powerunit_gui.h"
+
+namespace Ui {
+class BPLightContraption;
+}
+
+//! The main window of the BPLightContraption program
+class BPLightContraption : public QMainWindow
+{
+    Q_OBJECT
+    
+public:
+    explicit BPLightContraption(QWidget *parent = 0);
+    ~BPLightContraption();
+
+    //! Displays a message box with exception information
+    void ExceptionBox(const MCInterfaceException & e);
+
+private slots:
+    //! Called when the button to open the port is clicked
+    void OpenPort(void);
+
+    //! Called when the button to close the port is clicked
+    void ClosePort(void);
+
+    //! Called when the button to reset the port is clicked
+    void ResetPort(void);
+
+    //! Called when the button to force an update is pressed
+    void UpdateInfo(void);
+
+    //! Displays the information returned from MCInterface::RetrieveInfo()
+    /*!
+     *  Also called with status frames pushed by the microcontroller
+     */
+    void DisplayInfo(const QByteArray & info);
+
+    //! Displays the statistics about the link (MCInterface::GetLinkStats())
+    /*!
+     *  Only updates anything while the diagnostics panel is shown
+     */
+    void UpdateDiagnostics(void);
+
+    //! Called when the button to reset the link statistics is clicked
+    void ResetDiagnostics(void);
+    
+private:
+    Ui::BPLightContraption *ui;
+
+    //! Used to refresh the information at certain intervals
+    /*!
+     *  Only used if the microcontroller doesn't push status frames
+     */
+    QTimer * updatetimer;
+
+    //! True if the microcontroller is pushing status frames to us
+    bool subscribed;
+
+    //! Microcontrollers used by this program
+    QSharedPointer<MCInterface> mc;
+
+    //! Power units controlled by this program
+    QVector<QSharedPointer<PUInterfaceGUI> > pus;
+
+    //! Information about all the dimmers
+    QStandardItemModel *dimmerData;
+
+    //! Statistics for each command, for the diagnostics panel
+    QStandardItemModel *diagData;
+
+    //! Used to refresh the diagnostics panel
+    QTimer * diagtimer;
+
+    //! A request for the microcontroller's performance counters is outstanding
+    bool statspending;
+
+    //! A request for the microcontroller's mains statistics is outstanding
+    bool mainspending;
+
+    //! The last mains statistics from the microcontroller (count is zero if none)
+    MCInterface::MainsStats lastmains;
+
+    //! Converts two separate bytes into a 16 bit value and displays it on a QLCDNumber
+    double Display16BitValue(QLCDNumber * display, quint8 low, quint8 high);
+
+    //! Converts two separate bytes into a 16 bit value
+    double Convert16BitValue(quint8 low, quint8 high);
+
+    //! Resets all the displays to zero
+    void ZeroDisplays(void);
+
+    //! Formats a latency (in us) from MCInterface::LinkStats for display
+    /*!
+     *  If \p limit is true, \p us is the limit of a histogram bucket
+     *  (see MCInterface::LatencyPercentile()) and is shown as an upper
+     *  bound. A latency of -1 (longer than the histogram covers) is shown as such.
+     */
+    QString FormatLatency(qint64 us, bool limit = false);
+
+    //! Asks the microcontroller for its performance counters and displays them
+    /*!
+     *  Does nothing if it doesn't support them (FEAT_STATS). If \p reset
+     *  is true, the microcontroller clears them after sending them.
+     */
+    void UpdateMCStats(bool reset);
+
+    //! Asks the microcontroller for its mains statistics and displays the average frequency
+    /*!
+     *  Does nothing if it doesn't support them (FEAT_MAINS). If \p reset
+     *  is true, the microcontroller clears them after sending them.
+     */
+    void UpdateMains(bool reset);
+};
+
+#endif // TRIACLIGHT_H
+